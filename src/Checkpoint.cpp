@@ -0,0 +1,231 @@
+#include "Checkpoint.h"
+#include "MappedFile.h"
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#endif
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		constexpr char checkpointMagic[8] = { 'E', 'R', 'O', 'S', 'H', 'M', 'A', 'P' };
+		constexpr uint32_t checkpointVersion = 1;
+		//Keeps the payload aligned for SIMD loads once mapped
+		constexpr uint64_t payloadAlignment = 64;
+
+		static_assert(sizeof(CheckpointHeader) == 128, "the header layout is part of the file format");
+
+		void writeConfig(CheckpointHeader& header, const ErosionGenerator::Config& config)
+		{
+			header.gravity = config.gravity;
+			header.friction = config.friction;
+			header.maxDropletSteps = config.maxDropletSteps;
+			header.evaporation = config.evaporation;
+			header.erosionFactor = config.erosionFactor;
+			header.erosionRadius = config.erosionRadius;
+			header.minSlope = config.minSlope;
+			header.capacityFactor = config.capacityFactor;
+			header.depositFactor = config.depositFactor;
+			header.inertia = config.inertia;
+			header.reuseSamples = config.reuseSamples ? 1 : 0;
+		}
+
+		ErosionGenerator::Config readConfig(const CheckpointHeader& header)
+		{
+			ErosionGenerator::Config config;
+			config.gravity = header.gravity;
+			config.friction = header.friction;
+			config.maxDropletSteps = header.maxDropletSteps;
+			config.evaporation = header.evaporation;
+			config.erosionFactor = header.erosionFactor;
+			config.erosionRadius = header.erosionRadius;
+			config.minSlope = header.minSlope;
+			config.capacityFactor = header.capacityFactor;
+			config.depositFactor = header.depositFactor;
+			config.inertia = header.inertia;
+			config.reuseSamples = header.reuseSamples != 0;
+			return config;
+		}
+
+		void encodeDelta(const float* data, unsigned int width, unsigned int height, std::vector<uint8_t>& payload)
+		{
+			payload.reserve(static_cast<size_t>(width) * height * 3);
+			for (unsigned int y = 0; y < height; y++)
+			{
+				uint32_t previous = 0;
+				for (unsigned int x = 0; x < width; x++)
+				{
+					uint32_t bits;
+					std::memcpy(&bits, data + x + static_cast<size_t>(y) * width, sizeof(bits));
+					const int32_t delta = static_cast<int32_t>(bits - previous);
+					uint32_t zigzag = (static_cast<uint32_t>(delta) << 1) ^ static_cast<uint32_t>(delta >> 31);
+					previous = bits;
+
+					while (zigzag >= 0x80)
+					{
+						payload.push_back(static_cast<uint8_t>(zigzag | 0x80));
+						zigzag >>= 7;
+					}
+					payload.push_back(static_cast<uint8_t>(zigzag));
+				}
+			}
+		}
+
+		void decodeDelta(const uint8_t* payload, size_t size, unsigned int width, unsigned int height, float* data)
+		{
+			const uint8_t* end = payload + size;
+			for (unsigned int y = 0; y < height; y++)
+			{
+				uint32_t previous = 0;
+				for (unsigned int x = 0; x < width; x++)
+				{
+					uint32_t zigzag = 0;
+					for (unsigned int shift = 0; ; shift += 7)
+					{
+						if (payload == end || shift > 28)
+							throw std::runtime_error("corrupted checkpoint payload");
+						const uint8_t byte = *payload++;
+						zigzag |= static_cast<uint32_t>(byte & 0x7f) << shift;
+						if (!(byte & 0x80))
+							break;
+					}
+					const uint32_t delta = (zigzag >> 1) ^ (0u - (zigzag & 1));
+					previous += delta;
+					std::memcpy(data + x + static_cast<size_t>(y) * width, &previous, sizeof(previous));
+				}
+			}
+		}
+	}
+
+	uint64_t configHash(const ErosionGenerator::Config& config)
+	{
+		CheckpointHeader header{};
+		writeConfig(header, config);
+
+		//FNV-1a over the serialized fields, independent of the padding of Config
+		const auto first = reinterpret_cast<const uint8_t*>(&header.gravity);
+		const auto last = reinterpret_cast<const uint8_t*>(&header.reuseSamples + 1);
+		uint64_t hash = 14695981039346656037ull;
+		for (auto byte = first; byte != last; byte++)
+			hash = (hash ^ *byte) * 1099511628211ull;
+		return hash;
+	}
+
+	void saveCheckpoint(const std::string& path, const Heightmap& hmap, const SimulationState& state, CheckpointEncoding encoding)
+	{
+		CheckpointHeader header{};
+		std::memcpy(header.magic, checkpointMagic, sizeof(header.magic));
+		header.version = checkpointVersion;
+		header.width = hmap._width;
+		header.height = hmap._height;
+		header.type = CheckpointType::Float32;
+		header.encoding = encoding;
+		header.seed = state.seed;
+		header.configHash = configHash(state.config);
+		header.droplets = state.droplets;
+		header.batches = state.batches;
+		header.payloadOffset = (sizeof(CheckpointHeader) + payloadAlignment - 1) / payloadAlignment * payloadAlignment;
+		writeConfig(header, state.config);
+
+		std::vector<uint8_t> encoded;
+		const void* payload = hmap.data();
+		header.payloadSize = static_cast<uint64_t>(hmap._width) * hmap._height * sizeof(float);
+		if (encoding == CheckpointEncoding::Delta)
+		{
+			encodeDelta(hmap.data(), hmap._width, hmap._height, encoded);
+			payload = encoded.data();
+			header.payloadSize = encoded.size();
+		}
+
+		//Written next to the target and renamed, so an interrupted save never destroys the previous checkpoint
+		const std::string temporary = path + ".tmp";
+		std::unique_ptr<FILE, int(*)(FILE*)> file(std::fopen(temporary.c_str(), "wb"), &std::fclose);
+		if (!file)
+			throw std::runtime_error("could not open " + temporary);
+
+		const char padding[payloadAlignment] = {};
+		bool written = std::fwrite(&header, sizeof(header), 1, file.get()) == 1
+			&& std::fwrite(padding, 1, header.payloadOffset - sizeof(header), file.get()) == header.payloadOffset - sizeof(header)
+			&& (header.payloadSize == 0 || std::fwrite(payload, header.payloadSize, 1, file.get()) == 1)
+			&& std::fflush(file.get()) == 0;
+		written = std::fclose(file.release()) == 0 && written;
+		if (!written)
+		{
+			std::remove(temporary.c_str());
+			throw std::runtime_error("could not write " + temporary);
+		}
+
+		//Replaces the target in one step: the previous checkpoint stays in place until the new one is complete
+#ifdef _WIN32
+		const bool renamed = MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH) != 0;
+#else
+		const bool renamed = std::rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+		if (!renamed)
+		{
+			std::remove(temporary.c_str());
+			throw std::runtime_error("could not rename " + temporary + " to " + path);
+		}
+	}
+
+	Heightmap loadCheckpoint(const std::string& path, SimulationState* state)
+	{
+		auto mapping = std::make_shared<MappedFile>(path, MappedFile::Mode::CopyOnWrite);
+
+		CheckpointHeader header;
+		if (mapping->size() < sizeof(header))
+			throw std::runtime_error(path + " is not a checkpoint");
+		std::memcpy(&header, mapping->data(), sizeof(header));
+		if (std::memcmp(header.magic, checkpointMagic, sizeof(header.magic)) != 0)
+			throw std::runtime_error(path + " is not a checkpoint");
+		if (header.version != checkpointVersion || header.type != CheckpointType::Float32)
+			throw std::runtime_error(path + " uses an unsupported version or type");
+		if (header.payloadOffset < sizeof(header) || header.payloadOffset > mapping->size() || header.payloadSize > mapping->size() - header.payloadOffset)
+			throw std::runtime_error(path + " is truncated");
+
+		const ErosionGenerator::Config config = readConfig(header);
+		if (configHash(config) != header.configHash)
+			throw std::runtime_error(path + " has a corrupted configuration");
+
+		if (state)
+		{
+			state->config = config;
+			state->seed = header.seed;
+			state->droplets = header.droplets;
+			state->batches = header.batches;
+		}
+
+		//Bounded by dividing the payload, width * height * sizeof(float) can wrap around before it is compared.
+		//A raw cell takes 4 bytes, a delta cell at least one
+		const size_t cellBytes = header.encoding == CheckpointEncoding::Raw ? sizeof(float) : 1;
+		const size_t maxCells = static_cast<size_t>(header.payloadSize) / cellBytes;
+		if (header.width != 0 && header.height > maxCells / header.width)
+			throw std::runtime_error(path + " is truncated");
+
+		const size_t cells = static_cast<size_t>(header.width) * header.height;
+		uint8_t* payload = mapping->data() + header.payloadOffset;
+		switch (header.encoding)
+		{
+		case CheckpointEncoding::Raw:
+			if (header.payloadSize != cells * sizeof(float))
+				throw std::runtime_error(path + " is truncated");
+			//The map keeps the mapping alive, its writes land in private copies of the pages
+			return Heightmap::adopt(header.width, header.height, reinterpret_cast<float*>(payload), [mapping]() {});
+
+		case CheckpointEncoding::Delta:
+		{
+			Heightmap hmap(header.width, header.height);
+			decodeDelta(payload, header.payloadSize, header.width, header.height, hmap.data());
+			return hmap;
+		}
+		}
+		throw std::runtime_error(path + " uses an unknown encoding");
+	}
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include "Heightmap.h"
+#include "ErosionGenerator.h"
+
+namespace ErosionSimulation
+{
+	enum class CheckpointEncoding : uint32_t
+	{
+		//Heights stored as is, loaded by mapping the file without copy
+		Raw,
+		//Zigzag varint of the difference between the bit patterns of consecutive heights of a row, lossless and smaller on smooth maps
+		Delta
+	};
+
+	enum class CheckpointType : uint32_t
+	{
+		Float32
+	};
+
+	//Everything needed to continue a run where it stopped
+	struct SimulationState
+	{
+		ErosionGenerator::Config config;
+		//Seed of the run, droplet i spawns and draws its directions from (seed, i) whatever the batch it belongs to
+		unsigned int seed = 0;
+		//Droplets already launched and index of the next batch
+		unsigned long long droplets = 0;
+		unsigned long long batches = 0;
+	};
+
+	//Layout of the file, little endian: header, then the payload at payloadOffset
+	struct CheckpointHeader
+	{
+		char magic[8];
+		uint32_t version;
+		uint32_t width;
+		uint32_t height;
+		CheckpointType type;
+		CheckpointEncoding encoding;
+		uint32_t seed;
+		uint64_t configHash;
+		uint64_t droplets;
+		uint64_t batches;
+		uint64_t payloadOffset;
+		uint64_t payloadSize;
+		//Fields of ErosionGenerator::Config in declaration order, reuseSamples as 0 or 1
+		float gravity;
+		float friction;
+		int32_t maxDropletSteps;
+		float evaporation;
+		float erosionFactor;
+		float erosionRadius;
+		float minSlope;
+		float capacityFactor;
+		float depositFactor;
+		float inertia;
+		uint32_t reuseSamples;
+		uint32_t reserved[3];
+	};
+
+	//Hash of the parameters changing the outcome of a run, checkpoints of different configurations cannot be mixed
+	uint64_t configHash(const ErosionGenerator::Config& config);
+
+	//Throws std::runtime_error when the file cannot be written
+	void saveCheckpoint(const std::string& path, const Heightmap& hmap, const SimulationState& state, CheckpointEncoding encoding = CheckpointEncoding::Raw);
+	//Raw payloads are mapped copy-on-write: the map shares the pages of the file until it writes to them.
+	//Throws std::runtime_error when the file is missing, truncated or not a checkpoint
+	Heightmap loadCheckpoint(const std::string& path, SimulationState* state = nullptr);
+}
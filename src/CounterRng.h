@@ -0,0 +1,62 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	//Philox4x32-10 (Salmon et al., Random123): four 32 bit values that are a pure function of a 128 bit counter and a 64 bit key,
+	//so any element of a stream can be generated on any thread, in any order.
+	inline std::array<uint32_t, 4> philox4x32(std::array<uint32_t, 4> counter, uint64_t key)
+	{
+		uint32_t key0 = static_cast<uint32_t>(key);
+		uint32_t key1 = static_cast<uint32_t>(key >> 32);
+		for (int round = 0; round < 10; round++)
+		{
+			const uint64_t product0 = 0xD2511F53ull * counter[0];
+			const uint64_t product1 = 0xCD9E8D57ull * counter[2];
+			counter = { static_cast<uint32_t>(product1 >> 32) ^ counter[1] ^ key0, static_cast<uint32_t>(product1),
+				static_cast<uint32_t>(product0 >> 32) ^ counter[3] ^ key1, static_cast<uint32_t>(product0) };
+			key0 += 0x9E3779B9u;
+			key1 += 0xBB67AE85u;
+		}
+		return counter;
+	}
+
+	//Uniform in [0, 1) from the 24 high bits
+	inline float unitFloat(uint32_t bits)
+	{
+		return static_cast<float>(bits >> 8) * (1.f / 16777216.f);
+	}
+
+	//Random direction component in [-1, 1), advancing a per droplet xorshift state that must not be 0
+	inline float randomDirection(uint32_t& state)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		return static_cast<float>(state >> 8) * (1.f / 8388608.f) - 1.f;
+	}
+
+	//Spawn points in [areaMin, areaMax) and direction states of droplets first to first + count - 1 of a stream.
+	//Droplet i only depends on (seed, stream, i); the loop has no dependency between droplets and is vectorized by the compiler.
+	inline void generateDroplets(uint64_t seed, uint32_t stream, uint64_t first, unsigned int count, point2f areaMin, point2f areaMax,
+		point2f* starts, uint32_t* directionStates)
+	{
+		const float spanX = areaMax.x - areaMin.x;
+		const float spanY = areaMax.y - areaMin.y;
+		//Rounding may reach the upper bound, which is outside the area
+		const float lastX = std::nextafter(areaMax.x, areaMin.x);
+		const float lastY = std::nextafter(areaMax.y, areaMin.y);
+		for (unsigned int i = 0; i < count; i++)
+		{
+			const uint64_t index = first + i;
+			const auto bits = philox4x32({ static_cast<uint32_t>(index), static_cast<uint32_t>(index >> 32), stream, 0x45524f53u }, seed);
+			starts[i] = { std::min(areaMin.x + unitFloat(bits[0]) * spanX, lastX), std::min(areaMin.y + unitFloat(bits[1]) * spanY, lastY) };
+			directionStates[i] = bits[2] | 1u;
+		}
+	}
+}
@@ -0,0 +1,528 @@
+// ErosionBenchmark.cpp : measures the droplet throughput of the erosion engines.
+//
+
+#include "ErosionGenerator.h"
+#include "HeightSampler.h"
+#include "WavefrontDroplets.h"
+#include "MeshExporter.h"
+#include "PipeErosion.h"
+#include "GradientField.h"
+#include "TrajectoryRecorder.h"
+#include "HeightStorage.h"
+#include "TiledHeightmap.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iostream>
+#include <iomanip>
+#include <mutex>
+#include <string>
+#include <random>
+#include <omp.h>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <stdexcept>
+
+using namespace ErosionSimulation;
+
+void benchmarkParallelScaling(unsigned int size, unsigned int droplets)
+{
+	std::cout << "Parallel droplets scaling (" << size << "x" << size << ", " << droplets << " droplets)\n";
+
+	ErosionGenerator erosionGenerator{};
+	std::cout << "tile size " << erosionGenerator.parallelTileSize()
+		<< (erosionGenerator.parallelTiles(size, size) ? "" : ", no two tiles per phase: every thread count runs serially") << "\n";
+	std::cout << "threads\tseconds\tdroplets/s\tspeedup\n";
+
+	double reference = 0.;
+	const int maxThreads = omp_get_max_threads();
+	for (int threads = 1; threads <= maxThreads; threads++)
+	{
+		Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+
+		const auto start = std::chrono::steady_clock::now();
+		DropletOptions options;
+		options.threads = threads;
+		erosionGenerator.launchDroplets(hmap, droplets, 0, options);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		const double dropletsPerSecond = droplets / elapsed.count();
+		if (threads == 1)
+			reference = dropletsPerSecond;
+
+		std::cout << threads << "\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t"
+			<< std::setprecision(0) << dropletsPerSecond << "\t"
+			<< std::setprecision(2) << dropletsPerSecond / reference << "\n";
+	}
+}
+
+template<typename Step>
+double nanosecondsPerStep(const std::vector<point2f>& points, Step step)
+{
+	float checksum = 0.f;
+	const auto start = std::chrono::steady_clock::now();
+	for (size_t i = 0; i + 1 < points.size(); i++)
+		checksum += step(points[i], points[i + 1]);
+	const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+
+	//keeps the samples alive
+	if (checksum == 0.1234f)
+		std::cout << checksum;
+	return elapsed.count() / (points.size() - 1);
+}
+
+void benchmarkSampler(unsigned int size)
+{
+	std::cout << "Height sampling per droplet step (" << size << "x" << size << ")\n";
+
+	ErosionGenerator erosionGenerator{};
+	const Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+
+	//random walk with unit steps, like a droplet
+	std::default_random_engine engine(0);
+	std::uniform_real_distribution<float> angle(0.f, 6.2831853f);
+	std::vector<point2f> points(1 << 22);
+	point2f point = { size / 2.f, size / 2.f };
+	for (auto& p : points)
+	{
+		const float a = angle(engine);
+		point = { point.x + std::cos(a), point.y + std::sin(a) };
+		if (point.x < 0 || point.x >= size || point.y < 0 || point.y >= size)
+			point = { size / 2.f, size / 2.f };
+		p = point;
+	}
+
+	const double legacy = nanosecondsPerStep(points, [&](const point2f& current, const point2f& next)
+		{
+			const auto local_height = bilinearInterp<1>(hmap._data, hmap._width, hmap._height, current);
+			const auto gradient = erosionGenerator.computeGradient(hmap, current);
+			const auto new_height = bilinearInterp<1>(hmap._data, hmap._width, hmap._height, next);
+			return new_height[0] - local_height[0] + gradient[0] + gradient[1];
+		});
+
+	const double fused = nanosecondsPerStep(points, [&](const point2f& current, const point2f& next)
+		{
+			const auto local = sampleHeightGradient(hmap, current);
+			const auto new_height = bilinearInterp<1>(hmap._data, hmap._width, hmap._height, next);
+			return new_height[0] - local.height + local.gradient_x + local.gradient_y;
+		});
+
+	float previous_height = 0.f;
+	const double reused = nanosecondsPerStep(points, [&](const point2f&, const point2f& next)
+		{
+			const auto sample = sampleHeightGradient(hmap, next);
+			const float hdiff = sample.height - previous_height;
+			previous_height = sample.height;
+			return hdiff + sample.gradient_x + sample.gradient_y;
+		});
+
+	std::cout << "sampler\tns/step\n" << std::fixed << std::setprecision(2)
+		<< "5 bilinear\t" << legacy << "\n"
+		<< "fused\t" << fused << "\n"
+		<< "fused + reuse\t" << reused << "\n";
+}
+
+void benchmarkEngines(unsigned int size, unsigned int droplets)
+{
+	std::cout << "Droplet engines on one thread (" << size << "x" << size << ", " << droplets << " droplets)\n";
+	std::cout << "engine\tseconds\tdroplets/s\tsteps/droplet\tidentical to wavefront scalar\n";
+
+	ErosionGenerator erosionGenerator{};
+	Heightmap scalarReference;
+	const std::pair<DropletEngine, const char*> engines[] = {
+		{ DropletEngine::Sequential, "sequential" },
+		{ DropletEngine::WavefrontScalar, "wavefront scalar" },
+		{ DropletEngine::Wavefront, WavefrontSimulator::avx2Supported() ? "wavefront avx2" : "wavefront (no avx2)" } };
+
+	for (const auto& [engine, name] : engines)
+	{
+		Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+
+		DropletOptions options;
+		options.engine = engine;
+		const auto start = std::chrono::steady_clock::now();
+		const auto stats = erosionGenerator.launchDroplets(hmap, droplets, 0, options);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		//Both wavefront kernels must give the same map bit for bit, whatever the CPU
+		if (engine == DropletEngine::WavefrontScalar)
+			scalarReference = hmap;
+		const char* identical = engine == DropletEngine::Sequential ? "-" :
+			std::equal(hmap._data, hmap._data + static_cast<size_t>(size) * size, scalarReference._data) ? "yes" : "no";
+
+		std::cout << name << "\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t"
+			<< std::setprecision(0) << droplets / elapsed.count() << "\t"
+			<< std::setprecision(1) << static_cast<double>(stats.steps) / stats.droplets << "\t" << identical << "\n";
+	}
+}
+
+void benchmarkPipes(unsigned int size, unsigned int iterations)
+{
+	std::cout << "Virtual pipes solver (" << size << "x" << size << ", " << iterations << " iterations)\n";
+	std::cout << "threads\tseconds\train\tflux\ttransport\twater\terosion\tevaporation\tidentical\n";
+
+	ErosionGenerator erosionGenerator{};
+	const Heightmap initial = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+	Heightmap reference;
+
+	for (int threads = 1; threads <= omp_get_max_threads(); threads *= 2)
+	{
+		Heightmap hmap = initial;
+		PipeErosion pipes;
+		pipes.run(hmap, iterations, threads);
+		if (threads == 1)
+			reference = hmap;
+
+		const auto& timings = pipes.timings();
+		std::cout << threads << "\t" << std::fixed << std::setprecision(3) << timings.total() << "\t" << timings.rain << "\t" << timings.flux << "\t"
+			<< timings.transport << "\t" << timings.water << "\t" << timings.erosion << "\t" << timings.evaporation << "\t"
+			<< (std::equal(hmap.data(), hmap.data() + static_cast<size_t>(size) * size, reference.data()) ? "yes" : "no") << "\n";
+	}
+}
+
+void benchmarkGeneration(unsigned int size)
+{
+	std::cout << "Terrain generation (" << size << "x" << size << ")\n";
+	std::cout << "graph\tthreads\tseconds\tcached\n";
+
+	TerrainGenerator::Config fbm;
+	fbm.octaves = 6;
+	TerrainGenerator::Config warped = fbm;
+	warped.warpAmplitude = 30.f;
+	const std::pair<TerrainGenerator::Config, std::string> graphs[] = { { {}, "simplex" }, { fbm, "fbm6" }, { warped, "fbm6+warp" } };
+
+	for (const auto& [config, name] : graphs)
+	{
+		for (int threads = 1; threads <= omp_get_max_threads(); threads *= 2)
+		{
+			TerrainGenerator generator(config);
+			const auto start = std::chrono::steady_clock::now();
+			generator.generate(size, size, 75.f, 0, threads);
+			const auto generated = std::chrono::steady_clock::now();
+			//Same parameters, answered by the cache
+			generator.generate(size, size, 75.f, 0, threads);
+			const std::chrono::duration<double> elapsed = generated - start;
+			const std::chrono::duration<double> cached = std::chrono::steady_clock::now() - generated;
+
+			std::cout << name << "\t" << threads << "\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t"
+				<< std::setprecision(6) << cached.count() << "\n";
+		}
+	}
+}
+
+void benchmarkGradient(unsigned int size)
+{
+	std::cout << "Gradient field (" << size << "x" << size << ")\n";
+	std::cout << "method\tms\n";
+
+	ErosionGenerator erosionGenerator{};
+	Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+	const int repeats = 10;
+	auto time = [&](const std::string& name, auto&& run)
+	{
+		run();
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeats; i++)
+			run();
+		const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		std::cout << name << "\t" << std::fixed << std::setprecision(3) << elapsed.count() / repeats << "\n";
+	};
+
+	//Allocates its result on every call
+	time("heightmap", [&]() { volatile float sink = hmap.computeGradient()[0]; (void)sink; });
+
+	std::vector<float> gradientX(static_cast<size_t>(size) * size);
+	std::vector<float> gradientY(gradientX.size());
+	const DirtyRect all = { 0, 0, size, size };
+	time("central", [&]() { computeGradient(hmap, GradientKernel::CentralDifference, all, gradientX, gradientY); });
+	time("sobel", [&]() { computeGradient(hmap, GradientKernel::Sobel, all, gradientX, gradientY); });
+
+	std::vector<float> normals(3 * gradientX.size());
+	time("normals", [&]() { computeNormals(hmap, GradientKernel::CentralDifference, all, normals); });
+
+	GradientField field;
+	field.update(hmap);
+	time("unchanged", [&]() { field.update(hmap); });
+	//A single brush stroke sized edit between updates
+	time("one block", [&]()
+	{
+		hmap.beginModification();
+		hmap.at(size / 2, size / 2) += 0.1f;
+		hmap.markDirty(size / 2, size / 2, size / 2 + 1, size / 2 + 1);
+		field.update(hmap);
+	});
+}
+
+//One heap vector per droplet, as the trajectories were stored before the recorder
+class VectorTrajectorySink : public TrajectorySink
+{
+public:
+	void record(const point2f* points, unsigned int count) override
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		trajectories.emplace_back(points, points + count);
+	}
+
+	std::vector<std::vector<point2f>> trajectories;
+
+private:
+	std::mutex _mutex;
+};
+
+void benchmarkTrajectories(unsigned int size, unsigned int droplets)
+{
+	std::cout << "Trajectory recording (" << size << "x" << size << ", " << droplets << " droplets)\n";
+	std::cout << "sink\tseconds\tkept\tMB\n";
+
+	ErosionGenerator erosionGenerator{};
+	DropletOptions options;
+	options.threads = 0;
+
+	{
+		Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+		VectorTrajectorySink sink;
+		options.trajectorySink = &sink;
+		const auto start = std::chrono::steady_clock::now();
+		erosionGenerator.launchDroplets(hmap, droplets, 0, options);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		size_t bytes = sink.trajectories.capacity() * sizeof(std::vector<point2f>);
+		for (const auto& trajectory : sink.trajectories)
+			bytes += trajectory.capacity() * sizeof(point2f);
+		std::cout << "vectors\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t" << sink.trajectories.size() << "\t"
+			<< std::setprecision(1) << bytes / 1e6 << "\n";
+	}
+
+	TrajectoryRecorder::Config sparse;
+	sparse.dropletStride = 16;
+	sparse.stepStride = 4;
+	const std::pair<TrajectoryRecorder::Config, std::string> configs[] = { { {}, "ring" }, { sparse, "ring 1/16 1/4" } };
+	for (const auto& [config, name] : configs)
+	{
+		Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+		TrajectoryRecorder recorder(config);
+		options.trajectorySink = &recorder;
+		const auto start = std::chrono::steady_clock::now();
+		erosionGenerator.launchDroplets(hmap, droplets, 0, options);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << name << "\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t" << recorder.size() << "\t"
+			<< std::setprecision(1) << recorder.bytes() / 1e6 << "\n";
+	}
+
+	//Every droplet, as densities instead of points
+	{
+		Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+		FlowMap flow(size, size);
+		options.trajectorySink = nullptr;
+		options.flowMap = &flow;
+		const auto start = std::chrono::steady_clock::now();
+		erosionGenerator.launchDroplets(hmap, droplets, 0, options);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+		std::cout << "flow map\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t" << droplets << "\t"
+			<< std::setprecision(1) << static_cast<double>(size) * size * sizeof(FlowMap::Cell) / 1e6 << "\n";
+	}
+}
+
+void benchmarkPrecision(unsigned int size, unsigned int droplets)
+{
+	std::cout << "Height storage (" << size << "x" << size << ", " << droplets << " droplets out of core)\n";
+	std::cout << "format\tMB\tpack ms\tunpack ms\tmax error\tgradient ms\tgradient error\terosion s\terosion rms\n";
+
+	ErosionGenerator erosionGenerator{};
+	const Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+	const size_t cells = static_cast<size_t>(size) * size;
+	const DirtyRect all = { 0, 0, size, size };
+	const int repeats = 10;
+	auto milliseconds = [&](auto&& run)
+	{
+		run();
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < repeats; i++)
+			run();
+		const std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+		return elapsed.count() / repeats;
+	};
+	auto maxError = [&](const float* a, const float* b)
+	{
+		float error = 0.f;
+		for (size_t i = 0; i < cells; i++)
+			error = std::max(error, std::abs(a[i] - b[i]));
+		return error;
+	};
+
+	std::vector<float> referenceX(cells), referenceY(cells);
+	computeGradient(hmap, GradientKernel::CentralDifference, all, referenceX, referenceY);
+	const double referenceGradient = milliseconds([&]() { computeGradient(hmap, GradientKernel::CentralDifference, all, referenceX, referenceY); });
+
+	//Same seed and tiling for every format, so the deviation from float32 tiles is only the rounding of the stored heights.
+	//The uint16 range is the generated one widened by a quarter of its span on each side, erosion digs below the lowest height and deposits above the highest
+	const HeightRange generated = reduceMinMax(hmap);
+	const float margin = std::max(0.25f * (generated.max - generated.min), 1.f);
+	const HeightRange tileRange = { generated.min - margin, generated.max + margin };
+	const auto directory = std::filesystem::temp_directory_path() / "erosion_precision_benchmark";
+	DropletOptions options;
+	options.threads = 0;
+	Heightmap erodedReference;
+	auto erodeTiles = [&](HeightFormat format, Heightmap& eroded)
+	{
+		std::filesystem::remove_all(directory);
+		auto tiles = TiledHeightmap::create(directory.string(), size, size, 512, 64, format, tileRange);
+		tiles->write(0, 0, hmap);
+		const auto start = std::chrono::steady_clock::now();
+		erosionGenerator.launchDroplets(*tiles, droplets, 0, options);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		eroded = Heightmap(size, size);
+		tiles->read(0, 0, eroded);
+		tiles.reset();
+		std::filesystem::remove_all(directory);
+		return elapsed.count();
+	};
+	const double referenceErosion = erodeTiles(HeightFormat::Float32, erodedReference);
+	std::cout << "f32\t" << std::fixed << std::setprecision(1) << cells * sizeof(float) / 1e6 << "\t-\t-\t0\t"
+		<< std::setprecision(3) << referenceGradient << "\t0\t" << referenceErosion << "\t0\n";
+
+	auto run = [&]<class Storage>(const std::string& name, Storage)
+	{
+		PackedHeightmap<Storage> packed(hmap);
+		const double pack = milliseconds([&]() { packed = PackedHeightmap<Storage>(hmap, packed.range()); });
+		Heightmap unpacked;
+		const double unpack = milliseconds([&]() { unpacked = packed.unpack(); });
+
+		std::vector<float> gradientX(cells), gradientY(cells);
+		const double gradient = milliseconds([&]() { computeGradient(packed, GradientKernel::CentralDifference, all, gradientX, gradientY); });
+		const float gradientError = std::max(maxError(gradientX.data(), referenceX.data()), maxError(gradientY.data(), referenceY.data()));
+
+		Heightmap eroded;
+		const double erosion = erodeTiles(Storage::format, eroded);
+		double squares = 0.;
+		for (size_t i = 0; i < cells; i++)
+			squares += static_cast<double>(eroded._data[i] - erodedReference._data[i]) * (eroded._data[i] - erodedReference._data[i]);
+
+		std::cout << name << "\t" << std::fixed << std::setprecision(1) << packed.bytes() / 1e6 << "\t" << std::setprecision(3) << pack << "\t" << unpack << "\t"
+			<< std::setprecision(6) << maxError(unpacked._data, hmap._data) << "\t" << std::setprecision(3) << gradient << "\t"
+			<< std::setprecision(6) << gradientError << "\t" << std::setprecision(3) << erosion << "\t"
+			<< std::setprecision(6) << std::sqrt(squares / cells) << "\n";
+	};
+	run("f16", Float16Storage{});
+	run("u16", UNorm16Storage{});
+}
+
+void benchmarkExport(unsigned int size)
+{
+	std::cout << "Mesh export (" << size << "x" << size << ")\n";
+	std::cout << "format\tseconds\tMB\tMB/s\n";
+
+	ErosionGenerator erosionGenerator{};
+	const Heightmap hmap = erosionGenerator.generateNoisyTerrain(size, size, 75.f);
+	const std::pair<MeshFormat, std::string> formats[] = { { MeshFormat::Obj, "obj" }, { MeshFormat::Ply, "ply" }, { MeshFormat::Glb, "glb" } };
+
+	for (const auto& [format, name] : formats)
+	{
+		const std::string path = "export_benchmark." + name;
+		const auto start = std::chrono::steady_clock::now();
+		const size_t bytes = exportMesh(hmap, path, format);
+		const std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		std::remove(path.c_str());
+
+		std::cout << name << "\t" << std::fixed << std::setprecision(3) << elapsed.count() << "\t"
+			<< std::setprecision(1) << bytes / 1e6 << "\t" << bytes / 1e6 / elapsed.count() << "\n";
+	}
+}
+
+namespace
+{
+	struct Arguments
+	{
+		unsigned int size = 2048;
+		unsigned int droplets = 1U << 20;
+	};
+
+	void printUsage()
+	{
+		std::cout << "usage: ErosionBenchmark [--size N] [--droplets N]\n"
+			<< "  --size is the side of the square maps, 2048 by default\n"
+			<< "  --droplets is the number of droplets of the droplet benchmarks, 2^20 by default\n";
+	}
+
+	unsigned int parseCount(const std::string& name, const std::string& value)
+	{
+		size_t parsed = 0;
+		unsigned long count = 0;
+		try
+		{
+			count = std::stoul(value, &parsed);
+		}
+		catch (const std::logic_error&)
+		{
+			parsed = 0;
+		}
+		if (parsed != value.size() || value[0] == '-' || count == 0 || count > std::numeric_limits<unsigned int>::max())
+			throw std::runtime_error("invalid value for " + name + ": " + value);
+		return static_cast<unsigned int>(count);
+	}
+
+	Arguments parseArguments(int argc, char** argv)
+	{
+		Arguments arguments;
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string name = argv[i];
+			if (name == "--help" || name == "-h")
+			{
+				printUsage();
+				std::exit(0);
+			}
+			if (name != "--size" && name != "--droplets")
+				throw std::runtime_error("unknown argument " + name);
+			if (i + 1 >= argc)
+				throw std::runtime_error("missing value for " + name);
+
+			const std::string value = argv[++i];
+			if (name == "--size")
+				arguments.size = parseCount(name, value);
+			else
+				arguments.droplets = parseCount(name, value);
+		}
+		return arguments;
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		const Arguments arguments = parseArguments(argc, argv);
+		const unsigned int size = arguments.size;
+		const unsigned int droplets = arguments.droplets;
+
+		benchmarkSampler(size);
+		std::cout << "\n";
+		benchmarkEngines(size, droplets);
+		std::cout << "\n";
+		benchmarkParallelScaling(size, droplets);
+		std::cout << "\n";
+		benchmarkPipes(size, 100);
+		std::cout << "\n";
+		benchmarkGeneration(size);
+		std::cout << "\n";
+		benchmarkGradient(size);
+		std::cout << "\n";
+		benchmarkTrajectories(size, droplets);
+		std::cout << "\n";
+		benchmarkPrecision(size, droplets);
+		std::cout << "\n";
+		benchmarkExport(size);
+		return 0;
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "error: " << e.what() << "\n";
+		printUsage();
+		return 1;
+	}
+}
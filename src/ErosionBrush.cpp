@@ -0,0 +1,135 @@
+#include "ErosionBrush.h"
+#include <algorithm>
+#include <cmath>
+
+namespace ErosionSimulation
+{
+	ErosionBrush::ErosionBrush(float radius) :
+		_radius(radius),
+		_extent(static_cast<int>(std::ceil(radius)))
+	{
+		//Cone of weights centered on a cell, normalized so the whole disc removes exactly the requested amount
+		const int extent = _extent;
+		float total = 0.f;
+		for (int dy = -extent; dy <= extent; dy++)
+		{
+			Span span{ dy, 0, 0, static_cast<unsigned int>(_weights.size()) };
+			for (int dx = -extent; dx <= extent; dx++)
+			{
+				const float distance = std::sqrt(static_cast<float>(dx * dx + dy * dy));
+				if (distance >= radius)
+				{
+					if (span.length > 0)
+						break;
+					continue;
+				}
+
+				if (span.length == 0)
+					span.dx = dx;
+				span.length++;
+				_weights.push_back(radius - distance);
+				total += radius - distance;
+			}
+
+			if (span.length > 0)
+				_spans.push_back(span);
+		}
+
+		if (_spans.empty())
+		{
+			_spans.push_back({ 0, 0, 1, 0 });
+			_weights.push_back(1.f);
+			total = 1.f;
+		}
+
+		for (auto& w : _weights)
+			w /= total;
+	}
+
+	float ErosionBrush::apply(Heightmap& hmap, const point2f& point, float weight) const
+	{
+		const int width = static_cast<int>(hmap._width);
+		const int height = static_cast<int>(hmap._height);
+		const int center_x = static_cast<int>(std::floor(point.x + 0.5f));
+		const int center_y = static_cast<int>(std::floor(point.y + 0.5f));
+		hmap.markDirty(center_x - _extent, center_y - _extent, center_x + _extent + 1, center_y + _extent + 1);
+
+		float* const data = hmap.data();
+		float total_sediment = 0.f;
+		for (const auto& span : _spans)
+		{
+			const int y = center_y + span.dy;
+			if (y < 0 || y >= height)
+				continue;
+
+			const int x_start = center_x + span.dx;
+			const int first = std::max(x_start, 0);
+			const int last = std::min(x_start + span.length, width);
+			if (first >= last)
+				continue;
+
+			float* row = data + static_cast<size_t>(y) * width + first;
+			const float* weights = _weights.data() + span.offset + (first - x_start);
+			const int count = last - first;
+
+			float row_sediment = 0.f;
+#pragma omp simd reduction(+:row_sediment)
+			for (int i = 0; i < count; i++)
+			{
+				const float erosionValue = weights[i] * weight;
+				row[i] -= erosionValue;
+				row_sediment += erosionValue;
+			}
+			total_sediment += row_sediment;
+		}
+		return total_sediment;
+	}
+
+	float deposit(Heightmap& hmap, const point2f& point, float weight, float max)
+	{	
+		if (weight < 1e-5)
+			return 0.f;
+
+		float deposited = 0.f;
+		const int x = static_cast<unsigned int>(point.x);
+		const int y = static_cast<unsigned int>(point.y);
+
+		hmap.markDirty(x - 1, y - 1, x + 2, y + 2);
+		const int width = static_cast<int>(hmap._width);
+		const int height = static_cast<int>(hmap._height);
+		float* const cell = hmap.data() + static_cast<size_t>(y) * width + x;
+
+		const float x_remain = point.x - x - 0.5;
+		const float y_remain = point.y - y - 0.5;
+
+		float value = std::min(weight * (1 - std::abs(x_remain)) * (1 - std::abs(y_remain)), max);
+		deposited += value;
+		cell[0] += value;
+		if (x + 1 < width)
+		{
+			value = std::min(weight * std::max(0.f, x_remain) * (1 - std::abs(y_remain)), max);
+			deposited += value;
+			cell[1] += value;
+		}
+		if (x - 1 >= 0)
+		{
+			value = std::min(weight * std::max(0.f, -x_remain) * (1 - std::abs(y_remain)), max);
+			deposited += value;
+			cell[-1] += value;
+		}
+		if (y + 1 < height)
+		{
+			value = std::min(weight * (1 - std::abs(x_remain)) * std::max(0.f, y_remain), max);
+			deposited += value;
+			cell[width] += value;
+		}
+
+		if (y - 1 >= 0)
+		{
+			value = std::min(weight * (1 - std::abs(x_remain)) * std::max(0.f, -y_remain), max);
+			deposited += value;
+			cell[-width] += value;
+		}
+		return deposited;
+	}
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include <vector>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	//Disc of erosion weights precomputed for a radius, stored as contiguous row spans
+	class ErosionBrush
+	{
+	public:
+		ErosionBrush(float radius);
+
+		float radius() const { return _radius; }
+
+		//Removes weight from the map spread over the disc centered on point, clipped to the map, marks the disc dirty and returns the removed amount
+		float apply(Heightmap& hmap, const point2f& point, float weight) const;
+
+	private:
+		struct Span
+		{
+			int dy;
+			int dx;
+			int length;
+			unsigned int offset;
+		};
+
+		float _radius;
+		int _extent;
+		std::vector<Span> _spans;
+		std::vector<float> _weights;
+	};
+
+	//Adds weight around point, split between its cell and the 4 neighbours and capped to max per cell, marks them dirty and returns the added amount
+	float deposit(Heightmap& hmap, const point2f& point, float weight, float max);
+}
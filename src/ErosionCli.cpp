@@ -0,0 +1,485 @@
+// ErosionCli.cpp : headless entry point, generates a terrain, erodes it and reports the throughput.
+//
+
+#include "ErosionGenerator.h"
+#include "Instrumentation.h"
+#include "Checkpoint.h"
+#include "MeshExporter.h"
+#include "FlowMap.h"
+#include "TiledHeightmap.h"
+#include "HeightStorage.h"
+#include "PipeErosion.h"
+#include "ThermalErosion.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iomanip>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+
+using namespace ErosionSimulation;
+
+namespace
+{
+	struct Arguments
+	{
+		unsigned int size = 512;
+		unsigned int droplets = 1U << 20;
+		unsigned int seed = 0;
+		int threads = 0;
+		DropletEngine engine = DropletEngine::Sequential;
+		//Grid solver instead of droplets
+		bool pipes = false;
+		unsigned int iterations = 1000;
+		unsigned int thermalIterations = 0;
+		std::string config;
+		std::string out;
+		std::string stats;
+		std::string flow;
+		//Of the tiles and of the raw output
+		HeightFormat precision = HeightFormat::Float32;
+		std::string checkpoint;
+		unsigned int checkpointEvery = 0;
+		std::string resume;
+		std::string tiles;
+		unsigned int tileSize = 1024;
+		unsigned int levels = 1;
+		TerrainGenerator::Config terrain;
+		//Adaptive budget when > 0, --droplets is then the maximum
+		double converge = 0.;
+		double timeBudget = 0.;
+	};
+
+	//Droplets launched per call, a multiple of ErosionGenerator::tiledRoundSize so the batches do not change the map
+	constexpr unsigned int batchSize = 1U << 14;
+	static_assert(batchSize % ErosionGenerator::tiledRoundSize == 0, "batches must not split the rounds of the tiled engine");
+
+	void printUsage()
+	{
+		std::cout << "usage: ErosionCli [--size N] [--droplets N] [--seed N] [--threads N] [--engine seq|wave|scalar|pipes] [--config FILE] [--out FILE]\n"
+			<< "                  [--checkpoint FILE] [--checkpoint-every N] [--resume FILE] [--tiles DIR] [--tile-size N]\n"
+			<< "                  [--levels N] [--iterations N] [--thermal N] [--stats FILE] [--converge RMS] [--time-budget S]\n"
+			<< "                  [--octaves N] [--warp A] [--flow FILE] [--precision f32|f16|u16]\n"
+			<< "  --threads 0 uses all cores, 1 runs the droplets serially. Droplets always run serially on maps of 3 droplet tiles or less per axis\n"
+			<< "            (a tile is maxDropletSteps + erosionRadius + 3 cells, below 1024x1024 with the default config)\n"
+			<< "  --checkpoint saves the map and run state at the end, and every N droplets with --checkpoint-every\n"
+			<< "  --resume continues a checkpointed run up to --droplets droplets in total, with its map, seed and configuration\n"
+			<< "  --config reads 'name = value' lines named after the fields of ErosionGenerator::Config, '#' starts a comment\n"
+			<< "  --engine pipes runs --iterations time steps of the virtual pipes grid solver instead of droplets\n"
+			<< "  --thermal N runs N talus relaxation iterations after the erosion\n"
+			<< "  --levels N erodes coarse-to-fine on a pyramid of N levels, in a single batch\n"
+			<< "  --octaves sums N fBm octaves of noise for the terrain, --warp displaces it with a domain warp of amplitude A\n"
+			<< "  --converge launches batches until one changes the map by less than RMS per cell, or --droplets or --time-budget seconds are reached\n"
+			<< "  --stats writes the droplet statistics as JSON, with counters and histograms in builds with EROSION_INSTRUMENTATION\n"
+			<< "  --flow writes the droplet visits, carried sediment and water volume per cell of this run as the RGB channels of a PFM float image\n"
+			<< "  --tiles erodes out of core, with the map stored in DIR as tiles of --tile-size cells\n"
+			<< "  --out writes the eroded map as a mesh for .obj, .ply, .glb and .gltf, otherwise as raw little endian heights of --precision, row major\n"
+			<< "  --precision stores the raw output and the tiles as float32, float16 or uint16 normalized over the range of the heights\n";
+	}
+
+	Arguments parseArguments(int argc, char** argv)
+	{
+		Arguments arguments;
+		for (int i = 1; i < argc; i++)
+		{
+			const std::string name = argv[i];
+			if (name == "--help" || name == "-h")
+			{
+				printUsage();
+				std::exit(0);
+			}
+			if (i + 1 >= argc)
+				throw std::runtime_error("missing value for " + name);
+
+			const std::string value = argv[++i];
+			if (name == "--size")
+				arguments.size = std::stoul(value);
+			else if (name == "--droplets")
+				arguments.droplets = std::stoul(value);
+			else if (name == "--seed")
+				arguments.seed = std::stoul(value);
+			else if (name == "--threads")
+				arguments.threads = std::stoi(value);
+			else if (name == "--config")
+				arguments.config = value;
+			else if (name == "--out")
+				arguments.out = value;
+			else if (name == "--octaves")
+				arguments.terrain.octaves = std::stoi(value);
+			else if (name == "--warp")
+				arguments.terrain.warpAmplitude = std::stof(value);
+			else if (name == "--converge")
+				arguments.converge = std::stod(value);
+			else if (name == "--time-budget")
+				arguments.timeBudget = std::stod(value);
+			else if (name == "--stats")
+				arguments.stats = value;
+			else if (name == "--flow")
+				arguments.flow = value;
+			else if (name == "--precision")
+				arguments.precision = heightFormatFromName(value);
+			else if (name == "--checkpoint")
+				arguments.checkpoint = value;
+			else if (name == "--checkpoint-every")
+				arguments.checkpointEvery = std::stoul(value);
+			else if (name == "--resume")
+				arguments.resume = value;
+			else if (name == "--tiles")
+				arguments.tiles = value;
+			else if (name == "--tile-size")
+				arguments.tileSize = std::stoul(value);
+			else if (name == "--levels")
+				arguments.levels = std::stoul(value);
+			else if (name == "--iterations")
+				arguments.iterations = std::stoul(value);
+			else if (name == "--thermal")
+				arguments.thermalIterations = std::stoul(value);
+			else if (name == "--engine")
+			{
+				if (value == "seq")
+					arguments.engine = DropletEngine::Sequential;
+				else if (value == "wave")
+					arguments.engine = DropletEngine::Wavefront;
+				else if (value == "scalar")
+					arguments.engine = DropletEngine::WavefrontScalar;
+				else if (value == "pipes")
+					arguments.pipes = true;
+				else
+					throw std::runtime_error("unknown engine " + value);
+			}
+			else
+				throw std::runtime_error("unknown option " + name);
+		}
+		return arguments;
+	}
+
+	ErosionGenerator::Config loadConfig(const std::string& path)
+	{
+		std::ifstream file(path);
+		if (!file.is_open())
+			throw std::runtime_error("could not open " + path);
+
+		ErosionGenerator::Config config;
+		std::string line;
+		unsigned int lineNumber = 0;
+		while (std::getline(file, line))
+		{
+			lineNumber++;
+			line = line.substr(0, line.find('#'));
+			const auto separator = line.find('=');
+			if (separator == std::string::npos)
+			{
+				if (line.find_first_not_of(" \t\r") != std::string::npos)
+					throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": expected 'name = value'");
+				continue;
+			}
+
+			std::string name;
+			std::istringstream(line.substr(0, separator)) >> name;
+			std::istringstream value(line.substr(separator + 1));
+			if (name == "gravity") value >> config.gravity;
+			else if (name == "friction") value >> config.friction;
+			else if (name == "maxDropletSteps") value >> config.maxDropletSteps;
+			else if (name == "evaporation") value >> config.evaporation;
+			else if (name == "erosionFactor") value >> config.erosionFactor;
+			else if (name == "erosionRadius") value >> config.erosionRadius;
+			else if (name == "minSlope") value >> config.minSlope;
+			else if (name == "capacityFactor") value >> config.capacityFactor;
+			else if (name == "depositFactor") value >> config.depositFactor;
+			else if (name == "inertia") value >> config.inertia;
+			else if (name == "reuseSamples") value >> std::boolalpha >> config.reuseSamples;
+			else
+				throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": unknown parameter " + name);
+
+			if (value.fail())
+				throw std::runtime_error(path + ":" + std::to_string(lineNumber) + ": invalid value for " + name);
+		}
+		return config;
+	}
+
+	void writeRaw(const Heightmap& hmap, const std::string& path, HeightFormat format)
+	{
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open())
+			throw std::runtime_error("could not open " + path);
+		if (format == HeightFormat::Float32)
+		{
+			file.write(reinterpret_cast<const char*>(hmap.data()), static_cast<std::streamsize>(hmap._width) * hmap._height * sizeof(float));
+			return;
+		}
+
+		//The normalization range is not in the file, it is printed instead
+		const HeightRange range = format == HeightFormat::UNorm16 && hmap._width > 0 && hmap._height > 0 ? reduceMinMax(hmap) : HeightRange{ 0.f, 1.f };
+		if (format == HeightFormat::UNorm16)
+			std::cout << std::setprecision(6) << "range\t" << range.min << " " << range.max << "\n";
+		std::vector<uint16_t> row(hmap._width);
+		for (unsigned int y = 0; y < hmap._height; y++)
+		{
+			encodeHeights(format, hmap._data + static_cast<size_t>(y) * hmap._width, row.data(), hmap._width, range);
+			file.write(reinterpret_cast<const char*>(row.data()), static_cast<std::streamsize>(row.size() * sizeof(uint16_t)));
+		}
+	}
+
+	void writeOutput(const Heightmap& hmap, const std::string& path, HeightFormat format)
+	{
+		const auto extension = path.substr(std::min(path.find_last_of('.'), path.size()));
+		if (extension == ".obj" || extension == ".ply" || extension == ".glb" || extension == ".gltf")
+		{
+			const auto exportStart = std::chrono::steady_clock::now();
+			const size_t bytes = exportMesh(hmap, path, meshFormatFromPath(path));
+			const std::chrono::duration<double> exportDuration = std::chrono::steady_clock::now() - exportStart;
+			std::cout << std::fixed << std::setprecision(3) << "export\t" << exportDuration.count() << " s, "
+				<< std::setprecision(1) << bytes / 1e6 / exportDuration.count() << " MB/s\n";
+		}
+		else
+			writeRaw(hmap, path, format);
+	}
+
+	void runThermal(Heightmap& hmap, const Arguments& arguments)
+	{
+		if (arguments.thermalIterations == 0)
+			return;
+
+		const auto start = std::chrono::steady_clock::now();
+		ThermalErosion thermal;
+		thermal.run(hmap, arguments.thermalIterations, arguments.threads);
+		const std::chrono::duration<double> duration = std::chrono::steady_clock::now() - start;
+		std::cout << std::fixed << std::setprecision(3) << "thermal\t" << duration.count() << " s, " << arguments.thermalIterations << " iterations\n";
+	}
+
+	//The run state of checkpoints only describes droplets, so the grid solver always starts from a generated map
+	void runPipes(const Arguments& arguments)
+	{
+		if (!arguments.resume.empty() || !arguments.checkpoint.empty() || !arguments.flow.empty())
+			throw std::runtime_error("--engine pipes cannot be combined with --resume, --checkpoint or --flow");
+
+		TerrainGenerator terrain(arguments.terrain);
+		const auto generationStart = std::chrono::steady_clock::now();
+		Heightmap hmap = terrain.generate(arguments.size, arguments.size, 75.f, static_cast<int>(arguments.seed), arguments.threads);
+		const std::chrono::duration<double> generation = std::chrono::steady_clock::now() - generationStart;
+
+		PipeErosion pipes;
+		pipes.run(hmap, arguments.iterations, arguments.threads);
+		const auto& timings = pipes.timings();
+
+		std::cout << std::fixed << std::setprecision(3)
+			<< "map\t" << hmap._width << "x" << hmap._height << "\n"
+			<< "generation\t" << generation.count() << " s\n"
+			<< "erosion\t" << timings.total() << " s\n"
+			<< "iterations\t" << arguments.iterations << "\n"
+			<< "rain\t" << timings.rain << " s\n"
+			<< "flux\t" << timings.flux << " s\n"
+			<< "transport\t" << timings.transport << " s\n"
+			<< "water\t" << timings.water << " s\n"
+			<< "erosion pass\t" << timings.erosion << " s\n"
+			<< "evaporation\t" << timings.evaporation << " s\n"
+			<< std::setprecision(1)
+			<< "Mcells/s\t" << (timings.total() > 0. ? static_cast<double>(hmap._width) * hmap._height * arguments.iterations / timings.total() / 1e6 : 0.) << "\n";
+
+		runThermal(hmap, arguments);
+		if (!arguments.out.empty())
+			writeOutput(hmap, arguments.out, arguments.precision);
+	}
+
+	void writeFlow(const FlowMap& flow, const std::string& path)
+	{
+		const auto exportStart = std::chrono::steady_clock::now();
+		const size_t bytes = exportFlowMap(flow, path);
+		const std::chrono::duration<double> exportDuration = std::chrono::steady_clock::now() - exportStart;
+		std::cout << std::fixed << std::setprecision(3) << "flow\t" << exportDuration.count() << " s, " << std::setprecision(1) << bytes / 1e6 << " MB\n";
+	}
+
+	void writeStats(const DropletStats& stats, const std::string& path)
+	{
+		std::ofstream file(path);
+		if (!file.is_open())
+			throw std::runtime_error("could not open " + path);
+		writeJson(file, stats);
+	}
+
+	//The tiles in the directory are the result, only the parts of the map being eroded are kept in memory
+	void runTiled(const Arguments& arguments, const ErosionGenerator::Config& config)
+	{
+		if (!arguments.resume.empty() || !arguments.checkpoint.empty() || !arguments.out.empty())
+			throw std::runtime_error("--tiles cannot be combined with --resume, --checkpoint or --out");
+
+		ErosionGenerator erosionGenerator(config);
+		erosionGenerator._terrain._config = arguments.terrain;
+		//Generated heights reach 75 times the squared noise range, at most 300 for noise in [-1, 1]. Erosion digs below the lowest
+		//and deposits above the highest, so uint16 tiles cover a wider range
+		auto tiles = TiledHeightmap::create(arguments.tiles, arguments.size, arguments.size, arguments.tileSize, 64, arguments.precision, { -30.f, 330.f });
+
+		const auto generationStart = std::chrono::steady_clock::now();
+		erosionGenerator.generateNoisyTerrain(*tiles, 75.f, static_cast<int>(arguments.seed));
+		const std::chrono::duration<double> generation = std::chrono::steady_clock::now() - generationStart;
+
+		DropletOptions options;
+		options.engine = arguments.engine;
+		options.threads = arguments.threads;
+		//Unlike the map, the flow is kept in memory
+		FlowMap flow;
+		if (!arguments.flow.empty())
+		{
+			flow = FlowMap(tiles->width(), tiles->height());
+			options.flowMap = &flow;
+		}
+		const auto erosionStart = std::chrono::steady_clock::now();
+		const DropletStats stats = erosionGenerator.launchDroplets(*tiles, arguments.droplets, arguments.seed, options);
+		const std::chrono::duration<double> erosion = std::chrono::steady_clock::now() - erosionStart;
+
+		std::cout << std::fixed << std::setprecision(3)
+			<< "map\t" << tiles->width() << "x" << tiles->height() << " in " << tiles->tilesX() * tiles->tilesY() << " tiles\n"
+			<< "generation\t" << generation.count() << " s\n"
+			<< "erosion\t" << erosion.count() << " s\n"
+			<< "droplets\t" << stats.droplets << "\n"
+			<< std::setprecision(0)
+			<< "droplets/s\t" << (erosion.count() > 0. ? stats.droplets / erosion.count() : 0.) << "\n"
+			<< std::setprecision(1)
+			<< "steps/droplet\t" << (stats.droplets ? static_cast<double>(stats.steps) / stats.droplets : 0.) << "\n"
+			<< "tile faults\t" << tiles->faults() << "\n";
+
+		if (!arguments.stats.empty())
+			writeStats(stats, arguments.stats);
+		if (!arguments.flow.empty())
+			writeFlow(flow, arguments.flow);
+	}
+}
+
+int main(int argc, char** argv)
+{
+	try
+	{
+		const Arguments arguments = parseArguments(argc, argv);
+
+		ErosionGenerator erosionGenerator{};
+		erosionGenerator._terrain._config = arguments.terrain;
+		SimulationState state;
+		state.seed = arguments.seed;
+		if (!arguments.config.empty())
+			state.config = loadConfig(arguments.config);
+		if (!arguments.tiles.empty())
+		{
+			runTiled(arguments, state.config);
+			return 0;
+		}
+		if (arguments.pipes)
+		{
+			runPipes(arguments);
+			return 0;
+		}
+
+		Heightmap hmap;
+		const auto generationStart = std::chrono::steady_clock::now();
+		if (!arguments.resume.empty())
+		{
+			const auto requestedConfig = state.config;
+			hmap = loadCheckpoint(arguments.resume, &state);
+			if (!arguments.config.empty() && configHash(requestedConfig) != configHash(state.config))
+				throw std::runtime_error(arguments.resume + " was made with a different configuration than " + arguments.config);
+		}
+		else
+			hmap = erosionGenerator.generateNoisyTerrain(arguments.size, arguments.size, 75.f, static_cast<int>(arguments.seed));
+		const std::chrono::duration<double> generation = std::chrono::steady_clock::now() - generationStart;
+		erosionGenerator._config = state.config;
+
+		DropletOptions options;
+		options.engine = arguments.engine;
+		options.threads = arguments.threads;
+		FlowMap flow;
+		if (!arguments.flow.empty())
+		{
+			flow = FlowMap(hmap._width, hmap._height);
+			options.flowMap = &flow;
+		}
+		const unsigned long long firstDroplet = state.droplets;
+		DropletStats stats;
+		const auto erosionStart = std::chrono::steady_clock::now();
+		if (arguments.levels > 1)
+		{
+			//The levels need the whole budget at once, so the run cannot be split in checkpointed batches
+			if (!arguments.resume.empty() || arguments.checkpointEvery > 0)
+				throw std::runtime_error("--levels cannot be combined with --resume or --checkpoint-every");
+			PyramidOptions pyramid;
+			pyramid.levels = arguments.levels;
+			stats += erosionGenerator.launchDropletsPyramid(hmap, arguments.droplets, state.seed, pyramid, options);
+			state.batches++;
+			state.droplets = arguments.droplets;
+		}
+		if (arguments.converge > 0.)
+		{
+			if (arguments.levels > 1 || arguments.checkpointEvery > 0)
+				throw std::runtime_error("--converge cannot be combined with --levels or --checkpoint-every");
+			ConvergenceOptions convergence;
+			convergence.rmsThreshold = arguments.converge;
+			convergence.maxThreshold = std::numeric_limits<float>::max();
+			convergence.timeBudget = arguments.timeBudget;
+			convergence.maxDroplets = arguments.droplets - std::min<unsigned long long>(state.droplets, arguments.droplets);
+			options.firstDroplet = state.droplets;
+			const ConvergenceResult result = erosionGenerator.launchDropletsUntilConverged(hmap, state.seed, convergence, options);
+			stats += result.stats;
+			state.batches += result.curve.size();
+			if (!result.curve.empty())
+				state.droplets += result.curve.back().droplets;
+
+			std::cout << "batch\tdroplets\trms change\tmax change\ttime\n";
+			for (size_t i = 0; i < result.curve.size(); i++)
+			{
+				const auto& point = result.curve[i];
+				std::cout << i << "\t" << point.droplets << "\t" << std::setprecision(6) << point.rmsChange << "\t" << point.maxChange
+					<< "\t" << std::setprecision(3) << point.seconds << " s\n";
+			}
+			std::cout << (result.converged ? "converged" : "not converged") << "\n";
+		}
+		//The budget left by a converged run is not spent
+		while (arguments.converge <= 0. && state.droplets < arguments.droplets)
+		{
+			//Batches stay aligned on multiples of batchSize after a resume from any droplet count
+			const unsigned int count = static_cast<unsigned int>(std::min<unsigned long long>(batchSize - state.droplets % batchSize, arguments.droplets - state.droplets));
+			//Droplets continue the sequence of the seed, so a resumed run spawns the droplets the interrupted one would have
+			options.firstDroplet = state.droplets;
+			stats += erosionGenerator.launchDroplets(hmap, count, state.seed, options);
+			state.batches++;
+
+			const unsigned long long previous = state.droplets;
+			state.droplets += count;
+			if (!arguments.checkpoint.empty() && arguments.checkpointEvery > 0 && state.droplets < arguments.droplets
+				&& previous / arguments.checkpointEvery != state.droplets / arguments.checkpointEvery)
+				saveCheckpoint(arguments.checkpoint, hmap, state);
+		}
+		const std::chrono::duration<double> erosion = std::chrono::steady_clock::now() - erosionStart;
+		const unsigned long long launched = state.droplets - firstDroplet;
+
+		std::cout << std::fixed << std::setprecision(3)
+			<< "map\t" << hmap._width << "x" << hmap._height << "\n"
+			<< (arguments.resume.empty() ? "generation\t" : "load\t") << generation.count() << " s\n"
+			<< "erosion\t" << erosion.count() << " s\n"
+			<< "droplets\t" << launched << " (" << state.droplets << " in total)\n"
+			<< std::setprecision(0)
+			<< "droplets/s\t" << (erosion.count() > 0. ? launched / erosion.count() : 0.) << "\n"
+			<< std::setprecision(1)
+			<< "steps/droplet\t" << (stats.droplets ? static_cast<double>(stats.steps) / stats.droplets : 0.) << "\n";
+
+		if (!arguments.stats.empty())
+			writeStats(stats, arguments.stats);
+		if (!arguments.flow.empty())
+			writeFlow(flow, arguments.flow);
+		if (!arguments.checkpoint.empty())
+			saveCheckpoint(arguments.checkpoint, hmap, state);
+		//Applied after the checkpoint, so resuming continues the droplets on the unrelaxed map
+		runThermal(hmap, arguments);
+		if (!arguments.out.empty())
+			writeOutput(hmap, arguments.out, arguments.precision);
+	}
+	catch (const std::exception& e)
+	{
+		std::cerr << "error: " << e.what() << "\n";
+		printUsage();
+		return 1;
+	}
+	return 0;
+}
@@ -1,199 +1,582 @@
 #include "ErosionGenerator.h"
-#include <iostream>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <stdexcept>
+#include <omp.h>
 #include "Heightmap.h"
+#include "ErosionBrush.h"
+#include "HeightSampler.h"
+#include "WavefrontDroplets.h"
+#include "CounterRng.h"
+#include "TiledHeightmap.h"
 
 namespace ErosionSimulation
 {
-	template<int channels>
-	std::array<float, channels> bilinearInterp(const float* data, unsigned int width, unsigned int height, const point2f &point)
+	ErosionGenerator::ErosionGenerator()
 	{
-		if (point.x < 0 || point.x >= width || point.y < 0 || point.y >= height)
- 			return {};
-
-		point2f current_point = point;
+	}
 
-		if (current_point.x > width - 1)
-			current_point.x = width - 1 - 0.0001f;
+	ErosionGenerator::ErosionGenerator(const Config& config) :
+		_config(config)
+	{
+	}
 
-		if (current_point.y > height - 1)
-			current_point.y = height - 1 - 0.0001f;
+	ErosionGenerator::ErosionGenerator(const Config&& config) :
+		_config(config)
+	{
+	}
 
-		const unsigned int x_left = int(current_point.x);
-		const unsigned int x_right = x_left + 1;
+	Heightmap ErosionGenerator::generateNoisyTerrain(unsigned int width, unsigned int height, float maxValue, int seed)
+	{
+		return _terrain.generate(width, height, maxValue, seed);
+	}
 
-		const unsigned int y_top = int(current_point.y);
-		const unsigned int y_bottom = y_top + 1;
+	void ErosionGenerator::generateNoisyTerrain(TiledHeightmap& tiles, float maxValue, int seed)
+	{
+		_terrain.generate(tiles, maxValue, seed);
+	}
 
-		float x_remain = current_point.x - x_left;
-		float y_remain = current_point.y - y_top;
+	std::vector<point2f> ErosionGenerator::launchDroplet(Heightmap &hmap)
+	{
+		point2f startPoint;
+		uint32_t directionState;
+		generateDroplets(0, 0, _launchedDroplets++, 1, { 0.f, 0.f }, { static_cast<float>(hmap._width), static_cast<float>(hmap._height) }, &startPoint, &directionState);
+		hmap.detach();
+		hmap.beginModification();
+
+		std::vector<point2f> trajectory(static_cast<size_t>(std::max(_config.maxDropletSteps, 0)) + 1);
+		DropletStats stats;
+		trajectory.resize(runDroplet(hmap, *brush(), startPoint, directionState, trajectory.data(), nullptr, stats));
+		return trajectory;
+	}
 
-		std::array<float, channels> ret;
-		for (unsigned int c = 0; c < channels; c++)
-		{
-			float top_value = data[channels * (y_top * width + x_left) + c] * (1 - x_remain) + data[channels * (y_top * width + x_right) + c] * x_remain;
-			float bottom_value = data[channels * (y_bottom * width + x_left) + c] * (1 - x_remain) + data[channels * (y_bottom * width + x_right) + c] * x_remain;
+	DropletStats& DropletStats::operator+=(const DropletStats& other)
+	{
+		droplets += other.droplets;
+		steps += other.steps;
+		eroded += other.eroded;
+		deposited += other.deposited;
+		counters += other.counters;
+		return *this;
+	}
 
-			float value = top_value * (1 - y_remain) + bottom_value * y_remain;
-			ret[c] = value;
-		}
+	DropletStats ErosionGenerator::launchDroplets(Heightmap& hmap, unsigned int count, unsigned int seed, const DropletOptions& options) const
+	{
+		if (count == 0 || hmap._width == 0 || hmap._height == 0)
+			return {};
+		if (options.flowMap && (options.flowMap->width() != hmap._width || options.flowMap->height() != hmap._height))
+			throw std::runtime_error("flow map and heightmap have different sizes");
+
+		//Detach once before the workers start writing, so they never copy the buffer concurrently
+		hmap.detach();
+		hmap.beginModification();
+
+		//Without two tiles in a phase the rounds and buckets of the tiled engine would only cost time
+		if (options.threads != 1 && parallelTiles(hmap._width, hmap._height))
+			return launchDropletsTiled(hmap, count, seed, options);
+
+		const auto erosionBrush = brush();
+		std::vector<point2f> trajectories;
+		if (options.trajectorySink)
+			trajectories.resize(trajectoryScratchSize(options.engine));
+
+		DropletStats stats;
+		runDroplets(hmap, *erosionBrush, options, { 0.f, 0.f }, { static_cast<float>(hmap._width), static_cast<float>(hmap._height) }, count, seed, 0, options.firstDroplet, trajectories.data(), stats);
+		return stats;
+	}
 
-		return ret;
+	size_t ErosionGenerator::trajectoryScratchSize(DropletEngine engine) const
+	{
+		const size_t trajectoryCapacity = static_cast<size_t>(std::max(_config.maxDropletSteps, 0)) + 1;
+		return engine == DropletEngine::Sequential ? trajectoryCapacity : trajectoryCapacity * wavefrontLanes;
 	}
 
-	ErosionGenerator::ErosionGenerator() :
-		_generator(FastNoise::New<FastNoise::OpenSimplex2S>()),
-		_rn_engine(_rng())
+	void ErosionGenerator::runDroplets(Heightmap& hmap, const ErosionBrush& erosionBrush, const DropletOptions& options, point2f areaMin, point2f areaMax,
+		unsigned int count, unsigned int seed, uint32_t stream, unsigned long long first, point2f* trajectories, DropletStats& stats) const
 	{
+		//Spawned in small groups, so the random numbers stay in cache. The wavefront lanes drain at the end of a group,
+		//groups are aligned on droplet indices so they do not depend on how the run is split in batches
+		constexpr unsigned int group = 1024;
+		static_assert(tiledRoundSize % group == 0, "batches split on rounds must not split groups");
+		point2f starts[group];
+		uint32_t directionStates[group];
+		for (unsigned int done = 0; done < count; )
+		{
+			const unsigned int groupCount = static_cast<unsigned int>(std::min<unsigned long long>(count - done, group - (first + done) % group));
+			generateDroplets(seed, stream, first + done, groupCount, areaMin, areaMax, starts, directionStates);
+			runDroplets(hmap, erosionBrush, options, starts, directionStates, groupCount, trajectories, stats);
+			done += groupCount;
+		}
 	}
 
-	ErosionGenerator::ErosionGenerator(const Config& config) :
-		_generator(FastNoise::New<FastNoise::OpenSimplex2S>()),
-		_rn_engine(_rng()),
-		_config(config)
+	void ErosionGenerator::runDroplets(Heightmap& hmap, const ErosionBrush& erosionBrush, const DropletOptions& options, const point2f* starts, const uint32_t* directionStates,
+		unsigned int count, point2f* trajectories, DropletStats& stats) const
 	{
+		if (options.engine != DropletEngine::Sequential)
+		{
+			const WavefrontSimulator simulator(_config, erosionBrush, options.engine == DropletEngine::Wavefront);
+			simulator.run(hmap, starts, directionStates, count, trajectories, options.trajectorySink, options.flowMap, stats);
+			return;
+		}
+
+		point2f* trajectory = options.trajectorySink ? trajectories : nullptr;
+		for (unsigned int i = 0; i < count; i++)
+		{
+			const auto length = runDroplet(hmap, erosionBrush, starts[i], directionStates[i], trajectory, options.flowMap, stats);
+			if (trajectory)
+				options.trajectorySink->record(trajectory, length);
+		}
 	}
 
-	ErosionGenerator::ErosionGenerator(const Config&& config) :
-		_generator(FastNoise::New<FastNoise::OpenSimplex2S>()),
-		_rn_engine(_rng()),
-		_config(config)
+	namespace
 	{
+		//Half resolution map, heights halved along with the cell size so slopes keep their value
+		Heightmap downsample(const Heightmap& hmap)
+		{
+			Heightmap coarse((hmap._width + 1) / 2, (hmap._height + 1) / 2);
+			float* coarseData = coarse.data();
+#pragma omp parallel for
+			for (int y = 0; y < static_cast<int>(coarse._height); y++)
+			{
+				const unsigned int y0 = 2 * y;
+				const unsigned int y1 = std::min(y0 + 1, hmap._height - 1);
+				for (unsigned int x = 0; x < coarse._width; x++)
+				{
+					const unsigned int x0 = 2 * x;
+					const unsigned int x1 = std::min(x0 + 1, hmap._width - 1);
+					coarseData[x + y * coarse._width] = 0.125f * (hmap.at(x0, y0) + hmap.at(x1, y0) + hmap.at(x0, y1) + hmap.at(x1, y1));
+				}
+			}
+			return coarse;
+		}
+
+		//Adds the bilinear upsampling of the difference between eroded and original, scaled back to the heights of hmap
+		void addUpsampledDelta(Heightmap& hmap, const Heightmap& eroded, const Heightmap& original)
+		{
+			const unsigned int coarseWidth = eroded._width;
+			const unsigned int coarseHeight = eroded._height;
+			float* data = hmap.data();
+#pragma omp parallel for
+			for (int y = 0; y < static_cast<int>(hmap._height); y++)
+			{
+				const float v = std::clamp(0.5f * y - 0.25f, 0.f, static_cast<float>(coarseHeight - 1));
+				const unsigned int v0 = static_cast<unsigned int>(v);
+				const unsigned int v1 = std::min(v0 + 1, coarseHeight - 1);
+				const float fv = v - v0;
+				for (unsigned int x = 0; x < hmap._width; x++)
+				{
+					const float u = std::clamp(0.5f * x - 0.25f, 0.f, static_cast<float>(coarseWidth - 1));
+					const unsigned int u0 = static_cast<unsigned int>(u);
+					const unsigned int u1 = std::min(u0 + 1, coarseWidth - 1);
+					const float fu = u - u0;
+
+					const auto delta = [&](unsigned int cx, unsigned int cy) { return eroded.at(cx, cy) - original.at(cx, cy); };
+					const float top = delta(u0, v0) + fu * (delta(u1, v0) - delta(u0, v0));
+					const float bottom = delta(u0, v1) + fu * (delta(u1, v1) - delta(u0, v1));
+					data[x + static_cast<size_t>(y) * hmap._width] += 2.f * (top + fv * (bottom - top));
+				}
+			}
+			hmap.markDirty(0, 0, hmap._width, hmap._height);
+		}
 	}
 
-	Heightmap ErosionGenerator::generateNoisyTerrain(unsigned int width, unsigned int height, float maxValue)
+	DropletStats ErosionGenerator::launchDropletsPyramid(Heightmap& hmap, unsigned int count, unsigned int seed, const PyramidOptions& pyramid, const DropletOptions& options) const
 	{
-		Heightmap _hmap(width, height);
-		auto minMax = _generator->GenUniformGrid2D(_hmap._data, 0, 0, _hmap._width, _hmap._height, 0.003f, 0);
-		_hmap -= minMax.min;
-		_hmap *= maxValue * (minMax.max - minMax.min);
-		return  _hmap;
+		if (count == 0 || hmap._width == 0 || hmap._height == 0)
+			return {};
+
+		//levels[0] stands for hmap itself, which is eroded in place
+		std::vector<Heightmap> levels(1);
+		const auto levelMap = [&](size_t l) -> const Heightmap& { return l == 0 ? hmap : levels[l]; };
+		while (levels.size() < pyramid.levels && std::min(levelMap(levels.size() - 1)._width, levelMap(levels.size() - 1)._height) / 2 >= std::max(pyramid.minSize, 1U))
+			levels.push_back(downsample(levelMap(levels.size() - 1)));
+
+		double totalArea = 0.;
+		for (size_t l = 0; l < levels.size(); l++)
+			totalArea += static_cast<double>(levelMap(l)._width) * levelMap(l)._height;
+
+		DropletStats stats;
+		unsigned int distributed = 0;
+		hmap.detach();
+		hmap.beginModification();
+		for (size_t l = levels.size(); l-- > 0; )
+		{
+			const auto area = static_cast<double>(levelMap(l)._width) * levelMap(l)._height;
+			const unsigned int levelCount = l == 0 ? count - distributed : static_cast<unsigned int>(count * (area / totalArea));
+			distributed += levelCount;
+
+			Config levelConfig = _config;
+			levelConfig.erosionRadius = std::max(1.f, _config.erosionRadius / static_cast<float>(1U << l));
+			const ErosionGenerator levelGenerator(levelConfig);
+
+			if (l == 0)
+			{
+				stats += levelGenerator.launchDroplets(hmap, levelCount, seed, options);
+				break;
+			}
+
+			//The level is eroded in its own copy, the original stays for the delta
+			Heightmap eroded = levels[l];
+			DropletOptions levelOptions = options;
+			levelOptions.flowMap = nullptr;
+			stats += levelGenerator.launchDroplets(eroded, levelCount, seed + static_cast<unsigned int>(l) * 0x9e3779b9u, levelOptions);
+			Heightmap& finer = l == 1 ? hmap : levels[l - 1];
+			addUpsampledDelta(finer, eroded, levels[l]);
+		}
+		return stats;
 	}
 
-	float applyErosion(Heightmap& hmap, const point2f &point, float radius, float weight)
+	namespace
 	{
-		const auto Rsquared = radius * radius;
-		const auto area = 3.14f * Rsquared;
-		const auto norm_factor = 0.33f * area; //volume of cone
-		float total_sediment = 0.f;
-		for (unsigned int x = static_cast<unsigned int>(point.x - radius); x <= static_cast<unsigned int>(point.x + radius); x++)
+		//Rows are reduced separately then summed in order, so the result does not depend on the number of threads
+		void measureChange(const Heightmap& before, const Heightmap& after, int threads, ConvergencePoint& point)
 		{
-			if (x < 0 || x >= hmap._width)
-				continue;
-
-			const auto x_diff = (x - point.x);
-			const auto x_diff_squared = x_diff * x_diff;
-			const auto min_y = point.y - std::sqrt(Rsquared - x_diff_squared);
-			const auto max_y = point.y + std::sqrt(Rsquared - x_diff_squared);
-			for (unsigned int y = static_cast<unsigned int>(min_y); static_cast<unsigned int>(y) <= max_y; y++)
+			const int width = static_cast<int>(after._width);
+			const int height = static_cast<int>(after._height);
+			std::vector<double> rowSquares(height);
+			std::vector<float> rowMax(height);
+#pragma omp parallel for num_threads(threads)
+			for (int y = 0; y < height; y++)
 			{
-				if (y < 0 || y >= hmap._height)
-					continue;
+				const float* previous = before._data + static_cast<size_t>(y) * width;
+				const float* current = after._data + static_cast<size_t>(y) * width;
+				double squares = 0.;
+				float maxChange = 0.f;
+				for (int x = 0; x < width; x++)
+				{
+					const float delta = current[x] - previous[x];
+					squares += delta * delta;
+					maxChange = std::max(maxChange, std::abs(delta));
+				}
+				rowSquares[y] = squares;
+				rowMax[y] = maxChange;
+			}
 
-				const auto y_diff = (y - point.y);
-				const auto y_diff_squared = y_diff * y_diff;
-				auto distance = std::sqrt(y_diff_squared + x_diff_squared);
-				auto erosionWeight = std::abs(radius - distance) * weight / (radius * norm_factor) ;
+			double squares = 0.;
+			point.maxChange = 0.f;
+			for (int y = 0; y < height; y++)
+			{
+				squares += rowSquares[y];
+				point.maxChange = std::max(point.maxChange, rowMax[y]);
+			}
+			point.rmsChange = std::sqrt(squares / (static_cast<double>(width) * height));
+		}
+	}
 
-				auto erosionValue = erosionWeight;
-				total_sediment += erosionValue;
- 				hmap.at(x, y) -= erosionValue;
+	ConvergenceResult ErosionGenerator::launchDropletsUntilConverged(Heightmap& hmap, unsigned int seed, const ConvergenceOptions& convergence, const DropletOptions& options) const
+	{
+		ConvergenceResult result;
+		if (hmap._width == 0 || hmap._height == 0)
+			return result;
+
+		unsigned long long batchSize = convergence.batchSize > 0 ? convergence.batchSize : std::max<unsigned long long>(static_cast<unsigned long long>(hmap._width) * hmap._height / 4, 1);
+		batchSize = (batchSize + tiledRoundSize - 1) / tiledRoundSize * tiledRoundSize;
+		const int threads = options.threads <= 0 ? omp_get_max_threads() : options.threads;
+
+		DropletOptions batchOptions = options;
+		const auto start = std::chrono::steady_clock::now();
+		unsigned long long launched = 0;
+		while (launched < convergence.maxDroplets)
+		{
+			const unsigned int count = static_cast<unsigned int>(std::min(batchSize, convergence.maxDroplets - launched));
+			//Shares the buffer until the batch detaches the map, the copy is the snapshot the batch is measured against
+			const Heightmap before = hmap;
+			batchOptions.firstDroplet = options.firstDroplet + launched;
+			result.stats += launchDroplets(hmap, count, seed, batchOptions);
+			launched += count;
+
+			ConvergencePoint point;
+			point.droplets = launched;
+			measureChange(before, hmap, threads, point);
+			point.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			result.curve.push_back(point);
+
+			if (point.rmsChange < convergence.rmsThreshold && point.maxChange < convergence.maxThreshold)
+			{
+				result.converged = true;
+				break;
 			}
+			if (convergence.onBatch && !convergence.onBatch(point))
+				break;
+			//A diverging erosion never converges
+			if (!std::isfinite(point.rmsChange))
+				break;
+			if (convergence.timeBudget > 0. && point.seconds >= convergence.timeBudget)
+				break;
 		}
-		return total_sediment;
+		return result;
 	}
 
-	float deposit(Heightmap& hmap, const point2f& point, float weight, float max)
-	{	
-		if (weight < 1e-5)
-			return 0.f;
+	unsigned int ErosionGenerator::parallelTileSize() const
+	{
+		//a droplet moves by one cell per step, erodes within erosionRadius and samples one cell beyond its position
+		return static_cast<unsigned int>(std::max(_config.maxDropletSteps, 0)) + static_cast<unsigned int>(std::ceil(_config.erosionRadius)) + 3;
+	}
 
-		float deposited = 0.f;
-		const int x = static_cast<unsigned int>(point.x);
-		const int y = static_cast<unsigned int>(point.y);
+	bool ErosionGenerator::parallelTiles(unsigned int width, unsigned int height) const
+	{
+		//Tiles of a phase are 3 tiles apart
+		const unsigned int tileSize = parallelTileSize();
+		return (width + tileSize - 1) / tileSize > 3 || (height + tileSize - 1) / tileSize > 3;
+	}
 
-		const float x_remain = point.x - x - 0.5;
-		const float y_remain = point.y - y - 0.5;
+	DropletStats ErosionGenerator::launchDropletsTiled(Heightmap& hmap, unsigned int count, unsigned int seed, const DropletOptions& options) const
+	{
+		const auto width = hmap._width;
+		const auto height = hmap._height;
 
-		float value = std::min(weight * (1 - std::abs(x_remain)) * (1 - std::abs(y_remain)), max);
-		deposited += value;
-		hmap.at(x, y) += value;
-		if (x + 1 < hmap._width)
+		//Tiles of the same phase are two tiles apart, so their droplets can never reach the same cells
+		const unsigned int tileSize = parallelTileSize();
+		const unsigned int tilesX = (width + tileSize - 1) / tileSize;
+		const unsigned int tilesY = (height + tileSize - 1) / tileSize;
+		const unsigned int tileCount = tilesX * tilesY;
+		constexpr unsigned int phaseStride = 3;
+
+		const int threads = options.threads <= 0 ? omp_get_max_threads() : options.threads;
+		const auto erosionBrush = brush();
+
+		//Per thread scratch memory, allocated once for the whole batch
+		const size_t scratchSize = trajectoryScratchSize(options.engine);
+		std::vector<point2f> trajectories(options.trajectorySink ? scratchSize * threads : 0);
+		std::vector<DropletStats> threadStats(threads);
+
+		std::vector<point2f> starts(tiledRoundSize);
+		std::vector<uint32_t> directionStates(tiledRoundSize);
+		std::vector<point2f> tileStarts(tiledRoundSize);
+		std::vector<uint32_t> tileDirectionStates(tiledRoundSize);
+		std::vector<unsigned int> tileOffsets(tileCount + 1);
+
+		//Interleave the tiles by running the droplets in rounds instead of emptying each tile at once.
+		//Rounds are aligned on droplet indices, so they do not depend on how the run is split in batches
+		const unsigned long long end = options.firstDroplet + count;
+		for (unsigned long long roundStart = options.firstDroplet; roundStart < end; )
 		{
-			value = std::min(weight * std::max(0.f, x_remain) * (1 - std::abs(y_remain)), max);
-			deposited += value;
-			hmap.at(x + 1, y) += value;
+			const unsigned long long roundEnd = std::min(end, (roundStart / tiledRoundSize + 1) * tiledRoundSize);
+			const auto roundCount = static_cast<unsigned int>(roundEnd - roundStart);
+			generateDroplets(seed, 0, roundStart, roundCount, { 0.f, 0.f }, { static_cast<float>(width), static_cast<float>(height) }, starts.data(), directionStates.data());
+
+			//Stable counting sort by spawn tile, each tile keeps its droplets in index order
+			std::fill(tileOffsets.begin(), tileOffsets.end(), 0U);
+			const auto tileOf = [&](point2f start) { return static_cast<unsigned int>(start.x) / tileSize + static_cast<unsigned int>(start.y) / tileSize * tilesX; };
+			for (unsigned int i = 0; i < roundCount; i++)
+				tileOffsets[tileOf(starts[i]) + 1]++;
+			for (unsigned int t = 0; t < tileCount; t++)
+				tileOffsets[t + 1] += tileOffsets[t];
+			for (unsigned int i = 0; i < roundCount; i++)
+			{
+				const unsigned int slot = tileOffsets[tileOf(starts[i])]++;
+				tileStarts[slot] = starts[i];
+				tileDirectionStates[slot] = directionStates[i];
+			}
+			//The placement loop moved every offset to the end of its tile
+			for (unsigned int t = tileCount; t > 0; t--)
+				tileOffsets[t] = tileOffsets[t - 1];
+			tileOffsets[0] = 0;
+
+			for (unsigned int phase = 0; phase < phaseStride * phaseStride; phase++)
+			{
+				const unsigned int phaseX = phase % phaseStride;
+				const unsigned int phaseY = phase / phaseStride;
+				const int phaseTilesX = static_cast<int>((tilesX + phaseStride - 1 - phaseX) / phaseStride);
+				const int phaseTilesY = static_cast<int>((tilesY + phaseStride - 1 - phaseY) / phaseStride);
+
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+				for (int phaseTile = 0; phaseTile < phaseTilesX * phaseTilesY; phaseTile++)
+				{
+					const unsigned int tx = (phaseTile % phaseTilesX) * phaseStride + phaseX;
+					const unsigned int ty = (phaseTile / phaseTilesX) * phaseStride + phaseY;
+					const unsigned int tile = tx + ty * tilesX;
+					const unsigned int first = tileOffsets[tile];
+					const unsigned int last = tileOffsets[tile + 1];
+					if (first == last)
+						continue;
+
+					const int thread = omp_get_thread_num();
+					point2f* trajectory = options.trajectorySink ? trajectories.data() + scratchSize * thread : nullptr;
+					DropletStats tileStats;
+					runDroplets(hmap, *erosionBrush, options, tileStarts.data() + first, tileDirectionStates.data() + first, last - first, trajectory, tileStats);
+					threadStats[thread] += tileStats;
+				}
+			}
+			roundStart = roundEnd;
 		}
-		if (x - 1 >= 0)
+
+		DropletStats stats;
+		for (const auto& local : threadStats)
+			stats += local;
+		return stats;
+	}
+
+	namespace
+	{
+		//Moves the trajectories of a window back to map coordinates
+		class OffsetTrajectorySink : public TrajectorySink
 		{
-			value = std::min(weight * std::max(0.f, -x_remain) * (1 - std::abs(y_remain)), max);
-			deposited += value;
-			hmap.at(x - 1, y) += value;
-		}
-		if (y + 1 < hmap._height)
+		public:
+			OffsetTrajectorySink(TrajectorySink& sink, point2f offset) : _sink(sink), _offset(offset) {}
+
+			void record(const point2f* points, unsigned int count) override
+			{
+				_points.resize(count);
+				for (unsigned int i = 0; i < count; i++)
+					_points[i] = { points[i].x + _offset.x, points[i].y + _offset.y };
+				_sink.record(_points.data(), count);
+			}
+
+		private:
+			TrajectorySink& _sink;
+			point2f _offset;
+			std::vector<point2f> _points;
+		};
+	}
+
+	DropletStats ErosionGenerator::launchDroplets(TiledHeightmap& tiles, unsigned long long count, unsigned int seed, const DropletOptions& options) const
+	{
+		const auto width = tiles.width();
+		const auto height = tiles.height();
+		if (count == 0 || width == 0 || height == 0)
+			return {};
+
+		const unsigned int tileSize = tiles.tileSize();
+		const unsigned int tilesX = tiles.tilesX();
+		const unsigned int tilesY = tiles.tilesY();
+		const unsigned int tileCount = tilesX * tilesY;
+		const unsigned int halo = parallelTileSize();
+		constexpr unsigned int phaseStride = 3;
+
+		//Split the droplets between tiles proportionally to their area
+		std::vector<unsigned long long> tileDroplets(tileCount);
+		const double totalArea = static_cast<double>(width) * height;
+		double cumulatedArea = 0.;
+		unsigned long long distributed = 0;
+		for (unsigned int t = 0; t < tileCount; t++)
 		{
-			value = std::min(weight * (1 - std::abs(x_remain)) * std::max(0.f, y_remain), max);
-			deposited += value;
-			hmap.at(x, y + 1) += value;
+			const unsigned int tx = t % tilesX;
+			const unsigned int ty = t / tilesX;
+			cumulatedArea += static_cast<double>(std::min(tileSize, width - tx * tileSize)) * std::min(tileSize, height - ty * tileSize);
+			const auto upTo = static_cast<unsigned long long>(count * (cumulatedArea / totalArea));
+			tileDroplets[t] = std::min(upTo, count) - distributed;
+			distributed += tileDroplets[t];
 		}
+		tileDroplets[tileCount - 1] += count - distributed;
+
+		//Windows of the same phase overlap when the halo is larger than a tile, they then run one at a time
+		const int threads = tileSize < halo ? 1 : options.threads <= 0 ? omp_get_max_threads() : options.threads;
+		const auto erosionBrush = brush();
+		std::vector<DropletStats> threadStats(threads);
 
-		if (y - 1 >= 0)
+		for (unsigned int phase = 0; phase < phaseStride * phaseStride; phase++)
 		{
-			value = std::min(weight * (1 - std::abs(x_remain)) * std::max(0.f, -y_remain), max);
-			deposited += value;
-			hmap.at(x, y - 1) += value;
+			const unsigned int phaseX = phase % phaseStride;
+			const unsigned int phaseY = phase / phaseStride;
+			const int phaseTilesX = static_cast<int>((tilesX + phaseStride - 1 - phaseX) / phaseStride);
+			const int phaseTilesY = static_cast<int>((tilesY + phaseStride - 1 - phaseY) / phaseStride);
+
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+			for (int phaseTile = 0; phaseTile < phaseTilesX * phaseTilesY; phaseTile++)
+			{
+				const unsigned int tx = (phaseTile % phaseTilesX) * phaseStride + phaseX;
+				const unsigned int ty = (phaseTile / phaseTilesX) * phaseStride + phaseY;
+				const unsigned int tile = tx + ty * tilesX;
+				if (tileDroplets[tile] == 0)
+					continue;
+
+				const unsigned int windowX = tx * tileSize - std::min(tx * tileSize, halo);
+				const unsigned int windowY = ty * tileSize - std::min(ty * tileSize, halo);
+				const unsigned int windowWidth = std::min(width, (tx + 1) * tileSize + halo) - windowX;
+				const unsigned int windowHeight = std::min(height, (ty + 1) * tileSize + halo) - windowY;
+
+				Heightmap window(windowWidth, windowHeight);
+				tiles.read(windowX, windowY, window);
+
+				const point2f areaMin = { static_cast<float>(tx * tileSize - windowX), static_cast<float>(ty * tileSize - windowY) };
+				const point2f areaMax = { static_cast<float>(std::min(width, (tx + 1) * tileSize) - windowX), static_cast<float>(std::min(height, (ty + 1) * tileSize) - windowY) };
+
+				DropletOptions windowOptions = options;
+				std::vector<point2f> trajectories;
+				std::unique_ptr<OffsetTrajectorySink> sink;
+				if (options.trajectorySink)
+				{
+					sink = std::make_unique<OffsetTrajectorySink>(*options.trajectorySink, point2f{ static_cast<float>(windowX), static_cast<float>(windowY) });
+					windowOptions.trajectorySink = sink.get();
+					trajectories.resize(trajectoryScratchSize(options.engine));
+				}
+				//Windows of the same phase never overlap when they run concurrently, so they are merged without locks
+				std::unique_ptr<FlowMap> flow;
+				if (options.flowMap)
+				{
+					flow = std::make_unique<FlowMap>(windowWidth, windowHeight);
+					windowOptions.flowMap = flow.get();
+				}
+
+				//Each tile draws its droplets from its own stream
+				DropletStats tileStats;
+				for (unsigned long long done = 0; done < tileDroplets[tile]; )
+				{
+					const auto batch = static_cast<unsigned int>(std::min<unsigned long long>(tileDroplets[tile] - done, std::numeric_limits<unsigned int>::max()));
+					runDroplets(window, *erosionBrush, windowOptions, areaMin, areaMax, batch, seed, tile + 1, options.firstDroplet + done, trajectories.data(), tileStats);
+					done += batch;
+				}
+				tiles.write(windowX, windowY, window);
+				if (flow)
+					options.flowMap->merge(*flow, windowX, windowY);
+				threadStats[omp_get_thread_num()] += tileStats;
+			}
 		}
-		return deposited;
+
+		DropletStats stats;
+		for (const auto& local : threadStats)
+			stats += local;
+		return stats;
 	}
 
-	std::vector<point2f> ErosionGenerator::launchDroplet(Heightmap &hmap)
+	unsigned int ErosionGenerator::runDroplet(Heightmap& hmap, const ErosionBrush& erosionBrush, point2f currentPoint, uint32_t directionState, point2f* trajectory, FlowMap* flow, DropletStats& stats) const
 	{
-		if (_debug)
-			std::cout << "New droplet" << std::endl;
 		const auto width = hmap._width;
 		const auto height = hmap._height;
 
-		std::uniform_real_distribution<float> dist_x(0, static_cast<float>(width));
-		std::uniform_real_distribution<float> dist_y(0, static_cast<float>(height));
-
-		std::uniform_real_distribution<float> grad_x_dist(-1, 1);
-		std::uniform_real_distribution<float> grad_y_dist(-1, 1);
-
-		point2f currentPoint = { dist_x(_rn_engine), dist_y(_rn_engine) };
-
-		float speed_x{}, speed_y{};
-		bool stop = false;
-
 		float sediments = 0.f;
 		float volume = 1.0f;
 		float speed = 0.f;
 
 		float dir_x{}, dir_y{};
 
-		std::vector<point2f> trajectory = {currentPoint};
-		trajectory.reserve(static_cast<size_t>(_config.maxDropletSteps));
+		unsigned int length = 0;
+		if (trajectory)
+			trajectory[length] = currentPoint;
+		length++;
+		stats.droplets++;
 
-		for(unsigned int step = 0; step < _config.maxDropletSteps; step++)
+		Termination termination = Termination::MaxSteps;
+		HeightSample local = sampleHeightGradient(hmap, currentPoint);
+		for (int step = 0; step < _config.maxDropletSteps; step++)
 		{
-			const auto local_height = bilinearInterp<1>(hmap._data, width, height, currentPoint);
-			const auto local_gradient = computeGradient(hmap, currentPoint);
-			
-			const auto grad_norm = std::sqrt(local_gradient[0] * local_gradient[0] + local_gradient[1] * local_gradient[1]);
-			float new_dir_x, new_dir_y = 0.f;
+			const auto grad_norm = std::sqrt(local.gradient_x * local.gradient_x + local.gradient_y * local.gradient_y);
+			float new_dir_x, new_dir_y, new_dir_norm;
 			if (grad_norm == 0.f)
 			{
-				new_dir_x = grad_x_dist(_rn_engine);
-				new_dir_y = grad_y_dist(_rn_engine);
+				new_dir_x = randomDirection(directionState);
+				new_dir_y = randomDirection(directionState);
+				new_dir_norm = 1.f;
 			}
 			else
 			{
-				new_dir_x = -local_gradient[0];
-				new_dir_y = -local_gradient[1];
+				new_dir_x = -local.gradient_x;
+				new_dir_y = -local.gradient_y;
+				new_dir_norm = grad_norm;
 			}
 
-			dir_x = _config.inertia * dir_x + (1 - _config.inertia) * new_dir_x / grad_norm;
-			dir_y = _config.inertia * dir_y + (1 - _config.inertia) * new_dir_y / grad_norm;
+			dir_x = _config.inertia * dir_x + (1 - _config.inertia) * new_dir_x / new_dir_norm;
+			dir_y = _config.inertia * dir_y + (1 - _config.inertia) * new_dir_y / new_dir_norm;
 
 			const auto dir_norm = std::sqrt(dir_x * dir_x + dir_y * dir_y);
+			if (dir_norm == 0.f)
+			{
+				termination = Termination::Flat;
+				break;
+			}
 
 			dir_x /= dir_norm;
 			dir_y /= dir_norm;
@@ -203,67 +586,90 @@ namespace ErosionSimulation
 			newPoint.y += dir_y;
 
 			if (newPoint.x < 0 || newPoint.x >= width || newPoint.y < 0 || newPoint.y >= height)
+			{
+				termination = Termination::OutOfBounds;
 				break;
+			}
 
-			trajectory.push_back(newPoint);
-
-			const auto new_height = bilinearInterp<1>(hmap._data, width, height, newPoint);
-			const auto hdiff = new_height[0] - local_height[0];
+			if (trajectory)
+				trajectory[length] = newPoint;
+			length++;
+			stats.steps++;
+			if (flow)
+				flow->add(currentPoint, sediments, volume);
 
-			if (_debug)
-				std::cout << "speed : " << speed << "; height diff : " << hdiff << std::endl;
+			HeightSample next;
+			if (_config.reuseSamples)
+				next = sampleHeightGradient(hmap, newPoint);
+			else
+				next.height = bilinearInterp<1>(hmap._data, width, height, newPoint)[0];
+			const auto hdiff = next.height - local.height;
 
 			if (hdiff < 0)
 			{
 				float capacity = std::max(-hdiff, _config.minSlope) * speed * volume * _config.capacityFactor;
 
-				if (_debug)
-					std::cout << "capacity" << capacity << std::endl;
-
 				if (capacity > sediments)
 				{
 					const auto erosionFactor = std::min((capacity - sediments) * _config.erosionFactor, -hdiff);
-					if (_debug)
-						std::cout << "erosion factor " << erosionFactor << std::endl;
-					sediments += applyErosion(hmap, currentPoint, _config.erosionRadius, erosionFactor);
+					const auto eroded = erosionBrush.apply(hmap, currentPoint, erosionFactor);
+					sediments += eroded;
+					stats.eroded += eroded;
+					stats.counters.erosion();
 				}
 				else
 				{
 					const auto sedimentsToDeposit = _config.depositFactor * (sediments - capacity);
-					if (_debug)
-						std::cout << "sedimentsToDeposit " << sedimentsToDeposit << std::endl;
 					const auto deposited = deposit(hmap, currentPoint, sedimentsToDeposit, -hdiff);
 					sediments -= deposited;
+					stats.deposited += deposited;
+					stats.counters.deposit(sedimentsToDeposit, deposited);
 				}
 			}
 			else
 			{
 				if (hdiff == 0.f)
+				{
+					termination = Termination::Flat;
 					break;
+				}
 				const auto sedimentsToDeposit = sediments;
-
-				if (_debug)
-					std::cout << "sedimentsToDeposit " << sedimentsToDeposit << std::endl;
-
 				const auto deposited = deposit(hmap, currentPoint, sedimentsToDeposit, hdiff);
 				sediments -= deposited;
+				stats.deposited += deposited;
+				stats.counters.deposit(sedimentsToDeposit, deposited);
 				if (sediments == 0.f || deposited < 1e-5)
+				{
+					termination = Termination::Stalled;
 					break;
+				}
 			}
 
 			speed = std::sqrt(std::max(0.f, speed * speed - hdiff * _config.gravity));
 			volume *= _config.evaporation;
 			currentPoint = newPoint;
 			if (volume < 1e-3)
+			{
+				termination = Termination::Evaporated;
 				break;
+			}
 
-
+			//the reused sample misses the erosion applied around currentPoint during this step
+			local = _config.reuseSamples ? next : sampleHeightGradient(hmap, currentPoint);
 		}
-		return trajectory;
+		stats.counters.terminate(termination, length - 1);
+		return length;
+	}
 
+	std::shared_ptr<const ErosionBrush> ErosionGenerator::brush() const
+	{
+		std::lock_guard<std::mutex> lock(_brushMutex);
+		if (!_brush || _brush->radius() != _config.erosionRadius)
+			_brush = std::make_shared<const ErosionBrush>(_config.erosionRadius);
+		return _brush;
 	}
 
-	std::array<float, 2> ErosionGenerator::computeGradient(const Heightmap& hmap, const point2f point)
+	std::array<float, 2> ErosionGenerator::computeGradient(const Heightmap& hmap, const point2f point) const
 	{
 		std::array<float, 2> ret;
 		float local_value = bilinearInterp<1>(hmap._data, hmap._width, hmap._height, point)[0];
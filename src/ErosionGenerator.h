@@ -1,14 +1,111 @@
 #pragma once
 
-#include <FastNoise/FastNoise.h>
 #include <memory>
-#include <random>
+#include <cstdint>
 #include <array>
+#include <mutex>
+#include <functional>
+#include <vector>
 #include "Heightmap.h"
+#include "ErosionBrush.h"
+#include "FlowMap.h"
+#include "Instrumentation.h"
+#include "TerrainGenerator.h"
 
 
 namespace ErosionSimulation
 {
+	class TiledHeightmap;
+
+	struct DropletStats
+	{
+		unsigned long long droplets = 0;
+		unsigned long long steps = 0;
+		double eroded = 0.;
+		double deposited = 0.;
+		//Only recorded when built with EROSION_INSTRUMENTATION
+		DropletCounters counters;
+
+		DropletStats& operator+=(const DropletStats& other);
+	};
+
+	//Receives the trajectory of every droplet of a batch, the points are only valid during the call
+	class TrajectorySink
+	{
+	public:
+		virtual ~TrajectorySink() = default;
+		virtual void record(const point2f* points, unsigned int count) = 0;
+	};
+
+	enum class DropletEngine
+	{
+		//One droplet at a time, as launchDroplet
+		Sequential,
+		//wavefrontLanes droplets in lockstep, with AVX2 when the CPU supports it. The AVX2 and scalar kernels give the same map bit for bit,
+		//so the result does not depend on the CPU. It differs from Sequential, which deposits each droplet before the next one starts
+		Wavefront,
+		//Same as Wavefront without SIMD instructions
+		WavefrontScalar
+	};
+
+	struct DropletOptions
+	{
+		DropletEngine engine = DropletEngine::Sequential;
+		//1 runs the droplets serially, any other value uses the tiled engine (all cores when <= 0). Tiles are parallelTileSize() cells wide,
+		//266 with the default Config: maps of 3 tiles or less along both axes have no two tiles that can run together
+		//and always run serially, 1024x1024 is the smallest square map with default settings that runs in parallel
+		int threads = 1;
+		//Called concurrently from the worker threads when threads != 1
+		TrajectorySink* trajectorySink = nullptr;
+		//Accumulates the flow of the droplets, sized as the map. Written without locks: the tiled engine's phases keep concurrent droplets on different cells,
+		//so the result does not depend on the number of threads. Coarse pyramid levels do not contribute
+		FlowMap* flowMap = nullptr;
+		//Index of the first droplet of the batch, droplet i of a batch spawns and draws its random directions from (seed, firstDroplet + i) only
+		unsigned long long firstDroplet = 0;
+	};
+
+	struct PyramidOptions
+	{
+		//Number of levels including the full resolution one, each coarser level halves the resolution
+		unsigned int levels = 3;
+		//Levels are not coarsened below this size
+		unsigned int minSize = 32;
+	};
+
+	//Height change made by one batch of an adaptive run
+	struct ConvergencePoint
+	{
+		//Droplets launched by the run so far, including the batch
+		unsigned long long droplets = 0;
+		//L2 norm of the height delta divided by sqrt(cells), and its L-inf norm
+		double rmsChange = 0.;
+		float maxChange = 0.f;
+		//Since the start of the run
+		double seconds = 0.;
+	};
+
+	struct ConvergenceOptions
+	{
+		//Droplets per batch, 0 launches about one droplet per 4 cells. Rounded up to a multiple of tiledRoundSize so the map does not depend on the batches
+		unsigned int batchSize = 0;
+		//The run has converged after a batch changing the map by less than both thresholds
+		double rmsThreshold = 0.01;
+		float maxThreshold = 1.f;
+		//Seconds, the run stops after the batch exceeding it; 0 for no limit
+		double timeBudget = 0.;
+		unsigned long long maxDroplets = 1ULL << 26;
+		//Called after every batch, returning false stops the run
+		std::function<bool(const ConvergencePoint&)> onBatch;
+	};
+
+	struct ConvergenceResult
+	{
+		DropletStats stats;
+		std::vector<ConvergencePoint> curve;
+		//False when the run stopped on the time budget, maxDroplets, onBatch or a non-finite change
+		bool converged = false;
+	};
+
 	class ErosionGenerator {
 	public:
 		struct Config
@@ -23,23 +120,66 @@ namespace ErosionSimulation
 			float capacityFactor = 256.f;
 			float depositFactor = 0.01f;
 			float inertia = 0.1f;
+			//Sequential engine: reuse the height and gradient sampled at the end of a step for the next one instead of resampling after erosion
+			bool reuseSamples = false;
 		} _config;
+		//Terrain of generateNoisyTerrain, its config is the noise graph
+		TerrainGenerator _terrain;
 
 		ErosionGenerator();
 		ErosionGenerator(const Config& config);
 		ErosionGenerator(const Config&& config);
 
-		Heightmap generateNoisyTerrain(unsigned int width, unsigned int height, float MaxValue);
+		//Heights start at 0 and are scaled by maxValue times the range of the noise, generated in parallel and cached by _terrain
+		Heightmap generateNoisyTerrain(unsigned int width, unsigned int height, float maxValue, int seed = 0);
+		//Same terrain as the in-memory version, generated and normalized one tile at a time
+		void generateNoisyTerrain(TiledHeightmap& tiles, float maxValue, int seed = 0);
 
 		std::vector<point2f> launchDroplet(Heightmap &hmap);
-		std::array<float, 2> computeGradient(const Heightmap& hmap, const point2f point);
+		//Runs a batch of droplets seeded by seed, without allocating per droplet. Splitting a run in batches continuing firstDroplet
+		//on multiples of tiledRoundSize gives the same map; with threads = 1 and the sequential engine, any split does.
+		//The tiled engine splits the map in tiles of parallelTileSize() cells scheduled in 3x3 phases so concurrent droplets never share cells.
+		//Its droplets are bucketed by spawn tile in rounds of tiledRoundSize indices, so the map is the same for any number of threads.
+		DropletStats launchDroplets(Heightmap& hmap, unsigned int count, unsigned int seed, const DropletOptions& options = {}) const;
+		static constexpr unsigned int tiledRoundSize = 4096;
+		unsigned int parallelTileSize() const;
+		//Whether a 3x3 phase of the tiled engine holds more than one tile of a width x height map, otherwise threads != 1 runs serially
+		bool parallelTiles(unsigned int width, unsigned int height) const;
+		//Coarse-to-fine batch: erodes downsampled copies of the map first, coarsest level first, and adds the upsampled height changes of each level to the next one.
+		//Heights and erosionRadius are scaled with the cell size, so a droplet of a coarse level covers 2^level times more ground for the same number of steps.
+		//The droplets are split between levels proportionally to their area, each level receiving the same droplet density
+		DropletStats launchDropletsPyramid(Heightmap& hmap, unsigned int count, unsigned int seed, const PyramidOptions& pyramid, const DropletOptions& options = {}) const;
+		//Adaptive budget: launches batches continuing options.firstDroplet, measuring the height change of each, until a batch changes the map
+		//by less than the thresholds of convergence or a limit is reached. The droplets are those of a fixed size run of the same seed
+		ConvergenceResult launchDropletsUntilConverged(Heightmap& hmap, unsigned int seed, const ConvergenceOptions& convergence, const DropletOptions& options = {}) const;
+		//Out-of-core batch: each tile is eroded in a window extended by parallelTileSize() cells, so droplets spawned in the tile never leave it.
+		//Windows are processed in 3x3 tile phases, in parallel when the tiles are larger than the halo; results do not depend on options.threads.
+		//Trajectories are reported in map coordinates, the flow of each window is merged into options.flowMap once it is done
+		DropletStats launchDroplets(TiledHeightmap& tiles, unsigned long long count, unsigned int seed, const DropletOptions& options = {}) const;
+
+		std::array<float, 2> computeGradient(const Heightmap& hmap, const point2f point) const;
 
 	private:
-		FastNoise::SmartNode<FastNoise::OpenSimplex2S> _generator;
-		std::random_device _rng;
-		std::default_random_engine _rn_engine;
+		DropletStats launchDropletsTiled(Heightmap& hmap, unsigned int count, unsigned int seed, const DropletOptions& options) const;
+		//Runs count droplets of the stream spawned uniformly in [areaMin, areaMax) with the engine of options
+		void runDroplets(Heightmap& hmap, const ErosionBrush& erosionBrush, const DropletOptions& options, point2f areaMin, point2f areaMax,
+			unsigned int count, unsigned int seed, uint32_t stream, unsigned long long first, point2f* trajectories, DropletStats& stats) const;
+		//Runs droplets already spawned, in order
+		void runDroplets(Heightmap& hmap, const ErosionBrush& erosionBrush, const DropletOptions& options, const point2f* starts, const uint32_t* directionStates,
+			unsigned int count, point2f* trajectories, DropletStats& stats) const;
+		//Number of trajectory points needed by one thread of runDroplets
+		size_t trajectoryScratchSize(DropletEngine engine) const;
+		//Returns the number of trajectory points, trajectory (when not null) must hold maxDropletSteps + 1 points
+		unsigned int runDroplet(Heightmap& hmap, const ErosionBrush& erosionBrush, point2f startPoint, uint32_t directionState, point2f* trajectory, FlowMap* flow, DropletStats& stats) const;
+
+		//Returns the brush of the current erosionRadius, rebuilt only when the radius changes
+		std::shared_ptr<const ErosionBrush> brush() const;
+
+		//Droplets run by launchDroplet so far, they are the droplets of seed 0
+		unsigned long long _launchedDroplets = 0;
 
-		bool _debug = false;
+		mutable std::mutex _brushMutex;
+		mutable std::shared_ptr<const ErosionBrush> _brush;
 
 	};
 }
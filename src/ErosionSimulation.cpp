@@ -3,104 +3,60 @@
 
 #include "ErosionSimulation.h"
 #include "ErosionGenerator.h"
+#include "SimulationService.h"
 
 #include "Hmap3DVisualizer.h"
 
-#include <fstream>
 #include <chrono>
 
 #include <opencv2/highgui.hpp>
 #include <opencv2/imgproc.hpp>
 #include <opencv2/core.hpp>
-#include <future>
+#include <omp.h>
 
 using namespace std;
 using namespace ErosionSimulation;
 using namespace cv;
 
-void plotTraj(cv::Mat image, const std::vector<point2f>& traj)
+void plotTraj(cv::Mat image, const TrajectoryRecorder::Trajectory& traj)
 {
 	cv::Mat plotImage;
 	cv::cvtColor(image, plotImage, cv::COLOR_GRAY2BGR);
 	const auto trajLength = traj.size();
-	for (unsigned int i = 0; i < trajLength; i++)
+	unsigned int i = 0;
+	for (const auto& point : traj)
 	{
-		auto colorWeight = float(i) / trajLength;
+		auto colorWeight = float(i++) / trajLength;
 		cv::Scalar color(colorWeight, 0., 1 - colorWeight);
-		cv::drawMarker(plotImage, { int(traj[i].x), int(traj[i].y) }, color, 0, 3);
+		cv::drawMarker(plotImage, { int(point.x), int(point.y) }, color, 0, 3);
 	}
 
 	cv::imshow("traj", plotImage);
 }
 
-void exportObj(const Heightmap& hmap, std::ofstream& file)
-{
-	file << "o terrain\n\n";
-
-	//export all the vertices
-	for (unsigned int y = 0; y < hmap._height; y++)
-	{
-		for (unsigned int x = 0; x < hmap._width; x++)
-		{
-			file << "v " << static_cast<float>(x) << " " << static_cast<float>(y) << " " << hmap.at(x, y) * 10 << "\n";
-		}
-	}
-
-	file << '\n';
-
-	auto gradient = hmap.computeGradient();
-	//export the normals
-	for (unsigned int y = 0; y < hmap._height; y++)
-	{
-		for (unsigned int x = 0; x < hmap._width; x++)
-		{
-			file << "vn " << -gradient[2 * (x + y * hmap._width)] << " " << -gradient[2 * (x + y * hmap._width) + 1] << " 1.0\n"; //Approximate the tan to compute quicker
-		}
-	}
-
-	file << '\n';
-
-	//export the texture coodinates
-	for (unsigned int y = 0; y < hmap._height; y++)
-	{
-		for (unsigned int x = 0; x < hmap._width; x++)
-		{
-			file << "vt " << static_cast<float>(x) / hmap._width << " " << static_cast<float>(y) / hmap._height << "\n";
-		}
-	}
-
-	file << '\n';
-
-	//export the faces
-	for (unsigned int y = 0; y < hmap._height - 1; y++)
-	{
-		for (unsigned int x = 0; x < hmap._width - 1; x++)
-		{
-			std::ostringstream oss1;
-			oss1 << x + y * hmap._width + 1 << " " << x + (y + 1) * hmap._width + 1 << " " << x + 1 + y * hmap._width + 1;
-			file << "f " << oss1.str() << "\n";
-
-			std::ostringstream oss2;
-			oss2 << x + 1 + y * hmap._width + 1 << " " << x + (y + 1) * hmap._width + 1 << " " << x + 1 + (y + 1) * hmap._width + 1;
-			file << "f " << oss2.str() << "\n";
-
-		}
-	}
-
-	file << std::endl;
-}
-
 int main()
 {
 	ErosionGenerator erosionGenerator{};
-	Heightmap hmap(256, 256);
-	std::vector<std::vector<point2f>> trajs;
-
-	std::atomic<bool> run = false;
+	SimulationService simulation(256, 256);
+	Heightmap hmap = simulation.frame().hmap;
+	std::shared_ptr<const TrajectoryRecorder> trajs;
 
 	Hmap3DVizualizer hmapViz(1024, 768, true);
-	hmapViz.init(&hmap, &trajs);
+	hmapViz.init(&hmap, nullptr);
 	int steps = 1;
+	//Seed of the next run, incremented by each run so repeated runs do not replay the same droplets
+	int seed = 0;
+	int threads = 1;
+	int engine = static_cast<int>(DropletEngine::Sequential);
+	int thermalIterations = 0;
+	ThermalErosion::Config thermalConfig;
+	int adaptive = 0;
+	ConvergenceOptions convergence;
+	float rmsThreshold = static_cast<float>(convergence.rmsThreshold);
+	float timeBudget = 30.f;
+	TerrainGenerator::Config terrainConfig;
+	TrajectoryRecorder::Config trajectoryConfig;
+	int trajectoryStride = static_cast<int>(trajectoryConfig.dropletStride);
 
 	hmapViz.addParameter("gravity", &erosionGenerator._config.gravity, 0.f, 90.f);
 	hmapViz.addParameter("friction", &erosionGenerator._config.friction, 0.f, 1.f);
@@ -112,25 +68,76 @@ int main()
 	hmapViz.addParameter("capacityFactor", &erosionGenerator._config.capacityFactor, 0.f, 1000.f);
 	hmapViz.addParameter("depositFactor", &erosionGenerator._config.depositFactor, 0.f, 1.f);
 	hmapViz.addParameter("inertia", &erosionGenerator._config.inertia, 0.f, 1.f);
+	hmapViz.addParameter("Octaves", &terrainConfig.octaves, 1, 10);
+	hmapViz.addParameter("Noise frequency", &terrainConfig.frequency, 0.0005f, 0.02f);
+	hmapViz.addParameter("Warp amplitude", &terrainConfig.warpAmplitude, 0.f, 100.f);
+	hmapViz.addParameter("Warp frequency", &terrainConfig.warpFrequency, 0.f, 4.f);
 	hmapViz.addParameter("Steps 10^", &steps, 0, 10);
+	hmapViz.addParameter("Seed", &seed, 0, 1000000);
+	//The 256x256 map is a single phase of droplet tiles, so the droplets always run serially, the thermal pass does use the threads
+	hmapViz.addParameter("Threads (droplets serial below 1024x1024)", &threads, 1, omp_get_max_threads());
+	hmapViz.addParameter("Engine (seq/wave/wave scalar)", &engine, 0, 2);
+	hmapViz.addParameter("Thermal iterations", &thermalIterations, 0, 1000);
+	hmapViz.addParameter("talusSlope", &thermalConfig.talusSlope, 0.f, 5.f);
+	hmapViz.addParameter("Adaptive (until converged)", &adaptive, 0, 1);
+	hmapViz.addParameter("RMS change threshold", &rmsThreshold, 0.f, 1.f);
+	hmapViz.addParameter("maxChange threshold", &convergence.maxThreshold, 0.f, 10.f);
+	hmapViz.addParameter("Time budget (s)", &timeBudget, 0.f, 600.f);
+	hmapViz.addParameter("Trajectory every Nth droplet", &trajectoryStride, 1, 1024);
+
+
+	hmapViz.setOnNew([&simulation, &terrainConfig]()
+		{
+			simulation.generate(256, 256, 75.f, terrainConfig);
+		});
 
+	hmapViz.setOnRun([&simulation, &erosionGenerator, &steps, &seed, &threads, &engine, &thermalIterations, &thermalConfig, &adaptive, &convergence, &rmsThreshold, &timeBudget, &trajectoryConfig, &trajectoryStride]()
+		{
+			DropletOptions options;
+			options.engine = static_cast<DropletEngine>(engine);
+			options.threads = threads;
+			trajectoryConfig.dropletStride = trajectoryStride;
+			const unsigned int runSeed = static_cast<unsigned int>(seed++);
+			if (adaptive)
+			{
+				//Steps 10^ is ignored, the run stops on the thresholds or the time budget
+				convergence.rmsThreshold = rmsThreshold;
+				convergence.timeBudget = timeBudget;
+				simulation.runUntilConverged(erosionGenerator._config, convergence, runSeed, options, true, trajectoryConfig);
+			}
+			else
+				simulation.run(erosionGenerator._config, 1U << steps, runSeed, options, true, trajectoryConfig);
+			//Relaxes the slopes steepened by the deposits once the droplets are done
+			if (thermalIterations > 0)
+				simulation.relax(thermalConfig, thermalIterations, threads);
+		});
 
-	hmapViz.setOnNew([&erosionGenerator, &hmap, &trajs]()
+	hmapViz.setOnCancel([&simulation]()
 		{
-			hmap = erosionGenerator.generateNoisyTerrain(256, 256, 75.f);
+			simulation.cancel();
 		});
 
-	hmapViz.setOnRun([&erosionGenerator, &hmap, &steps, &trajs]()
+	//Only the render thread touches hmap, it is swapped for the latest published snapshot
+	hmapViz.setOnFrame([&simulation, &hmapViz, &hmap, &trajs]()
 		{
-			const unsigned int maxSteps = 1U << steps;
-			std::async(std::launch::async, [maxSteps, &erosionGenerator, &hmap, &trajs]()
+			if (simulation.updateFrame())
+			{
+				const auto& frame = simulation.frame();
+				hmap = frame.hmap;
+				trajs = frame.trajectories;
+				hmapViz.setTrajectories(trajs.get());
+
+				std::vector<float> changes;
+				if (frame.convergence)
 				{
-					for (int i = 0; i < maxSteps; i++)
-					{
-						const auto local_traj = erosionGenerator.launchDroplet(hmap);
-						trajs.push_back(local_traj);
-					}
-				});
+					for (const auto& point : *frame.convergence)
+						changes.push_back(static_cast<float>(point.rmsChange));
+				}
+				hmapViz.setConvergence(std::move(changes), frame.convergence && !frame.convergence->empty() ? frame.convergence->back().droplets : 0);
+			}
+
+			const auto requested = simulation.dropletsRequested();
+			hmapViz.setProgress(simulation.busy() && requested > 0 ? static_cast<float>(simulation.dropletsDone()) / requested : -1.f);
 		});
 
 	hmapViz.run();
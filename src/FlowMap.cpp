@@ -0,0 +1,72 @@
+#include "FlowMap.h"
+#include <algorithm>
+#include <fstream>
+#include <stdexcept>
+
+namespace ErosionSimulation
+{
+	FlowMap::FlowMap(unsigned int width, unsigned int height) :
+		_width(width),
+		_height(height),
+		_cells(static_cast<size_t>(width) * height, Cell{})
+	{
+	}
+
+	void FlowMap::merge(const FlowMap& other, unsigned int x, unsigned int y)
+	{
+		if (x + other._width > _width || y + other._height > _height)
+			throw std::runtime_error("merged flow map does not fit");
+
+#pragma omp parallel for
+		for (int row = 0; row < static_cast<int>(other._height); row++)
+		{
+			const Cell* source = other._cells.data() + static_cast<size_t>(row) * other._width;
+			Cell* destination = _cells.data() + static_cast<size_t>(y + row) * _width + x;
+			for (unsigned int column = 0; column < other._width; column++)
+			{
+				destination[column].visits += source[column].visits;
+				destination[column].sediment += source[column].sediment;
+				destination[column].water += source[column].water;
+			}
+		}
+	}
+
+	void FlowMap::clear()
+	{
+		std::fill(_cells.begin(), _cells.end(), Cell{});
+	}
+
+	Heightmap FlowMap::channel(FlowChannel channel) const
+	{
+		Heightmap image(_width, _height);
+		float* data = image.data();
+		const size_t count = _cells.size();
+#pragma omp parallel for
+		for (long long i = 0; i < static_cast<long long>(count); i++)
+		{
+			const Cell& cell = _cells[i];
+			data[i] = channel == FlowChannel::Visits ? cell.visits : channel == FlowChannel::Sediment ? cell.sediment : cell.water;
+		}
+		return image;
+	}
+
+	size_t exportFlowMap(const FlowMap& flow, const std::string& path)
+	{
+		std::ofstream file(path, std::ios::binary);
+		if (!file.is_open())
+			throw std::runtime_error("could not open " + path);
+
+		//A negative scale marks little endian floats
+		const std::string header = "PF\n" + std::to_string(flow.width()) + " " + std::to_string(flow.height()) + "\n-1.0\n";
+		file << header;
+		//Rows go from the bottom of the image to its top
+		const size_t rowBytes = static_cast<size_t>(flow.width()) * sizeof(FlowMap::Cell);
+		static_assert(sizeof(FlowMap::Cell) == 3 * sizeof(float), "cells must be packed RGB floats");
+		for (unsigned int y = flow.height(); y-- > 0; )
+			file.write(reinterpret_cast<const char*>(flow.data() + static_cast<size_t>(y) * flow.width()), static_cast<std::streamsize>(rowBytes));
+
+		if (!file)
+			throw std::runtime_error("could not write " + path);
+		return header.size() + rowBytes * flow.height();
+	}
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	enum class FlowChannel
+	{
+		//Droplet steps leaving the cell
+		Visits,
+		//Sediment carried by those droplets
+		Sediment,
+		//Water volume of those droplets
+		Water
+	};
+
+	//Flow density of the droplets, accumulated by the engines during the simulation instead of storing the trajectories.
+	//Each step of a droplet adds to the cell it leaves, before eroding or depositing there.
+	class FlowMap
+	{
+	public:
+		struct Cell
+		{
+			float visits;
+			float sediment;
+			float water;
+		};
+
+		FlowMap() = default;
+		FlowMap(unsigned int width, unsigned int height);
+
+		//point must be inside the map
+		void add(point2f point, float sediment, float water)
+		{
+			Cell& cell = _cells[static_cast<unsigned int>(point.x) + static_cast<size_t>(static_cast<unsigned int>(point.y)) * _width];
+			cell.visits += 1.f;
+			cell.sediment += sediment;
+			cell.water += water;
+		}
+		//Adds other, whose cell (0, 0) is cell (x, y) of this map and which must fit inside it
+		void merge(const FlowMap& other, unsigned int x, unsigned int y);
+		void clear();
+
+		//Single channel copy, as a float image of the map's size
+		Heightmap channel(FlowChannel channel) const;
+
+		const Cell* data() const { return _cells.data(); }
+		unsigned int width() const { return _width; }
+		unsigned int height() const { return _height; }
+
+	private:
+		unsigned int _width = 0;
+		unsigned int _height = 0;
+		//Interleaved, the three channels of a step share a cache line
+		std::vector<Cell> _cells;
+	};
+
+	//Writes the three channels as the red, green and blue of a PFM float image, returns the number of bytes written.
+	//throws std::runtime_error when the file cannot be written
+	size_t exportFlowMap(const FlowMap& flow, const std::string& path);
+}
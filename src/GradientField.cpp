@@ -0,0 +1,240 @@
+#include "GradientField.h"
+#include <algorithm>
+#include <cmath>
+#include <stdexcept>
+#include <omp.h>
+#include <vector>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		//Columns of normals computed per batch, their gradient stays on the stack
+		constexpr unsigned int normalBatch = 256;
+
+		//Rows up and down of y, clamped to the map
+		unsigned int rowAbove(unsigned int y) { return y > 0 ? y - 1 : 0; }
+		unsigned int rowBelow(unsigned int y, unsigned int height) { return std::min(y + 1, height - 1); }
+
+		//Gradient of cells [x0, x1) of row, written to gradientX[x - x0] and gradientY[x - x0]. above and below are the rows
+		//returned by rowAbove and rowBelow, rowDistance their distance
+		void gradientRow(const float* above, const float* row, const float* below, unsigned int rowDistance, unsigned int width, GradientKernel kernel,
+			unsigned int x0, unsigned int x1, float* gradientX, float* gradientY)
+		{
+			const float inverseY = rowDistance > 0 ? 1.f / rowDistance : 0.f;
+
+			//Borders, clamped to the map
+			auto border = [&](unsigned int x)
+			{
+				const unsigned int left = x > 0 ? x - 1 : 0;
+				const unsigned int right = std::min(x + 1, width - 1);
+				const float inverseX = right > left ? 1.f / (right - left) : 0.f;
+				if (kernel == GradientKernel::CentralDifference)
+				{
+					gradientX[x - x0] = (row[right] - row[left]) * inverseX;
+					gradientY[x - x0] = (below[x] - above[x]) * inverseY;
+				}
+				else
+				{
+					gradientX[x - x0] = ((above[right] + 2.f * row[right] + below[right]) - (above[left] + 2.f * row[left] + below[left])) * 0.25f * inverseX;
+					gradientY[x - x0] = ((below[left] + 2.f * below[x] + below[right]) - (above[left] + 2.f * above[x] + above[right])) * 0.25f * inverseY;
+				}
+			};
+
+			const unsigned int first = std::min(std::max(x0, 1u), x1);
+			const unsigned int last = std::max(std::min(x1, width - 1), first);
+			for (unsigned int x = x0; x < first; x++)
+				border(x);
+
+			float* outX = gradientX - x0;
+			float* outY = gradientY - x0;
+			if (kernel == GradientKernel::CentralDifference)
+			{
+#pragma omp simd
+				for (int x = static_cast<int>(first); x < static_cast<int>(last); x++)
+				{
+					outX[x] = (row[x + 1] - row[x - 1]) * 0.5f;
+					outY[x] = (below[x] - above[x]) * inverseY;
+				}
+			}
+			else
+			{
+				const float scaleY = 0.25f * inverseY;
+#pragma omp simd
+				for (int x = static_cast<int>(first); x < static_cast<int>(last); x++)
+				{
+					outX[x] = ((above[x + 1] + 2.f * row[x + 1] + below[x + 1]) - (above[x - 1] + 2.f * row[x - 1] + below[x - 1])) * 0.125f;
+					outY[x] = ((below[x - 1] + 2.f * below[x] + below[x + 1]) - (above[x - 1] + 2.f * above[x] + above[x + 1])) * scaleY;
+				}
+			}
+
+			for (unsigned int x = last; x < x1; x++)
+				border(x);
+		}
+
+		DirtyRect clampRect(const Heightmap& hmap, const DirtyRect& rect)
+		{
+			return { std::min(rect.x0, hmap._width), std::min(rect.y0, hmap._height), std::min(rect.x1, hmap._width), std::min(rect.y1, hmap._height) };
+		}
+	}
+
+	void computeGradient(const Heightmap& hmap, GradientKernel kernel, const DirtyRect& rect, std::span<float> gradientX, std::span<float> gradientY)
+	{
+		const size_t cells = static_cast<size_t>(hmap._width) * hmap._height;
+		if (gradientX.size() < cells || gradientY.size() < cells)
+			throw std::runtime_error("gradient buffers smaller than the map");
+
+		const DirtyRect area = clampRect(hmap, rect);
+		if (area.x0 >= area.x1)
+			return;
+
+		const unsigned int width = hmap._width;
+#pragma omp parallel for
+		for (int y = static_cast<int>(area.y0); y < static_cast<int>(area.y1); y++)
+		{
+			const size_t offset = static_cast<size_t>(y) * width + area.x0;
+			const unsigned int up = rowAbove(y);
+			const unsigned int down = rowBelow(y, hmap._height);
+			gradientRow(hmap._data + static_cast<size_t>(up) * width, hmap._data + static_cast<size_t>(y) * width, hmap._data + static_cast<size_t>(down) * width,
+				down - up, width, kernel, area.x0, area.x1, gradientX.data() + offset, gradientY.data() + offset);
+		}
+	}
+
+	template<class Storage>
+	void computeGradient(const PackedHeightmap<Storage>& hmap, GradientKernel kernel, const DirtyRect& rect, std::span<float> gradientX, std::span<float> gradientY)
+	{
+		const unsigned int width = hmap.width();
+		const unsigned int height = hmap.height();
+		const size_t cells = static_cast<size_t>(width) * height;
+		if (gradientX.size() < cells || gradientY.size() < cells)
+			throw std::runtime_error("gradient buffers smaller than the map");
+
+		const DirtyRect area = { std::min(rect.x0, width), std::min(rect.y0, height), std::min(rect.x1, width), std::min(rect.y1, height) };
+		if (area.x0 >= area.x1 || area.y0 >= area.y1)
+			return;
+
+		//The decoded span of a row reaches one cell beyond the area on both sides
+		const unsigned int first = area.x0 > 0 ? area.x0 - 1 : 0;
+		const unsigned int last = std::min(area.x1 + 1, width);
+		const int rows = static_cast<int>(area.y1 - area.y0);
+#pragma omp parallel
+		{
+			//Each thread decodes a contiguous band, its three row window slides down without decoding a row twice
+			const int thread = omp_get_thread_num();
+			const int bandThreads = omp_get_num_threads();
+			const unsigned int y0 = area.y0 + static_cast<unsigned int>(static_cast<long long>(rows) * thread / bandThreads);
+			const unsigned int y1 = area.y0 + static_cast<unsigned int>(static_cast<long long>(rows) * (thread + 1) / bandThreads);
+			std::vector<float> window(3 * static_cast<size_t>(width));
+			//Map row held by each of the 3 window slots
+			unsigned int held[3] = { height, height, height };
+			auto decoded = [&](unsigned int y)
+			{
+				float* slot = window.data() + static_cast<size_t>(y % 3) * width;
+				if (held[y % 3] != y)
+				{
+					hmap.decodeRow(y, first, last - first, slot + first);
+					held[y % 3] = y;
+				}
+				return slot;
+			};
+
+			for (unsigned int y = y0; y < y1; y++)
+			{
+				const unsigned int up = rowAbove(y);
+				const unsigned int down = rowBelow(y, height);
+				const float* above = decoded(up);
+				const float* row = decoded(y);
+				const float* below = decoded(down);
+				const size_t offset = static_cast<size_t>(y) * width + area.x0;
+				gradientRow(above, row, below, down - up, width, kernel, area.x0, area.x1, gradientX.data() + offset, gradientY.data() + offset);
+			}
+		}
+	}
+
+	template void computeGradient(const HalfHeightmap&, GradientKernel, const DirtyRect&, std::span<float>, std::span<float>);
+	template void computeGradient(const UNorm16Heightmap&, GradientKernel, const DirtyRect&, std::span<float>, std::span<float>);
+
+	void computeNormals(const Heightmap& hmap, GradientKernel kernel, const DirtyRect& rect, std::span<float> normals)
+	{
+		const size_t cells = static_cast<size_t>(hmap._width) * hmap._height;
+		if (normals.size() < 3 * cells)
+			throw std::runtime_error("normal buffer smaller than the map");
+
+		const DirtyRect area = clampRect(hmap, rect);
+		if (area.x0 >= area.x1)
+			return;
+
+		const unsigned int width = hmap._width;
+#pragma omp parallel for
+		for (int y = static_cast<int>(area.y0); y < static_cast<int>(area.y1); y++)
+		{
+			float gradientX[normalBatch];
+			float gradientY[normalBatch];
+			const unsigned int up = rowAbove(y);
+			const unsigned int down = rowBelow(y, hmap._height);
+			for (unsigned int x0 = area.x0; x0 < area.x1; x0 += normalBatch)
+			{
+				const unsigned int count = std::min(normalBatch, area.x1 - x0);
+				gradientRow(hmap._data + static_cast<size_t>(up) * width, hmap._data + static_cast<size_t>(y) * width, hmap._data + static_cast<size_t>(down) * width,
+					down - up, width, kernel, x0, x0 + count, gradientX, gradientY);
+
+				float* out = normals.data() + 3 * (static_cast<size_t>(y) * width + x0);
+#pragma omp simd
+				for (int i = 0; i < static_cast<int>(count); i++)
+				{
+					const float inverseNorm = 1.f / std::sqrt(gradientX[i] * gradientX[i] + gradientY[i] * gradientY[i] + 1.f);
+					out[3 * i] = -gradientX[i] * inverseNorm;
+					out[3 * i + 1] = -gradientY[i] * inverseNorm;
+					out[3 * i + 2] = inverseNorm;
+				}
+			}
+		}
+	}
+
+	GradientField::GradientField(GradientKernel kernel) :
+		_kernel(kernel)
+	{
+	}
+
+	void GradientField::setKernel(GradientKernel kernel)
+	{
+		if (kernel != _kernel)
+			_valid = false;
+		_kernel = kernel;
+	}
+
+	bool GradientField::update(const Heightmap& hmap)
+	{
+		//A map older than the field cannot be a later state of the same terrain
+		if (!_valid || hmap._width != _width || hmap._height != _height || hmap.generation() < _generation)
+		{
+			_width = hmap._width;
+			_height = hmap._height;
+			//Only reallocated when the size changes
+			const size_t cells = static_cast<size_t>(_width) * _height;
+			_gradientX.resize(cells);
+			_gradientY.resize(cells);
+			_normals.resize(3 * cells);
+			compute(hmap, { 0, 0, _width, _height });
+			_generation = hmap.generation();
+			_valid = true;
+			return true;
+		}
+
+		const auto regions = hmap.dirtyRegions(_generation);
+		_generation = hmap.generation();
+		for (const auto& region : regions)
+		{
+			//The kernels of the surrounding cells read the cells of the region
+			compute(hmap, { region.x0 > 0 ? region.x0 - 1 : 0, region.y0 > 0 ? region.y0 - 1 : 0,
+				std::min(region.x1 + 1, _width), std::min(region.y1 + 1, _height) });
+		}
+		return !regions.empty();
+	}
+
+	void GradientField::compute(const Heightmap& hmap, const DirtyRect& rect)
+	{
+		computeGradient(hmap, _kernel, rect, _gradientX, _gradientY);
+		computeNormals(hmap, _kernel, rect, _normals);
+	}
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <span>
+#include <vector>
+#include "Heightmap.h"
+#include "HeightStorage.h"
+
+namespace ErosionSimulation
+{
+	enum class GradientKernel
+	{
+		//(h(x + 1) - h(x - 1)) / 2, one-sided on the borders
+		CentralDifference,
+		//3x3 Sobel weights, scaled so a plane gives its slope. Smoother on noisy maps
+		Sobel
+	};
+
+	//Writes the gradient of the cells of rect into the caller's planar buffers, laid out as the map (width * height floats each).
+	//Cells outside the map are clamped to the border. The interior of each row is a SIMD loop
+	void computeGradient(const Heightmap& hmap, GradientKernel kernel, const DirtyRect& rect, std::span<float> gradientX, std::span<float> gradientY);
+	//Same for a map in 16 bits, decoded three rows at a time into floats. Defined for HalfHeightmap and UNorm16Heightmap
+	template<class Storage>
+	void computeGradient(const PackedHeightmap<Storage>& hmap, GradientKernel kernel, const DirtyRect& rect, std::span<float> gradientX, std::span<float> gradientY);
+	//Unit normals (-dx, -dy, 1) / |(-dx, -dy, 1)| of the cells of rect, 3 interleaved floats per cell of the map
+	void computeNormals(const Heightmap& hmap, GradientKernel kernel, const DirtyRect& rect, std::span<float> normals);
+
+	//Gradient and normals of a heightmap, kept in buffers reused between updates.
+	//update() only recomputes the blocks the map reports dirty since the previous update, so calling it every frame on an unchanged map is free.
+	class GradientField
+	{
+	public:
+		GradientField(GradientKernel kernel = GradientKernel::CentralDifference);
+
+		//Returns false when nothing changed since the previous update
+		bool update(const Heightmap& hmap);
+
+		GradientKernel kernel() const { return _kernel; }
+		//The next update recomputes the whole field
+		void setKernel(GradientKernel kernel);
+
+		std::span<const float> gradientX() const { return _gradientX; }
+		std::span<const float> gradientY() const { return _gradientY; }
+		std::span<const float> normals() const { return _normals; }
+
+		unsigned int width() const { return _width; }
+		unsigned int height() const { return _height; }
+
+	private:
+		void compute(const Heightmap& hmap, const DirtyRect& rect);
+
+		GradientKernel _kernel;
+		unsigned int _width = 0;
+		unsigned int _height = 0;
+		unsigned long long _generation = 0;
+		bool _valid = false;
+
+		std::vector<float> _gradientX;
+		std::vector<float> _gradientY;
+		std::vector<float> _normals;
+	};
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	struct HeightSample
+	{
+		float height;
+		float gradient_x;
+		float gradient_y;
+	};
+
+	template<int channels>
+	std::array<float, channels> bilinearInterp(const float* data, unsigned int width, unsigned int height, const point2f &point)
+	{
+		if (point.x < 0 || point.x >= width || point.y < 0 || point.y >= height || width < 2 || height < 2)
+ 			return {};
+
+		//The last row and column sample the cell before them. Clamped on the integer index: width - 1 - epsilon rounds back
+		//to width - 1 in float on maps wider than 2048 cells
+		const unsigned int x_left = std::min<unsigned int>(int(point.x), width - 2);
+		const unsigned int x_right = x_left + 1;
+
+		const unsigned int y_top = std::min<unsigned int>(int(point.y), height - 2);
+		const unsigned int y_bottom = y_top + 1;
+
+		float x_remain = std::min(point.x - x_left, 1.f);
+		float y_remain = std::min(point.y - y_top, 1.f);
+
+		std::array<float, channels> ret;
+		for (unsigned int c = 0; c < channels; c++)
+		{
+			float top_value = data[channels * (y_top * width + x_left) + c] * (1 - x_remain) + data[channels * (y_top * width + x_right) + c] * x_remain;
+			float bottom_value = data[channels * (y_bottom * width + x_left) + c] * (1 - x_remain) + data[channels * (y_bottom * width + x_right) + c] * x_remain;
+
+			float value = top_value * (1 - y_remain) + bottom_value * y_remain;
+			ret[c] = value;
+		}
+
+		return ret;
+	}
+
+	//Bilinear height and its analytic gradient from a single fetch of the 2x2 cell containing point
+	inline HeightSample sampleHeightGradient(const float* data, unsigned int width, unsigned int height, const point2f& point)
+	{
+		if (point.x < 0 || point.x >= width || point.y < 0 || point.y >= height || width < 2 || height < 2)
+			return {};
+
+		//Clamped on the integer index, as in bilinearInterp
+		const unsigned int x_left = std::min<unsigned int>(static_cast<unsigned int>(point.x), width - 2);
+		const unsigned int y_top = std::min<unsigned int>(static_cast<unsigned int>(point.y), height - 2);
+		const float x_remain = std::min(point.x - x_left, 1.f);
+		const float y_remain = std::min(point.y - y_top, 1.f);
+
+		const float* top = data + static_cast<size_t>(y_top) * width + x_left;
+		const float* bottom = top + width;
+		const float top_left = top[0];
+		const float top_right = top[1];
+		const float bottom_left = bottom[0];
+		const float bottom_right = bottom[1];
+
+		HeightSample sample;
+		sample.gradient_x = (top_right - top_left) * (1 - y_remain) + (bottom_right - bottom_left) * y_remain;
+		sample.gradient_y = (bottom_left - top_left) * (1 - x_remain) + (bottom_right - top_right) * x_remain;
+		sample.height = (top_left * (1 - x_remain) + top_right * x_remain) * (1 - y_remain) + (bottom_left * (1 - x_remain) + bottom_right * x_remain) * y_remain;
+		return sample;
+	}
+
+	inline HeightSample sampleHeightGradient(const Heightmap& hmap, const point2f& point)
+	{
+		return sampleHeightGradient(hmap._data, hmap._width, hmap._height, point);
+	}
+}
@@ -0,0 +1,174 @@
+#include "HeightStorage.h"
+#include <cstring>
+#include <stdexcept>
+
+#if defined(_MSC_VER) && defined(EROSION_F16C)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		float halfToFloatScalar(uint16_t half)
+		{
+			const uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+			const uint32_t exponent = (half >> 10) & 0x1f;
+			uint32_t mantissa = half & 0x3ff;
+			uint32_t bits;
+			if (exponent == 0x1f)
+				bits = sign | 0x7f800000 | (mantissa << 13);
+			else if (exponent != 0)
+				bits = sign | ((exponent + 112) << 23) | (mantissa << 13);
+			else if (mantissa == 0)
+				bits = sign;
+			else
+			{
+				//Subnormal half, normalized as a float
+				int shift = 0;
+				while (!(mantissa & 0x400))
+				{
+					mantissa <<= 1;
+					shift++;
+				}
+				bits = sign | ((113 - shift) << 23) | ((mantissa & 0x3ff) << 13);
+			}
+			float value;
+			std::memcpy(&value, &bits, sizeof(value));
+			return value;
+		}
+
+		uint16_t floatToHalfScalar(float value)
+		{
+			uint32_t bits;
+			std::memcpy(&bits, &value, sizeof(bits));
+			const uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+			const uint32_t magnitude = bits & 0x7fffffff;
+
+			if (magnitude >= 0x7f800000)
+				return sign | 0x7c00 | (magnitude > 0x7f800000 ? 0x200 : 0);
+			//Rounds to infinity from 65520 on
+			if (magnitude >= 0x477ff000)
+				return sign | 0x7c00;
+			if (magnitude < 0x38800000)
+			{
+				//Subnormal half or zero: the implicit bit is added and the mantissa shifted into place
+				if (magnitude < 0x33000000)
+					return sign;
+				const uint32_t exponent = magnitude >> 23;
+				const uint32_t mantissa = (magnitude & 0x7fffff) | 0x800000;
+				const uint32_t shift = 126 - exponent;
+				uint32_t half = mantissa >> shift;
+				const uint32_t remainder = mantissa & ((1u << shift) - 1);
+				const uint32_t halfway = 1u << (shift - 1);
+				if (remainder > halfway || (remainder == halfway && (half & 1)))
+					half++;
+				return sign | static_cast<uint16_t>(half);
+			}
+
+			//Rebiased exponent and mantissa in one, the carry of the rounding moves to the exponent
+			uint32_t half = (magnitude - 0x38000000) >> 13;
+			const uint32_t remainder = magnitude & 0x1fff;
+			if (remainder > 0x1000 || (remainder == 0x1000 && (half & 1)))
+				half++;
+			return sign | static_cast<uint16_t>(half);
+		}
+	}
+
+	size_t heightFormatSize(HeightFormat format)
+	{
+		return format == HeightFormat::Float32 ? sizeof(float) : sizeof(uint16_t);
+	}
+
+	HeightFormat heightFormatFromName(const std::string& name)
+	{
+		if (name == "f32")
+			return HeightFormat::Float32;
+		if (name == "f16")
+			return HeightFormat::Float16;
+		if (name == "u16")
+			return HeightFormat::UNorm16;
+		throw std::runtime_error("unknown height format " + name);
+	}
+
+	bool f16cSupported()
+	{
+#if defined(EROSION_F16C) && defined(_MSC_VER)
+		static const bool supported = []()
+		{
+			int info[4];
+			__cpuid(info, 1);
+			//F16C and AVX, whose registers must be enabled by the OS
+			const bool osxsave = (info[2] & (1 << 27)) != 0;
+			if (!osxsave || (info[2] & (1 << 28)) == 0 || (info[2] & (1 << 29)) == 0)
+				return false;
+			return (_xgetbv(0) & 0x6) == 0x6;
+		}();
+		return supported;
+#elif defined(EROSION_F16C)
+		static const bool supported = __builtin_cpu_supports("f16c");
+		return supported;
+#else
+		return false;
+#endif
+	}
+
+	void halfToFloat(const uint16_t* in, float* out, size_t count)
+	{
+#ifdef EROSION_F16C
+		if (f16cSupported())
+		{
+			halfToFloatF16c(in, out, count);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < count; i++)
+			out[i] = halfToFloatScalar(in[i]);
+	}
+
+	void floatToHalf(const float* in, uint16_t* out, size_t count)
+	{
+#ifdef EROSION_F16C
+		if (f16cSupported())
+		{
+			floatToHalfF16c(in, out, count);
+			return;
+		}
+#endif
+		for (size_t i = 0; i < count; i++)
+			out[i] = floatToHalfScalar(in[i]);
+	}
+
+	void decodeHeights(HeightFormat format, const void* in, float* out, size_t count, const HeightRange& range)
+	{
+		switch (format)
+		{
+		case HeightFormat::Float32:
+			Float32Storage::decode(static_cast<const float*>(in), out, count, range);
+			break;
+		case HeightFormat::Float16:
+			Float16Storage::decode(static_cast<const uint16_t*>(in), out, count, range);
+			break;
+		case HeightFormat::UNorm16:
+			UNorm16Storage::decode(static_cast<const uint16_t*>(in), out, count, range);
+			break;
+		}
+	}
+
+	void encodeHeights(HeightFormat format, const float* in, void* out, size_t count, const HeightRange& range)
+	{
+		switch (format)
+		{
+		case HeightFormat::Float32:
+			Float32Storage::encode(in, static_cast<float*>(out), count, range);
+			break;
+		case HeightFormat::Float16:
+			Float16Storage::encode(in, static_cast<uint16_t*>(out), count, range);
+			break;
+		case HeightFormat::UNorm16:
+			UNorm16Storage::encode(in, static_cast<uint16_t*>(out), count, range);
+			break;
+		}
+	}
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "Heightmap.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define EROSION_F16C
+#endif
+
+namespace ErosionSimulation
+{
+	//Encodings of stored heights, the arithmetic always happens on floats
+	enum class HeightFormat
+	{
+		Float32,
+		//IEEE half precision, 11 significant bits: 0.03 steps at a height of 75
+		Float16,
+		//Heights in [min, max] of a HeightRange as 0..65535, a uniform (max - min) / 65535 step
+		UNorm16
+	};
+
+	//Size of a stored height, and the format named f32, f16 or u16 (throws std::runtime_error for others)
+	size_t heightFormatSize(HeightFormat format);
+	HeightFormat heightFormatFromName(const std::string& name);
+
+	//Conversions of count half floats, with F16C when the CPU supports it. Rounding is to nearest even, out of range values become infinities
+	void halfToFloat(const uint16_t* in, float* out, size_t count);
+	void floatToHalf(const float* in, uint16_t* out, size_t count);
+	bool f16cSupported();
+#ifdef EROSION_F16C
+	void halfToFloatF16c(const uint16_t* in, float* out, size_t count);
+	void floatToHalfF16c(const float* in, uint16_t* out, size_t count);
+#endif
+
+	//Storage policies of PackedHeightmap: the stored type and its conversions from and to floats.
+	//range is only used by UNorm16Storage, heights outside of it are clamped
+	struct Float32Storage
+	{
+		using value_type = float;
+		static constexpr HeightFormat format = HeightFormat::Float32;
+
+		static void decode(const float* in, float* out, size_t count, const HeightRange&) { std::copy(in, in + count, out); }
+		static void encode(const float* in, float* out, size_t count, const HeightRange&) { std::copy(in, in + count, out); }
+	};
+
+	struct Float16Storage
+	{
+		using value_type = uint16_t;
+		static constexpr HeightFormat format = HeightFormat::Float16;
+
+		static void decode(const uint16_t* in, float* out, size_t count, const HeightRange&) { halfToFloat(in, out, count); }
+		static void encode(const float* in, uint16_t* out, size_t count, const HeightRange&) { floatToHalf(in, out, count); }
+	};
+
+	struct UNorm16Storage
+	{
+		using value_type = uint16_t;
+		static constexpr HeightFormat format = HeightFormat::UNorm16;
+
+		static void decode(const uint16_t* in, float* out, size_t count, const HeightRange& range)
+		{
+			const float step = (range.max - range.min) / 65535.f;
+#pragma omp simd
+			for (long long i = 0; i < static_cast<long long>(count); i++)
+				out[i] = range.min + in[i] * step;
+		}
+
+		static void encode(const float* in, uint16_t* out, size_t count, const HeightRange& range)
+		{
+			const float scale = range.max > range.min ? 65535.f / (range.max - range.min) : 0.f;
+#pragma omp simd
+			for (long long i = 0; i < static_cast<long long>(count); i++)
+				out[i] = static_cast<uint16_t>(static_cast<int>(std::min(std::max((in[i] - range.min) * scale, 0.f), 65535.f) + 0.5f));
+		}
+	};
+
+	//Runtime dispatch of the policies, for buffers whose format is only known at run time
+	void decodeHeights(HeightFormat format, const void* in, float* out, size_t count, const HeightRange& range);
+	void encodeHeights(HeightFormat format, const float* in, void* out, size_t count, const HeightRange& range);
+
+	//Heightmap stored in a compact type: rows are decoded to floats to be read and encoded back when written,
+	//so a map kept at rest, exported or streamed through the out-of-core engine takes half the memory and bandwidth in 16 bits.
+	//Unlike Heightmap, copies are deep and there is no dirty tracking.
+	template<class Storage>
+	class PackedHeightmap
+	{
+	public:
+		using value_type = typename Storage::value_type;
+
+		PackedHeightmap() = default;
+		PackedHeightmap(unsigned int width, unsigned int height, const HeightRange& range = { 0.f, 1.f }) :
+			_width(width), _height(height), _range(range), _data(static_cast<size_t>(width) * height)
+		{
+		}
+		//Encodes hmap, over its own range of heights for UNorm16Storage
+		explicit PackedHeightmap(const Heightmap& hmap) :
+			PackedHeightmap(hmap, Storage::format == HeightFormat::UNorm16 && hmap._width > 0 && hmap._height > 0 ? reduceMinMax(hmap) : HeightRange{ 0.f, 1.f })
+		{
+		}
+		PackedHeightmap(const Heightmap& hmap, const HeightRange& range) :
+			PackedHeightmap(hmap._width, hmap._height, range)
+		{
+#pragma omp parallel for
+			for (int y = 0; y < static_cast<int>(_height); y++)
+				encodeRow(y, 0, _width, hmap._data + static_cast<size_t>(y) * _width);
+		}
+
+		Heightmap unpack() const
+		{
+			Heightmap hmap(_width, _height);
+			float* data = hmap.data();
+#pragma omp parallel for
+			for (int y = 0; y < static_cast<int>(_height); y++)
+				decodeRow(y, 0, _width, data + static_cast<size_t>(y) * _width);
+			return hmap;
+		}
+
+		//count cells of row y from x0, to or from floats
+		void decodeRow(unsigned int y, unsigned int x0, unsigned int count, float* out) const
+		{
+			Storage::decode(_data.data() + static_cast<size_t>(y) * _width + x0, out, count, _range);
+		}
+		void encodeRow(unsigned int y, unsigned int x0, unsigned int count, const float* in)
+		{
+			Storage::encode(in, _data.data() + static_cast<size_t>(y) * _width + x0, count, _range);
+		}
+
+		float at(unsigned int x, unsigned int y) const
+		{
+			float value;
+			decodeRow(y, x, 1, &value);
+			return value;
+		}
+
+		unsigned int width() const { return _width; }
+		unsigned int height() const { return _height; }
+		const HeightRange& range() const { return _range; }
+		const value_type* data() const { return _data.data(); }
+		size_t bytes() const { return _data.size() * sizeof(value_type); }
+
+	private:
+		unsigned int _width = 0;
+		unsigned int _height = 0;
+		HeightRange _range = { 0.f, 1.f };
+		std::vector<value_type> _data;
+	};
+
+	using HalfHeightmap = PackedHeightmap<Float16Storage>;
+	using UNorm16Heightmap = PackedHeightmap<UNorm16Storage>;
+}
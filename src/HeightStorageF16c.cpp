@@ -0,0 +1,42 @@
+//Compiled with F16C enabled, only called when f16cSupported()
+#include "HeightStorage.h"
+
+#ifdef EROSION_F16C
+#include <immintrin.h>
+
+namespace ErosionSimulation
+{
+	void halfToFloatF16c(const uint16_t* in, float* out, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+			_mm256_storeu_ps(out + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i))));
+
+		//The tail goes through a zero padded vector, so the rounding is the same as for the rest
+		if (i < count)
+		{
+			alignas(16) uint16_t halves[8] = {};
+			alignas(32) float floats[8];
+			std::copy(in + i, in + count, halves);
+			_mm256_store_ps(floats, _mm256_cvtph_ps(_mm_load_si128(reinterpret_cast<const __m128i*>(halves))));
+			std::copy(floats, floats + (count - i), out + i);
+		}
+	}
+
+	void floatToHalfF16c(const float* in, uint16_t* out, size_t count)
+	{
+		size_t i = 0;
+		for (; i + 8 <= count; i += 8)
+			_mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm256_cvtps_ph(_mm256_loadu_ps(in + i), _MM_FROUND_TO_NEAREST_INT));
+
+		if (i < count)
+		{
+			alignas(32) float floats[8] = {};
+			alignas(16) uint16_t halves[8];
+			std::copy(in + i, in + count, floats);
+			_mm_store_si128(reinterpret_cast<__m128i*>(halves), _mm256_cvtps_ph(_mm256_load_ps(floats), _MM_FROUND_TO_NEAREST_INT));
+			std::copy(halves, halves + (count - i), out + i);
+		}
+	}
+}
+#endif
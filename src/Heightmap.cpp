@@ -1,41 +1,84 @@
 #include "Heightmap.h"
+#include <algorithm>
+#include <utility>
 
 namespace ErosionSimulation
 {
-	Heightmap::Heightmap(unsigned int width, unsigned int height) :
-		_width(width),
-		_height(height)
+	namespace
+	{
+		unsigned long long nextGeneration()
+		{
+			static std::atomic<unsigned long long> generation = 0;
+			return generation.fetch_add(1, std::memory_order_relaxed) + 1;
+		}
+	}
+
+	Heightmap::Heightmap(unsigned int width, unsigned int height)
 	{
 		create(width, height);
 	}
 
-	Heightmap::Heightmap(const Heightmap& other) :
+	Heightmap::Heightmap(const Heightmap& other) noexcept :
+		_width(other._width),
+		_height(other._height),
 		_data(other._data),
-		refCount(other.refCount)
+		refCount(other.refCount),
+		_generation(other._generation),
+		_blockGenerations(other._blockGenerations),
+		_releaseBuffer(other._releaseBuffer)
 	{
-		(*refCount)++;
+		if (refCount)
+			refCount->fetch_add(1, std::memory_order_relaxed);
 	}
 
-	Heightmap::Heightmap(const Heightmap&& other) noexcept :
-		_data(other._data),
-		refCount(other.refCount)
+	Heightmap::Heightmap(Heightmap&& other) noexcept :
+		_width(std::exchange(other._width, 0)),
+		_height(std::exchange(other._height, 0)),
+		_data(std::exchange(other._data, nullptr)),
+		refCount(std::exchange(other.refCount, nullptr)),
+		_generation(std::exchange(other._generation, 0)),
+		_blockGenerations(std::exchange(other._blockGenerations, nullptr)),
+		_releaseBuffer(std::exchange(other._releaseBuffer, nullptr))
 	{
-		(*refCount)++;
 	}
 
-	Heightmap& Heightmap::operator=(const Heightmap& other)
+	Heightmap Heightmap::adopt(unsigned int width, unsigned int height, float* data, std::function<void()> releaseBuffer)
+	{
+		//No payload is allocated, the mapping is used as is
+		Heightmap hmap;
+		hmap.attach(width, height, width > 0 and height > 0 ? data : nullptr);
+		if (!hmap._data)
+		{
+			releaseBuffer();
+			return hmap;
+		}
+		hmap._releaseBuffer = new std::function<void()>(std::move(releaseBuffer));
+		return hmap;
+	}
+
+	Heightmap& Heightmap::operator=(const Heightmap& other) noexcept
 	{
-		_data = other._data;
-		refCount = other.refCount;
-		(*refCount)++;
+		if (this != &other)
+		{
+			Heightmap copy(other);
+			*this = std::move(copy);
+		}
 		return *this;
 	}
 
-	Heightmap& Heightmap::operator=(const Heightmap&& other)
+	Heightmap& Heightmap::operator=(Heightmap&& other) noexcept
 	{
-		_data = other._data;
-		refCount = other.refCount;
-		(*refCount)++;
+		if (this != &other)
+		{
+			release();
+			_width = std::exchange(other._width, 0);
+			_height = std::exchange(other._height, 0);
+			_data = std::exchange(other._data, nullptr);
+			refCount = std::exchange(other.refCount, nullptr);
+			_generation = std::exchange(other._generation, 0);
+			_blockGenerations = std::exchange(other._blockGenerations, nullptr);
+			_releaseBuffer = std::exchange(other._releaseBuffer, nullptr);
+		}
 		return *this;
 	}
 
@@ -46,7 +89,7 @@ namespace ErosionSimulation
 
 	float& Heightmap::at(unsigned int x, unsigned int y)
 	{
-		return _data[y * _width + x];
+		return data()[y * _width + x];
 	}
 
 	const float& Heightmap::at(unsigned int x, unsigned int y) const
@@ -54,26 +97,143 @@ namespace ErosionSimulation
 		return _data[y * _width + x];
 	}
 
+	float* Heightmap::data()
+	{
+		detach();
+		return _data;
+	}
+
+	bool Heightmap::shared() const
+	{
+		return refCount && refCount->load(std::memory_order_acquire) > 1;
+	}
+
+	void Heightmap::detach()
+	{
+		if (!shared())
+			return;
+
+		const size_t size = static_cast<size_t>(_width) * _height;
+		float* copy = new float[size];
+		std::copy(_data, _data + size, copy);
+
+		const size_t blocks = static_cast<size_t>(blocksX()) * blocksY();
+		auto blockGenerations = new std::atomic<unsigned long long>[blocks];
+		for (size_t b = 0; b < blocks; b++)
+			blockGenerations[b].store(_blockGenerations[b].load(std::memory_order_relaxed), std::memory_order_relaxed);
+
+		release();
+		_data = copy;
+		_blockGenerations = blockGenerations;
+		refCount = new std::atomic<unsigned int>(1);
+	}
+
 	Heightmap::~Heightmap()
 	{
-		(*refCount)--;
-		if (*refCount == 0)
+		release();
+	}
+
+	void Heightmap::release()
+	{
+		if (refCount && refCount->fetch_sub(1, std::memory_order_acq_rel) == 1)
 		{
-			delete[] _data;
+			if (_releaseBuffer)
+			{
+				(*_releaseBuffer)();
+				delete _releaseBuffer;
+			}
+			else
+				delete[] _data;
+			delete[] _blockGenerations;
 			delete refCount;
 		}
+		_data = nullptr;
+		_releaseBuffer = nullptr;
+		_blockGenerations = nullptr;
+		refCount = nullptr;
 	}
 
 	void Heightmap::create(unsigned int width, unsigned int height)
 	{
-		if (width > 0 and height > 0)
+		attach(width, height, width > 0 and height > 0 ? new float[static_cast<size_t>(width) * height] {} : nullptr);
+	}
+
+	void Heightmap::attach(unsigned int width, unsigned int height, float* data)
+	{
+		release();
+		_width = width;
+		_height = height;
+		_generation = nextGeneration();
+		if (data)
 		{
-			_data = new float[width * height] {};
-			refCount = new unsigned int{};
-			(*refCount) = 1;
+			_data = data;
+			const size_t blocks = static_cast<size_t>(blocksX()) * blocksY();
+			_blockGenerations = new std::atomic<unsigned long long>[blocks];
+			for (size_t b = 0; b < blocks; b++)
+				_blockGenerations[b].store(_generation, std::memory_order_relaxed);
+			refCount = new std::atomic<unsigned int>(1);
 		}
 	}
 
+	void Heightmap::beginModification()
+	{
+		_generation = nextGeneration();
+	}
+
+	void Heightmap::markDirty(int x0, int y0, int x1, int y1)
+	{
+		if (!_blockGenerations)
+			return;
+
+		x0 = std::max(x0, 0);
+		y0 = std::max(y0, 0);
+		x1 = std::min(x1, static_cast<int>(_width));
+		y1 = std::min(y1, static_cast<int>(_height));
+		if (x0 >= x1 || y0 >= y1)
+			return;
+
+		const unsigned int stride = blocksX();
+		for (unsigned int by = y0 / dirtyBlockSize; by <= (y1 - 1) / dirtyBlockSize; by++)
+		{
+			for (unsigned int bx = x0 / dirtyBlockSize; bx <= (x1 - 1) / dirtyBlockSize; bx++)
+			{
+				//loading first avoids bouncing the cache line between threads eroding the same block
+				auto& stamp = _blockGenerations[bx + by * stride];
+				if (stamp.load(std::memory_order_relaxed) != _generation)
+					stamp.store(_generation, std::memory_order_relaxed);
+			}
+		}
+	}
+
+	std::vector<DirtyRect> Heightmap::dirtyRegions(unsigned long long since) const
+	{
+		std::vector<DirtyRect> regions;
+		if (!_blockGenerations)
+			return regions;
+
+		const unsigned int stride = blocksX();
+		for (unsigned int by = 0; by < blocksY(); by++)
+		{
+			unsigned int bx = 0;
+			while (bx < stride)
+			{
+				if (_blockGenerations[bx + by * stride].load(std::memory_order_relaxed) <= since)
+				{
+					bx++;
+					continue;
+				}
+
+				const unsigned int first = bx;
+				while (bx < stride && _blockGenerations[bx + by * stride].load(std::memory_order_relaxed) > since)
+					bx++;
+
+				regions.push_back({ first * dirtyBlockSize, by * dirtyBlockSize,
+					std::min(bx * dirtyBlockSize, _width), std::min((by + 1) * dirtyBlockSize, _height) });
+			}
+		}
+		return regions;
+	}
+
 	std::vector<float> Heightmap::computeGradient() const
 	{
 		auto gradient = std::vector<float>(_width * _height * 2, 0.f);
@@ -107,56 +267,21 @@ namespace ErosionSimulation
 
 	Heightmap& Heightmap::operator*=(float value)
 	{
-#pragma omp parallel for
-		for (int y = 0; y < _height; y++)
-		{
-			for (unsigned int x = 0; x < _width; x++)
-			{
-				_data[x + _width * y] = _data[x + _width * y] * value;
-			}
-		}
-		return *this;
+		return *this = *this * value;
 	}
 
-
 	Heightmap& Heightmap::operator/=(float value)
 	{
-#pragma omp parallel for
-		for (int y = 0; y < _height; y++)
-		{
-			for (unsigned int x = 0; x < _width; x++)
-			{
-				_data[x + _width * y] = _data[x + _width * y] / value;
-			}
-		}
-		return *this;
+		return *this = *this / value;
 	}
 
-
 	Heightmap& Heightmap::operator+=(float value)
 	{
-#pragma omp parallel for
-		for (int y = 0; y < _height; y++)
-		{
-			for (unsigned int x = 0; x < _width; x++)
-			{
-				_data[x + _width * y] = _data[x + _width * y] + value;
-			}
-		}
-		return *this;
+		return *this = *this + value;
 	}
 
-
 	Heightmap& Heightmap::operator-=(float value)
 	{
-#pragma omp parallel for
-		for (int y = 0; y < _height; y++)
-		{
-			for (unsigned int x = 0; x < _width; x++)
-			{
-				_data[x + _width * y] = _data[x + _width * y] - value;
-			}
-		}
-		return *this;
+		return *this = *this - value;
 	}
-}
\ No newline at end of file
+}
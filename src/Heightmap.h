@@ -2,6 +2,9 @@
 #define HEIGHTMAP_H
 
 #include <vector>
+#include <atomic>
+#include <functional>
+#include "HeightmapExpression.h"
 
 namespace ErosionSimulation
 {
@@ -11,23 +14,67 @@ namespace ErosionSimulation
 		float y;
 	};
 
+	//Half-open rectangle of cells
+	struct DirtyRect
+	{
+		unsigned int x0;
+		unsigned int y0;
+		unsigned int x1;
+		unsigned int y1;
+	};
+
+	//Copy-on-write value type: copies share the buffer in O(1) and the first write through a shared copy duplicates it.
+	//The refcount is atomic, so copies can be handed to other threads, but a copy must not be taken while another thread writes to the same Heightmap object.
 	struct Heightmap
 	{
-		Heightmap() = delete;
+		Heightmap() = default;
 		Heightmap(unsigned int width, unsigned int height);
-		Heightmap(const Heightmap& other);
-		Heightmap(const Heightmap&& other) noexcept;
-		Heightmap& operator=(const Heightmap& other);
-		Heightmap& operator=(const Heightmap&& other);
+		Heightmap(const Heightmap& other) noexcept;
+		//Wraps a buffer allocated elsewhere (a file mapping for instance), releaseBuffer is called once the last copy lets go of it
+		static Heightmap adopt(unsigned int width, unsigned int height, float* data, std::function<void()> releaseBuffer);
+		Heightmap(Heightmap&& other) noexcept;
+		Heightmap& operator=(const Heightmap& other) noexcept;
+		Heightmap& operator=(Heightmap&& other) noexcept;
+		//Evaluates the expression in a single pass, see HeightmapExpression.h. The expression may read this map
+		template<class E>
+		Heightmap(const HeightExpression<E>& expression);
+		template<class E>
+		Heightmap& operator=(const HeightExpression<E>& expression);
 		Heightmap& operator*=(float value);
 		Heightmap& operator/=(float value);
 		Heightmap& operator+=(float value);
 		Heightmap& operator-=(float value);
+		template<class R, std::enable_if_t<isHeightOperand<R>, int> = 0>
+		Heightmap& operator*=(const R& other) { return *this = *this * other; }
+		template<class R, std::enable_if_t<isHeightOperand<R>, int> = 0>
+		Heightmap& operator/=(const R& other) { return *this = *this / other; }
+		template<class R, std::enable_if_t<isHeightOperand<R>, int> = 0>
+		Heightmap& operator+=(const R& other) { return *this = *this + other; }
+		template<class R, std::enable_if_t<isHeightOperand<R>, int> = 0>
+		Heightmap& operator-=(const R& other) { return *this = *this - other; }
 
 		float operator[](unsigned int) const;
 		float& at(unsigned int x, unsigned int y);
 		const float& at(unsigned int x, unsigned int y) const;
 
+		//Writable buffer, duplicated first if it is shared with another copy
+		float* data();
+		const float* data() const { return _data; }
+		//Makes the buffer exclusive to this map. Writes through _data must be preceded by a call to detach() or data()
+		void detach();
+		bool shared() const;
+
+		//Modifications are stamped per block of dirtyBlockSize x dirtyBlockSize cells with a generation taken from a counter shared by all maps,
+		//so a consumer remembering generation() can later ask which blocks changed, even on another snapshot of the map.
+		static constexpr unsigned int dirtyBlockSize = 32;
+		//Starts a new generation, the following markDirty calls are stamped with it
+		void beginModification();
+		//Stamps the blocks covering the half-open rectangle, safe to call concurrently
+		void markDirty(int x0, int y0, int x1, int y1);
+		unsigned long long generation() const { return _generation; }
+		//Rectangles covering the blocks modified after the generation since, merged along rows of blocks
+		std::vector<DirtyRect> dirtyRegions(unsigned long long since) const;
+
 		std::vector<float> computeGradient() const;
 
 		~Heightmap();
@@ -38,8 +85,59 @@ namespace ErosionSimulation
 
 		float* _data = nullptr;
 
-		unsigned int* refCount = nullptr;
+		std::atomic<unsigned int>* refCount = nullptr;
+
+	private:
+		void release();
+		//Takes data as the buffer of a new width x height map, with its own refcount and block stamps
+		void attach(unsigned int width, unsigned int height, float* data);
+		unsigned int blocksX() const { return (_width + dirtyBlockSize - 1) / dirtyBlockSize; }
+		unsigned int blocksY() const { return (_height + dirtyBlockSize - 1) / dirtyBlockSize; }
+
+		unsigned long long _generation = 0;
+		//Shares the buffer and refcount of _data
+		std::atomic<unsigned long long>* _blockGenerations = nullptr;
+		//Set for adopted buffers, which are not freed with delete[]
+		std::function<void()>* _releaseBuffer = nullptr;
 	};
+
+	inline HeightmapView toExpression(const Heightmap& hmap)
+	{
+		HeightmapView view;
+		view.data = hmap._data;
+		view.width = hmap._width;
+		view.height = hmap._height;
+		return view;
+	}
+
+	template<class E>
+	Heightmap::Heightmap(const HeightExpression<E>& expression)
+	{
+		*this = expression;
+	}
+
+	template<class E>
+	Heightmap& Heightmap::operator=(const HeightExpression<E>& expression)
+	{
+		unsigned int width, height;
+		expressionSize(expression.self(), width, height);
+		if (width == _width && height == _height && _data && !shared())
+		{
+			//Cells only depend on the same cell of the operands, so evaluating in place is safe
+			beginModification();
+			markDirty(0, 0, _width, _height);
+			evaluateExpression(expression.self(), _data, width, height);
+			return *this;
+		}
+
+		//Shared or resized: evaluated in a single pass into a new buffer, left uninitialized since every cell is written,
+		//then swapped in. The expression may read the previous buffer, only released afterwards
+		float* buffer = width > 0 && height > 0 ? new float[static_cast<size_t>(width) * height] : nullptr;
+		if (buffer)
+			evaluateExpression(expression.self(), buffer, width, height);
+		attach(width, height, buffer);
+		return *this;
+	}
 }
 
 #endif // !HEIGHTMAP_H
\ No newline at end of file
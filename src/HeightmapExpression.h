@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <limits>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+namespace ErosionSimulation
+{
+	struct Heightmap;
+
+	//Lazy element-wise arithmetic on heightmaps: operators build a tree of small value types that is only evaluated when assigned to
+	//a Heightmap or reduced, in a single parallel pass over the cells with no intermediate map. Expressions read the buffers of the maps
+	//they were built from, so they must be evaluated before those maps are modified or destroyed, usually in the same statement.
+	template<class E>
+	struct HeightExpression
+	{
+		const E& self() const { return static_cast<const E&>(*this); }
+	};
+
+	//Reads a map, the leaf of the expressions built from Heightmap operands
+	struct HeightmapView : HeightExpression<HeightmapView>
+	{
+		const float* data;
+		unsigned int width;
+		unsigned int height;
+
+		float operator()(size_t index) const { return data[index]; }
+		bool matches(unsigned int w, unsigned int h) const { return width == w && height == h; }
+	};
+
+	//Broadcast to every cell, its size of 0 x 0 matches any map
+	struct ScalarExpression : HeightExpression<ScalarExpression>
+	{
+		float value;
+		unsigned int width = 0;
+		unsigned int height = 0;
+
+		float operator()(size_t) const { return value; }
+		bool matches(unsigned int, unsigned int) const { return true; }
+	};
+
+	template<class Op, class A>
+	struct UnaryExpression : HeightExpression<UnaryExpression<Op, A>>
+	{
+		A operand;
+		Op op;
+		unsigned int width;
+		unsigned int height;
+
+		UnaryExpression(const A& operand, Op op) : operand(operand), op(op), width(operand.width), height(operand.height) {}
+
+		float operator()(size_t index) const { return op(operand(index)); }
+		bool matches(unsigned int w, unsigned int h) const { return operand.matches(w, h); }
+	};
+
+	template<class Op, class L, class R>
+	struct BinaryExpression : HeightExpression<BinaryExpression<Op, L, R>>
+	{
+		L left;
+		R right;
+		Op op;
+		//Size of the first operand that is not a scalar
+		unsigned int width;
+		unsigned int height;
+
+		BinaryExpression(const L& left, const R& right, Op op) : left(left), right(right), op(op),
+			width(left.width ? left.width : right.width), height(left.width ? left.height : right.height) {}
+
+		float operator()(size_t index) const { return op(left(index), right(index)); }
+		bool matches(unsigned int w, unsigned int h) const { return left.matches(w, h) && right.matches(w, h); }
+	};
+
+	template<class Op, class A, class B, class C>
+	struct TernaryExpression : HeightExpression<TernaryExpression<Op, A, B, C>>
+	{
+		A first;
+		B second;
+		C third;
+		Op op;
+		unsigned int width;
+		unsigned int height;
+
+		TernaryExpression(const A& first, const B& second, const C& third, Op op) : first(first), second(second), third(third), op(op),
+			width(first.width ? first.width : second.width ? second.width : third.width),
+			height(first.width ? first.height : second.width ? second.height : third.height) {}
+
+		float operator()(size_t index) const { return op(first(index), second(index), third(index)); }
+		bool matches(unsigned int w, unsigned int h) const { return first.matches(w, h) && second.matches(w, h) && third.matches(w, h); }
+	};
+
+	//Operands: expressions, maps and numbers, converted to float
+	template<class T>
+	struct IsHeightOperand : std::bool_constant<std::is_base_of_v<HeightExpression<T>, T> || std::is_same_v<T, Heightmap>> {};
+	template<class T>
+	constexpr bool isHeightOperand = IsHeightOperand<std::decay_t<T>>::value;
+	template<class T>
+	constexpr bool isScalarOperand = std::is_arithmetic_v<std::decay_t<T>>;
+
+	//Binary operations need at least one map or expression, numbers alone keep the built-in operators
+	template<class L, class R>
+	using EnableHeightBinary = std::enable_if_t<(isHeightOperand<L> && (isHeightOperand<R> || isScalarOperand<R>)) || (isScalarOperand<L> && isHeightOperand<R>), int>;
+
+	//Defined in Heightmap.h, once Heightmap is complete
+	inline HeightmapView toExpression(const Heightmap& hmap);
+
+	template<class E>
+	const E& toExpression(const HeightExpression<E>& expression)
+	{
+		return expression.self();
+	}
+
+	inline ScalarExpression toExpression(float value)
+	{
+		ScalarExpression scalar;
+		scalar.value = value;
+		return scalar;
+	}
+
+	template<class T>
+	using ExpressionOf = std::decay_t<decltype(toExpression(std::declval<const T&>()))>;
+
+	template<class Op, class L, class R>
+	BinaryExpression<Op, ExpressionOf<L>, ExpressionOf<R>> makeBinary(const L& left, const R& right, Op op)
+	{
+		return { toExpression(left), toExpression(right), op };
+	}
+
+	struct AddOp { float operator()(float a, float b) const { return a + b; } };
+	struct SubtractOp { float operator()(float a, float b) const { return a - b; } };
+	struct MultiplyOp { float operator()(float a, float b) const { return a * b; } };
+	struct DivideOp { float operator()(float a, float b) const { return a / b; } };
+	struct NegateOp { float operator()(float a) const { return -a; } };
+	struct ClampOp { float operator()(float value, float low, float high) const { return std::min(std::max(value, low), high); } };
+	struct LerpOp { float operator()(float a, float b, float t) const { return a + t * (b - a); } };
+
+	template<class L, class R, EnableHeightBinary<L, R> = 0>
+	auto operator+(const L& left, const R& right) { return makeBinary(left, right, AddOp{}); }
+	template<class L, class R, EnableHeightBinary<L, R> = 0>
+	auto operator-(const L& left, const R& right) { return makeBinary(left, right, SubtractOp{}); }
+	template<class L, class R, EnableHeightBinary<L, R> = 0>
+	auto operator*(const L& left, const R& right) { return makeBinary(left, right, MultiplyOp{}); }
+	template<class L, class R, EnableHeightBinary<L, R> = 0>
+	auto operator/(const L& left, const R& right) { return makeBinary(left, right, DivideOp{}); }
+
+	template<class A, std::enable_if_t<isHeightOperand<A>, int> = 0>
+	UnaryExpression<NegateOp, ExpressionOf<A>> operator-(const A& operand)
+	{
+		return { toExpression(operand), NegateOp{} };
+	}
+
+	//Bounds may be numbers or expressions
+	template<class A, class L, class H, std::enable_if_t<isHeightOperand<A> && (isHeightOperand<L> || isScalarOperand<L>) && (isHeightOperand<H> || isScalarOperand<H>), int> = 0>
+	TernaryExpression<ClampOp, ExpressionOf<A>, ExpressionOf<L>, ExpressionOf<H>> clamp(const A& operand, const L& low, const H& high)
+	{
+		return { toExpression(operand), toExpression(low), toExpression(high), ClampOp{} };
+	}
+
+	//a + t * (b - a), any of them can be a number as long as a or b is not
+	template<class A, class B, class T, std::enable_if_t<(isHeightOperand<A> || isHeightOperand<B>) && (isHeightOperand<A> || isScalarOperand<A>)
+		&& (isHeightOperand<B> || isScalarOperand<B>) && (isHeightOperand<T> || isScalarOperand<T>), int> = 0>
+	TernaryExpression<LerpOp, ExpressionOf<A>, ExpressionOf<B>, ExpressionOf<T>> lerp(const A& a, const B& b, const T& t)
+	{
+		return { toExpression(a), toExpression(b), toExpression(t), LerpOp{} };
+	}
+
+	//Checks the sizes of the operands and returns that of the expression
+	template<class E>
+	void expressionSize(const E& expression, unsigned int& width, unsigned int& height)
+	{
+		width = expression.width;
+		height = expression.height;
+		if (!expression.matches(width, height))
+			throw std::runtime_error("heightmap expression operands have different sizes");
+	}
+
+	//Writes the expression to out, a buffer of width x height cells
+	template<class E>
+	void evaluateExpression(const E& expression, float* out, unsigned int width, unsigned int height)
+	{
+		const int rows = static_cast<int>(height);
+#pragma omp parallel for
+		for (int y = 0; y < rows; y++)
+		{
+			const size_t row = static_cast<size_t>(y) * width;
+#pragma omp simd
+			for (int x = 0; x < static_cast<int>(width); x++)
+				out[row + x] = expression(row + x);
+		}
+	}
+
+	//Folds each row then the rows in order, so the result does not depend on the number of threads
+	template<class T, class A, class Fold>
+	T reduceExpression(const A& operand, T init, Fold fold)
+	{
+		const auto& expression = toExpression(operand);
+		unsigned int width, height;
+		expressionSize(expression, width, height);
+
+		const int rows = static_cast<int>(height);
+		std::vector<T> partials(rows, init);
+#pragma omp parallel for
+		for (int y = 0; y < rows; y++)
+		{
+			const size_t row = static_cast<size_t>(y) * width;
+			T partial = init;
+			for (unsigned int x = 0; x < width; x++)
+				partial = fold(partial, expression(row + x));
+			partials[y] = partial;
+		}
+
+		T result = init;
+		for (const auto& partial : partials)
+			result = fold(result, partial);
+		return result;
+	}
+
+	struct HeightRange
+	{
+		float min;
+		float max;
+	};
+
+	template<class A, std::enable_if_t<isHeightOperand<A>, int> = 0>
+	float reduceMin(const A& operand)
+	{
+		return reduceExpression(operand, std::numeric_limits<float>::max(), [](float a, float b) { return std::min(a, b); });
+	}
+
+	template<class A, std::enable_if_t<isHeightOperand<A>, int> = 0>
+	float reduceMax(const A& operand)
+	{
+		return reduceExpression(operand, std::numeric_limits<float>::lowest(), [](float a, float b) { return std::max(a, b); });
+	}
+
+	//Accumulated in double
+	template<class A, std::enable_if_t<isHeightOperand<A>, int> = 0>
+	double reduceSum(const A& operand)
+	{
+		return reduceExpression(operand, 0., [](double a, double b) { return a + b; });
+	}
+
+	//Both bounds in a single pass
+	template<class A, std::enable_if_t<isHeightOperand<A>, int> = 0>
+	HeightRange reduceMinMax(const A& operand)
+	{
+		const auto& expression = toExpression(operand);
+		unsigned int width, height;
+		expressionSize(expression, width, height);
+
+		const int rows = static_cast<int>(height);
+		std::vector<HeightRange> partials(rows);
+#pragma omp parallel for
+		for (int y = 0; y < rows; y++)
+		{
+			const size_t row = static_cast<size_t>(y) * width;
+			HeightRange partial = { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() };
+			for (unsigned int x = 0; x < width; x++)
+			{
+				const float value = expression(row + x);
+				partial.min = std::min(partial.min, value);
+				partial.max = std::max(partial.max, value);
+			}
+			partials[y] = partial;
+		}
+
+		HeightRange range = { std::numeric_limits<float>::max(), std::numeric_limits<float>::lowest() };
+		for (const auto& partial : partials)
+		{
+			range.min = std::min(range.min, partial.min);
+			range.max = std::max(range.max, partial.max);
+		}
+		return range;
+	}
+}
@@ -128,7 +128,7 @@ Hmap3DVizualizer::~Hmap3DVizualizer()
     glfwTerminate();
 }
 
-void Hmap3DVizualizer::init(const ErosionSimulation::Heightmap* hmap, const std::vector<std::vector<ErosionSimulation::point2f>>* trajs)
+void Hmap3DVizualizer::init(const ErosionSimulation::Heightmap* hmap, const ErosionSimulation::TrajectoryRecorder* trajs)
 {
     _hmap = hmap;
     _trajs = trajs;
@@ -198,6 +198,7 @@ void Hmap3DVizualizer::init(const ErosionSimulation::Heightmap* hmap, const std:
     glGenBuffers(1, &normalsbufferID);
     glGenBuffers(1, &uvbufferID);
     glGenBuffers(1, &elementbufferID);
+    glGenBuffers(1, &lodIndexbufferID);
 
     programID = LoadShaders("E:/Workspace/ErosionSimulation/shaders/terrain_vertex.glsl", "E:/Workspace/ErosionSimulation/shaders/terrain_frag.glsl");
 
@@ -238,12 +239,32 @@ void Hmap3DVizualizer::renderUI()
     {
         _onRun();
     }
+    ImGui::SameLine();
+    if (ImGui::Button("Cancel") && _onCancel)
+    {
+        _onCancel();
+    }
+    if (_progress >= 0.f)
+    {
+        ImGui::ProgressBar(_progress);
+    }
+    if (!_convergence.empty())
+    {
+        ImGui::Text("%llu droplets in %d batches", _convergenceDroplets, static_cast<int>(_convergence.size()));
+        ImGui::PlotLines("RMS change", _convergence.data(), static_cast<int>(_convergence.size()), 0, nullptr, 0.f, FLT_MAX, ImVec2(0.f, 60.f));
+    }
 
     if (ImGui::CollapsingHeader("Camera"))
     {
         ImGui::SliderFloat("Elevation##Camera", &_cameraElevation, 0.f, 90.f);
         ImGui::SliderFloat("Azimut##Camera", &_cameraAzimut, 0.f, 360.f);
-        ImGui::SliderFloat("Distance##Camera", &_cameraDistance, 0.f, 1000.f);
+        ImGui::SliderFloat("Distance##Camera", &_cameraDistance, 0.f, std::max(1000.f, 2.f * std::max(_hmap->_width, _hmap->_height)));
+        ImGui::Checkbox("LOD##Camera", &_useLod);
+        if (_useLod)
+        {
+            ImGui::SliderFloat("Pixel error##Camera", &_lodPixelError, 0.5f, 16.f);
+            ImGui::Text("%d chunks", static_cast<int>(_lodSelection.size()));
+        }
     }
 
     if (ImGui::CollapsingHeader("Sun"))
@@ -278,6 +299,9 @@ void Hmap3DVizualizer::run()
     {
         glfwPollEvents();
 
+        if (_onFrame)
+            _onFrame();
+
         glfwGetFramebufferSize(_window, &_display_w, &_display_h);
         glViewport(0, 0, _display_w, _display_h);
         glClearColor(clear_color.x * clear_color.w, clear_color.y * clear_color.w, clear_color.z * clear_color.w, clear_color.w);
@@ -288,7 +312,8 @@ void Hmap3DVizualizer::run()
             *glm::rotate(glm::radians(-90.f - _cameraElevation), glm::vec3{ 1.f, 0.f, 0.f })
             *glm::rotate(glm::radians(_cameraAzimut), glm::vec3{ 0.f, 0.f, 1.f });
 
-        const glm::mat4 projection = glm::perspective(glm::radians(_cameraFoV), 4.f/3.f, 1.f, 1000.f);
+        const float far_plane = std::max(1000.f, 2.f * (_cameraDistance + std::max(_hmap->_width, _hmap->_height)));
+        const glm::mat4 projection = glm::perspective(glm::radians(_cameraFoV), 4.f/3.f, 1.f, far_plane);
         const glm::mat4 mvp = projection * view;
 
         const float elevation_rad = glm::radians(_sunElevation);
@@ -300,22 +325,6 @@ void Hmap3DVizualizer::run()
 
         // Use our shader
 
-        glBindBuffer(GL_ARRAY_BUFFER, vertexbufferID);
-        const std::vector<float> vertexBuffer = makeVertexBuffer();
-        glBufferData(GL_ARRAY_BUFFER, vertexBuffer.size() * sizeof(float), vertexBuffer.data(), GL_STATIC_DRAW);
-
-        glBindBuffer(GL_ARRAY_BUFFER, normalsbufferID);
-        const std::vector<float> normalsBuffer = makeNormalsBuffer();
-        glBufferData(GL_ARRAY_BUFFER, normalsBuffer.size() * sizeof(float), normalsBuffer.data(), GL_STATIC_DRAW);
-
-        glBindBuffer(GL_ARRAY_BUFFER, uvbufferID);
-        const std::vector<float> uvBuffer = makeUVBuffer();
-        glBufferData(GL_ARRAY_BUFFER, uvBuffer.size() * sizeof(float), uvBuffer.data(), GL_STATIC_DRAW);
-
-        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbufferID);
-        const std::vector<unsigned int> indexBuffer = makeIndexBuffer();
-        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indexBuffer.size() * sizeof(unsigned int), indexBuffer.data(), GL_STATIC_DRAW);
-
         glUseProgram(programID);
 
         GLuint MatrixID = glGetUniformLocation(programID, "V");
@@ -330,49 +339,10 @@ void Hmap3DVizualizer::run()
         MatrixID = glGetUniformLocation(programID, "sun_position");
         glUniform3fv(MatrixID, 1, &sun_position[0]);
 
-        glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, vertexbufferID);
-        glVertexAttribPointer(
-            0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-            3,                  // size
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-        );
-
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, normalsbufferID);
-        glVertexAttribPointer(
-            1,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-            3,                  // size
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-        );
-
-        glEnableVertexAttribArray(2);
-        glBindBuffer(GL_ARRAY_BUFFER, uvbufferID);
-        glVertexAttribPointer(
-            2,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
-            2,                  // size
-            GL_FLOAT,           // type
-            GL_FALSE,           // normalized?
-            0,                  // stride
-            (void*)0            // array buffer offset
-        );
-
-        glDrawElements(
-            GL_TRIANGLES,      // mode
-            indexBuffer.size(),    // count
-            GL_UNSIGNED_INT,   // type
-            (void*)0           // element array buffer offset
-        );        
-
-        glDisableVertexAttribArray(0);
-        glDisableVertexAttribArray(1);
-        glDisableVertexAttribArray(2);
+        if (_useLod)
+            drawLod(view);
+        else
+            drawMesh();
 
         renderUI();
 
@@ -380,62 +350,142 @@ void Hmap3DVizualizer::run()
     }
 }
 
-std::vector<float> Hmap3DVizualizer::makeVertexBuffer()
+void Hmap3DVizualizer::drawMesh()
 {
-    //export the normals
-    std::vector<float> vertices;
-    for (unsigned int y = 0; y < _hmap->_height; y++)
-    {
-        for (unsigned int x = 0; x < _hmap->_width; x++)
-        {
-            vertices.insert(vertices.cend(), { static_cast<float>(x) - _hmap->_width / 2, static_cast<float>(y) - _hmap->_height / 2, _hmap->at(x, y) });
-        }
-    }
-    return vertices;
+    uploadMesh();
+
+    glEnableVertexAttribArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexbufferID);
+    glVertexAttribPointer(
+        0,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
+        3,                  // size
+        GL_FLOAT,           // type
+        GL_FALSE,           // normalized?
+        0,                  // stride
+        (void*)0            // array buffer offset
+    );
+
+    glEnableVertexAttribArray(1);
+    glBindBuffer(GL_ARRAY_BUFFER, normalsbufferID);
+    glVertexAttribPointer(
+        1,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
+        3,                  // size
+        GL_FLOAT,           // type
+        GL_FALSE,           // normalized?
+        0,                  // stride
+        (void*)0            // array buffer offset
+    );
+
+    glEnableVertexAttribArray(2);
+    glBindBuffer(GL_ARRAY_BUFFER, uvbufferID);
+    glVertexAttribPointer(
+        2,                  // attribute 0. No particular reason for 0, but must match the layout in the shader.
+        2,                  // size
+        GL_FLOAT,           // type
+        GL_FALSE,           // normalized?
+        0,                  // stride
+        (void*)0            // array buffer offset
+    );
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbufferID);
+    glDrawElements(
+        GL_TRIANGLES,      // mode
+        _mesh.indices().size(),    // count
+        GL_UNSIGNED_INT,   // type
+        (void*)0           // element array buffer offset
+    );
+
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
 }
 
-std::vector<float> Hmap3DVizualizer::makeNormalsBuffer()
+void Hmap3DVizualizer::drawLod(const glm::mat4& view)
 {
-    const auto gradient = _hmap->computeGradient();
-    //export the normals
-    std::vector<float> normals;
-    for (unsigned int y = 0; y < _hmap->_height; y++)
+    if (_lod.update(*_hmap))
     {
-        for (unsigned int x = 0; x < _hmap->_width; x++)
-        {
-            normals.insert(normals.cend(), { -gradient[2 * (x + y * _hmap->_width)], -gradient[2 * (x + y * _hmap->_width) + 1], 1.f }); //Approximate the tan to compute quicker
-        }
+        for (const auto& [id, buffer] : _lodBuffers)
+            glDeleteBuffers(1, &buffer.id);
+        _lodBuffers.clear();
     }
-    return normals;
-}
 
-std::vector<float> Hmap3DVizualizer::makeUVBuffer()
-{
-    //export the texture coodinates
-    std::vector<float> uv;
-    for (unsigned int y = 0; y < _hmap->_height; y++)
+    //The camera sits at the origin of the view space
+    const glm::vec4 eye = glm::inverse(view) * glm::vec4{ 0.f, 0.f, 0.f, 1.f };
+    const ErosionSimulation::TerrainLod::Camera camera{ eye.x, eye.y, eye.z, glm::radians(_cameraFoV), static_cast<float>(_display_h) };
+    _lod.select(*_hmap, camera, _lodPixelError, _lodSelection);
+
+    //Every chunk has the same topology, the 16 bit index buffer is shared
+    const auto& indices = ErosionSimulation::TerrainLod::indices();
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lodIndexbufferID);
+    if (!_lodIndicesUploaded)
+    {
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(uint16_t), indices.data(), GL_STATIC_DRAW);
+        _lodIndicesUploaded = true;
+    }
+
+    const size_t normalsOffset = 3 * ErosionSimulation::TerrainLod::vertexCount * sizeof(float);
+    const size_t uvsOffset = 2 * normalsOffset;
+    const size_t uvsSize = 2 * ErosionSimulation::TerrainLod::vertexCount * sizeof(float);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(1);
+    glEnableVertexAttribArray(2);
+    for (const auto* chunk : _lodSelection)
     {
-        for (unsigned int x = 0; x < _hmap->_width; x++)
+        //Vertices, normals then uvs in one buffer per chunk, uploaded again only when the chunk mesh changed
+        auto& buffer = _lodBuffers[chunk->id];
+        if (buffer.id == 0)
+            glGenBuffers(1, &buffer.id);
+        glBindBuffer(GL_ARRAY_BUFFER, buffer.id);
+        if (buffer.version != chunk->version)
         {
-            uv.insert(uv.cend(), { static_cast<float>(x) / _hmap->_width, static_cast<float>(y) / _hmap->_height });
+            glBufferData(GL_ARRAY_BUFFER, uvsOffset + uvsSize, nullptr, GL_DYNAMIC_DRAW);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, normalsOffset, chunk->vertices.data());
+            glBufferSubData(GL_ARRAY_BUFFER, normalsOffset, normalsOffset, chunk->normals.data());
+            glBufferSubData(GL_ARRAY_BUFFER, uvsOffset, uvsSize, chunk->uvs.data());
+            buffer.version = chunk->version;
         }
+
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 0, (void*)0);
+        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, 0, (void*)normalsOffset);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, 0, (void*)uvsOffset);
+        glDrawElements(GL_TRIANGLES, indices.size(), GL_UNSIGNED_SHORT, (void*)0);
     }
-    return uv;
+    glDisableVertexAttribArray(0);
+    glDisableVertexAttribArray(1);
+    glDisableVertexAttribArray(2);
 }
 
-std::vector<unsigned int> Hmap3DVizualizer::makeIndexBuffer()
+void Hmap3DVizualizer::uploadMesh()
 {
-    //export the faces
-    std::vector<unsigned int> indices;
-    for (unsigned int y = 0; y < _hmap->_height - 1; y++)
+    if (!_mesh.update(*_hmap))
+        return;
+
+    if (_mesh.topologyChanged())
     {
-        for (unsigned int x = 0; x < _hmap->_width - 1; x++)
-        {
-            indices.insert(indices.cend(), {x + y * _hmap->_width, x + (y + 1) * _hmap->_width, x + 1 + y * _hmap->_width });
-            indices.insert(indices.cend(), {x + 1 + y * _hmap->_width , x + (y + 1) * _hmap->_width,  x + 1 + (y + 1) * _hmap->_width});
-        }
+        glBindBuffer(GL_ARRAY_BUFFER, vertexbufferID);
+        glBufferData(GL_ARRAY_BUFFER, _mesh.vertices().size() * sizeof(float), _mesh.vertices().data(), GL_DYNAMIC_DRAW);
+
+        glBindBuffer(GL_ARRAY_BUFFER, normalsbufferID);
+        glBufferData(GL_ARRAY_BUFFER, _mesh.normals().size() * sizeof(float), _mesh.normals().data(), GL_DYNAMIC_DRAW);
+
+        glBindBuffer(GL_ARRAY_BUFFER, uvbufferID);
+        glBufferData(GL_ARRAY_BUFFER, _mesh.uvs().size() * sizeof(float), _mesh.uvs().data(), GL_STATIC_DRAW);
+
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, elementbufferID);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, _mesh.indices().size() * sizeof(unsigned int), _mesh.indices().data(), GL_STATIC_DRAW);
+        return;
     }
-    return indices;
+
+    const auto vertices = reinterpret_cast<const char*>(_mesh.vertices().data());
+    const auto normals = reinterpret_cast<const char*>(_mesh.normals().data());
+
+    glBindBuffer(GL_ARRAY_BUFFER, vertexbufferID);
+    for (const auto& range : _mesh.dirtyRanges())
+        glBufferSubData(GL_ARRAY_BUFFER, range.offset, range.size, vertices + range.offset);
+
+    glBindBuffer(GL_ARRAY_BUFFER, normalsbufferID);
+    for (const auto& range : _mesh.dirtyRanges())
+        glBufferSubData(GL_ARRAY_BUFFER, range.offset, range.size, normals + range.offset);
 }
 
 
@@ -4,9 +4,14 @@
 #include <variant>
 #include <functional>
 #include "Heightmap.h"
+#include "TerrainMesh.h"
+#include "TerrainLod.h"
+#include "TrajectoryRecorder.h"
+#include <unordered_map>
 
 #include <GL/glew.h>
 #include <GLFW/glfw3.h>
+#include <glm/glm.hpp>
 
 class Hmap3DVizualizer
 {
@@ -14,7 +19,7 @@ public:
 	Hmap3DVizualizer(int display_w, int display_h, bool debug = false);
 	~Hmap3DVizualizer();
 
-	void init(const ErosionSimulation::Heightmap *hmap, const std::vector<std::vector<ErosionSimulation::point2f>> *trajs);
+	void init(const ErosionSimulation::Heightmap *hmap, const ErosionSimulation::TrajectoryRecorder *trajs);
 	void run();
 	void showHmap();
 
@@ -23,6 +28,16 @@ public:
 
 	void setOnNew(std::function<void(void)> onNew) { _onNew = onNew; }
 	void setOnRun(std::function<void(void)> onRun) { _onRun = onRun; }
+	void setOnCancel(std::function<void(void)> onCancel) { _onCancel = onCancel; }
+	//Called at the start of every frame, before the map is read
+	void setOnFrame(std::function<void(void)> onFrame) { _onFrame = onFrame; }
+
+	//Null when the last run recorded no trajectories
+	void setTrajectories(const ErosionSimulation::TrajectoryRecorder* trajs) { _trajs = trajs; }
+	//Fraction of the current run, hidden when negative
+	void setProgress(float progress) { _progress = progress; }
+	//RMS height change of each batch of an adaptive run, hidden when empty
+	void setConvergence(std::vector<float> changes, unsigned long long droplets) { _convergence = std::move(changes); _convergenceDroplets = droplets; }
 
 
 private:
@@ -46,18 +61,37 @@ private:
 
 	std::function<void(void)> _onNew;
 	std::function<void(void)> _onRun;
+	std::function<void(void)> _onCancel;
+	std::function<void(void)> _onFrame;
+	float _progress = -1.f;
+	std::vector<float> _convergence;
+	unsigned long long _convergenceDroplets = 0;
 
 	std::vector<Parameter> _parameters;
 	void renderUI();
 	void renderSlider(const Parameter& parameter);
 
 	const ErosionSimulation::Heightmap* _hmap;
-	const std::vector<std::vector<ErosionSimulation::point2f>>* _trajs;
+	const ErosionSimulation::TrajectoryRecorder* _trajs;
+
+	//Uploads the whole mesh when its topology changed, otherwise only the ranges rewritten since the last frame
+	void uploadMesh();
+	void drawMesh();
+	ErosionSimulation::TerrainMesh _mesh;
 
-	std::vector<unsigned int> makeIndexBuffer();
-	std::vector<float> makeVertexBuffer();
-	std::vector<float> makeUVBuffer();
-	std::vector<float> makeNormalsBuffer();
+	//Draws the chunks selected for the current camera, the full resolution mesh is used when _useLod is off
+	void drawLod(const glm::mat4& view);
+	struct LodBuffer
+	{
+		GLuint id = 0;
+		unsigned long long version = 0;
+	};
+	ErosionSimulation::TerrainLod _lod;
+	std::vector<const ErosionSimulation::TerrainLod::Chunk*> _lodSelection;
+	std::unordered_map<unsigned int, LodBuffer> _lodBuffers;
+	bool _useLod = true;
+	bool _lodIndicesUploaded = false;
+	float _lodPixelError = 2.f;
 
 	float _cameraAzimut = 0.f;
 	float _cameraElevation = 45.f;
@@ -72,6 +106,7 @@ private:
 	GLuint normalsbufferID;
 	GLuint uvbufferID;
 	GLuint elementbufferID;
+	GLuint lodIndexbufferID;
 
 	GLuint programID;
 };
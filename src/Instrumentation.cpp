@@ -0,0 +1,55 @@
+#include "Instrumentation.h"
+#include "ErosionGenerator.h"
+
+namespace ErosionSimulation
+{
+	const char* terminationName(Termination termination)
+	{
+		switch (termination)
+		{
+		case Termination::OutOfBounds: return "outOfBounds";
+		case Termination::Flat: return "flat";
+		case Termination::Stalled: return "stalled";
+		case Termination::Evaporated: return "evaporated";
+		case Termination::MaxSteps: return "maxSteps";
+		}
+		return "unknown";
+	}
+
+	DropletCounters& DropletCounters::operator+=(const DropletCounters& other)
+	{
+		for (int t = 0; t < terminationCount; t++)
+			terminations[t] += other.terminations[t];
+		for (int b = 0; b < stepHistogramBins; b++)
+			stepHistogram[b] += other.stepHistogram[b];
+		erosions += other.erosions;
+		deposits += other.deposits;
+		cappedDeposits += other.cappedDeposits;
+		return *this;
+	}
+
+	void writeJson(std::ostream& stream, const DropletStats& stats)
+	{
+		const auto& counters = stats.counters;
+		stream << "{\n"
+			<< "  \"instrumented\": " << (instrumentationEnabled ? "true" : "false") << ",\n"
+			<< "  \"droplets\": " << stats.droplets << ",\n"
+			<< "  \"steps\": " << stats.steps << ",\n"
+			<< "  \"stepsPerDroplet\": " << (stats.droplets ? static_cast<double>(stats.steps) / stats.droplets : 0.) << ",\n"
+			<< "  \"eroded\": " << stats.eroded << ",\n"
+			<< "  \"deposited\": " << stats.deposited << ",\n"
+			<< "  \"erosions\": " << counters.erosions << ",\n"
+			<< "  \"deposits\": " << counters.deposits << ",\n"
+			<< "  \"cappedDeposits\": " << counters.cappedDeposits << ",\n"
+			<< "  \"terminations\": {";
+		for (int t = 0; t < terminationCount; t++)
+			stream << (t ? ", " : " ") << "\"" << terminationName(static_cast<Termination>(t)) << "\": " << counters.terminations[t];
+		stream << " },\n"
+			<< "  \"stepHistogram\": [";
+		//Each bin gives the lower bound of its step range
+		for (int b = 0; b < DropletCounters::stepHistogramBins; b++)
+			stream << (b ? ", " : " ") << "{ \"minSteps\": " << (b ? 1U << (b - 1) : 0U) << ", \"droplets\": " << counters.stepHistogram[b] << " }";
+		stream << " ]\n"
+			<< "}\n";
+	}
+}
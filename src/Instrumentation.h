@@ -0,0 +1,78 @@
+#pragma once
+
+#include <ostream>
+
+namespace ErosionSimulation
+{
+#ifdef EROSION_INSTRUMENTATION
+	constexpr bool instrumentationEnabled = true;
+#else
+	constexpr bool instrumentationEnabled = false;
+#endif
+
+	enum class Termination
+	{
+		//The next position left the map
+		OutOfBounds,
+		//No slope and no direction left, or the next position at the same height
+		Flat,
+		//Going uphill with no sediment left to fill the hole
+		Stalled,
+		Evaporated,
+		MaxSteps
+	};
+	constexpr int terminationCount = 5;
+	const char* terminationName(Termination termination);
+
+	//Hot path counters of the droplet engines. The recording functions compile to nothing unless EROSION_INSTRUMENTATION is defined,
+	//so they can stay in the inner loops. Each thread fills its own copy, summed at the end of a batch.
+	struct DropletCounters
+	{
+		//Bin 0 counts droplets without any step, bin b those with [2^(b-1), 2^b) steps
+		static constexpr int stepHistogramBins = 16;
+
+		unsigned long long terminations[terminationCount] = {};
+		unsigned long long stepHistogram[stepHistogramBins] = {};
+		unsigned long long erosions = 0;
+		unsigned long long deposits = 0;
+		//Deposits limited by the height difference, returning less than requested
+		unsigned long long cappedDeposits = 0;
+
+		void terminate(Termination termination, unsigned int steps)
+		{
+			if constexpr (instrumentationEnabled)
+			{
+				terminations[static_cast<int>(termination)]++;
+				int bin = 0;
+				while (steps > 0 && bin < stepHistogramBins - 1)
+				{
+					steps >>= 1;
+					bin++;
+				}
+				stepHistogram[bin]++;
+			}
+		}
+
+		void erosion()
+		{
+			if constexpr (instrumentationEnabled)
+				erosions++;
+		}
+
+		void deposit(float requested, float deposited)
+		{
+			if constexpr (instrumentationEnabled)
+			{
+				deposits++;
+				if (deposited < requested)
+					cappedDeposits++;
+			}
+		}
+
+		DropletCounters& operator+=(const DropletCounters& other);
+	};
+
+	struct DropletStats;
+	//Writes the stats and counters as a JSON object, "instrumented" tells whether the counters were recorded
+	void writeJson(std::ostream& stream, const DropletStats& stats);
+}
@@ -0,0 +1,93 @@
+#include "MappedFile.h"
+#include <stdexcept>
+
+#ifdef _WIN32
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace ErosionSimulation
+{
+	MappedFile::MappedFile(const std::string& path, Mode mode, size_t size)
+	{
+		const bool writable = mode == Mode::ReadWrite;
+#ifdef _WIN32
+		_file = CreateFileA(path.c_str(), GENERIC_READ | (writable ? GENERIC_WRITE : 0), FILE_SHARE_READ, nullptr,
+			writable ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+		if (_file == INVALID_HANDLE_VALUE)
+		{
+			_file = nullptr;
+			throw std::runtime_error("could not open " + path);
+		}
+
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(_file, &fileSize);
+		if (writable && size > 0 && static_cast<size_t>(fileSize.QuadPart) != size)
+		{
+			fileSize.QuadPart = static_cast<LONGLONG>(size);
+			if (!SetFilePointerEx(_file, fileSize, nullptr, FILE_BEGIN) || !SetEndOfFile(_file))
+			{
+				release();
+				throw std::runtime_error("could not resize " + path);
+			}
+		}
+		_size = static_cast<size_t>(fileSize.QuadPart);
+
+		if (_size > 0)
+			_mapping = CreateFileMappingA(_file, nullptr, writable ? PAGE_READWRITE : PAGE_WRITECOPY, 0, 0, nullptr);
+		if (_mapping)
+			_data = static_cast<uint8_t*>(MapViewOfFile(_mapping, writable ? FILE_MAP_ALL_ACCESS : FILE_MAP_COPY, 0, 0, 0));
+#else
+		const int file = open(path.c_str(), writable ? O_RDWR | O_CREAT : O_RDONLY, 0644);
+		if (file < 0)
+			throw std::runtime_error("could not open " + path);
+
+		struct stat status;
+		if (fstat(file, &status) == 0)
+		{
+			_size = static_cast<size_t>(status.st_size);
+			if (writable && size > 0 && _size != size)
+				_size = ftruncate(file, static_cast<off_t>(size)) == 0 ? size : 0;
+		}
+		if (_size > 0)
+		{
+			void* data = mmap(nullptr, _size, PROT_READ | PROT_WRITE, writable ? MAP_SHARED : MAP_PRIVATE, file, 0);
+			_data = data == MAP_FAILED ? nullptr : static_cast<uint8_t*>(data);
+		}
+		close(file);
+#endif
+		if (!_data)
+		{
+			release();
+			throw std::runtime_error("could not map " + path);
+		}
+	}
+
+	MappedFile::~MappedFile()
+	{
+		release();
+	}
+
+	void MappedFile::release()
+	{
+#ifdef _WIN32
+		if (_data)
+			UnmapViewOfFile(_data);
+		if (_mapping)
+			CloseHandle(_mapping);
+		if (_file)
+			CloseHandle(_file);
+		_mapping = nullptr;
+		_file = nullptr;
+#else
+		if (_data)
+			munmap(_data, _size);
+#endif
+		_data = nullptr;
+	}
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace ErosionSimulation
+{
+	//Whole file mapped in memory, unmapped on destruction
+	class MappedFile
+	{
+	public:
+		enum class Mode
+		{
+			//Writes go to private copies of the pages, the file is never modified
+			CopyOnWrite,
+			//Writes reach the file, which is created or resized to the requested size
+			ReadWrite
+		};
+
+		//Throws std::runtime_error when the file cannot be opened or mapped
+		MappedFile(const std::string& path, Mode mode, size_t size = 0);
+		~MappedFile();
+
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+
+		uint8_t* data() const { return _data; }
+		size_t size() const { return _size; }
+
+	private:
+		void release();
+
+		//Windows file and mapping handles
+		void* _file = nullptr;
+		void* _mapping = nullptr;
+		uint8_t* _data = nullptr;
+		size_t _size = 0;
+	};
+}
@@ -0,0 +1,224 @@
+// MeshChecks.cpp : headless checks of the render meshes, built with EROSION_CHECKS and run by ctest.
+//
+
+#include "ErosionGenerator.h"
+#include "TerrainMesh.h"
+#include "TerrainLod.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+
+using namespace ErosionSimulation;
+
+namespace
+{
+	int failures = 0;
+
+	void check(bool condition, const std::string& what)
+	{
+		if (condition)
+			return;
+		std::cout << "FAILED: " << what << "\n";
+		failures++;
+	}
+
+	//Smooth slopes with a few cells of roughness, so every LOD level has its own error and droplets find no flat ground
+	Heightmap roughTerrain(unsigned int width, unsigned int height)
+	{
+		Heightmap hmap(width, height);
+		float* data = hmap.data();
+		for (unsigned int y = 0; y < height; y++)
+		{
+			for (unsigned int x = 0; x < width; x++)
+			{
+				uint32_t hash = (x * 73856093u) ^ (y * 19349663u);
+				hash = (hash ^ (hash >> 13)) * 0x5bd1e995u;
+				const float roughness = static_cast<float>(hash >> 8) / 16777216.f;
+				data[x + static_cast<size_t>(y) * width] = 40.f + 25.f * std::sin(x * 0.013f) * std::cos(y * 0.017f) + 0.02f * x + 0.5f * roughness;
+			}
+		}
+		return hmap;
+	}
+
+	bool sameFloats(const std::vector<float>& a, const std::vector<float>& b)
+	{
+		return a.size() == b.size() && std::memcmp(a.data(), b.data(), a.size() * sizeof(float)) == 0;
+	}
+
+	//Patches a copy of the buffers with the dirty ranges of every update, as the visualizer patches its GPU buffers,
+	//and compares both the mesh and the patched copy with a mesh built from scratch
+	void checkIncrementalMesh()
+	{
+		std::cout << "Incremental TerrainMesh update\n";
+		Heightmap hmap = roughTerrain(500, 300);
+		TerrainMesh mesh;
+		check(mesh.update(hmap) && mesh.topologyChanged(), "first update rebuilds the mesh");
+		std::vector<float> uploadedVertices = mesh.vertices();
+		std::vector<float> uploadedNormals = mesh.normals();
+
+		auto compare = [&](const std::string& step, bool changed)
+		{
+			check(mesh.update(hmap) == changed, step + ": update reports a change");
+			check(!mesh.topologyChanged(), step + ": update stays incremental");
+			for (const auto& range : mesh.dirtyRanges())
+			{
+				std::memcpy(reinterpret_cast<char*>(uploadedVertices.data()) + range.offset, reinterpret_cast<const char*>(mesh.vertices().data()) + range.offset, range.size);
+				std::memcpy(reinterpret_cast<char*>(uploadedNormals.data()) + range.offset, reinterpret_cast<const char*>(mesh.normals().data()) + range.offset, range.size);
+			}
+
+			TerrainMesh full;
+			full.update(hmap);
+			check(sameFloats(mesh.vertices(), full.vertices()) && sameFloats(mesh.normals(), full.normals()), step + ": incremental mesh matches a full rebuild");
+			check(sameFloats(uploadedVertices, full.vertices()) && sameFloats(uploadedNormals, full.normals()), step + ": dirty ranges cover every changed vertex");
+		};
+
+		ErosionGenerator erosionGenerator{};
+		DropletOptions options;
+		erosionGenerator.launchDroplets(hmap, 20000, 1, options);
+		compare("droplets", true);
+
+		//A rectangle on the right border of the map, starting and ending on the edges of dirty blocks:
+		//the normals of the cells just outside read it
+		hmap.beginModification();
+		float* data = hmap.data();
+		for (unsigned int y = 37; y < 64; y++)
+			for (unsigned int x = 448; x < 500; x++)
+				data[x + y * hmap._width] += 3.f;
+		hmap.markDirty(448, 37, 500, 64);
+		compare("border edit", true);
+
+		//A copy edited on its own, the mesh follows the snapshot it is given
+		Heightmap snapshot = hmap;
+		snapshot.beginModification();
+		snapshot.data()[250 + 150 * snapshot._width] -= 10.f;
+		snapshot.markDirty(250, 150, 251, 151);
+		hmap = snapshot;
+		compare("snapshot edit", true);
+
+		compare("no edit", false);
+	}
+
+	//Height of the chunk surface at a cell on one of its rows or columns of vertices, where the triangles are linear between two vertices
+	float chunkHeight(const TerrainLod::Chunk& chunk, unsigned int x, unsigned int y, unsigned int width, unsigned int height)
+	{
+		auto locate = [&](unsigned int cell, unsigned int origin, unsigned int last, unsigned int& index, float& remain)
+		{
+			index = std::min((cell - origin) / chunk.stride, TerrainLod::chunkCells);
+			const unsigned int position = std::min(origin + index * chunk.stride, last);
+			const unsigned int next = std::min(origin + (index + 1) * chunk.stride, last);
+			remain = index < TerrainLod::chunkCells && next > position ? static_cast<float>(cell - position) / (next - position) : 0.f;
+		};
+		unsigned int i, j;
+		float x_remain, y_remain;
+		locate(x, chunk.x0, width - 1, i, x_remain);
+		locate(y, chunk.y0, height - 1, j, y_remain);
+		auto z = [&](unsigned int vi, unsigned int vj)
+		{
+			return chunk.vertices[3 * (std::min(vi, TerrainLod::chunkCells) + std::min(vj, TerrainLod::chunkCells) * TerrainLod::chunkVertices) + 2];
+		};
+		return (z(i, j) * (1 - x_remain) + z(i + 1, j) * x_remain) * (1 - y_remain) + (z(i, j + 1) * (1 - x_remain) + z(i + 1, j + 1) * x_remain) * y_remain;
+	}
+
+	//The selected chunks must cover every cell of the map once, and wherever two of them share a border,
+	//the skirt hanging from the higher edge must reach the lower one
+	void checkLodSelection(const std::string& step, const Heightmap& hmap, const std::vector<const TerrainLod::Chunk*>& selection)
+	{
+		const unsigned int width = hmap._width;
+		const unsigned int height = hmap._height;
+		auto end = [](const TerrainLod::Chunk& chunk, unsigned int origin, unsigned int size)
+		{
+			return std::min(origin + TerrainLod::chunkCells * chunk.stride, size - 1);
+		};
+
+		std::vector<unsigned char> coverage(static_cast<size_t>(width - 1) * (height - 1), 0);
+		for (const auto* chunk : selection)
+			for (unsigned int y = chunk->y0; y < end(*chunk, chunk->y0, height); y++)
+				for (unsigned int x = chunk->x0; x < end(*chunk, chunk->x0, width); x++)
+					coverage[x + static_cast<size_t>(y) * (width - 1)]++;
+		check(std::all_of(coverage.cbegin(), coverage.cend(), [](unsigned char count) { return count == 1; }), step + ": chunks cover every cell once");
+
+		unsigned int borders = 0;
+		unsigned int coarseBorders = 0;
+		unsigned int gaps = 0;
+		for (const auto* a : selection)
+		{
+			for (const auto* b : selection)
+			{
+				//a on the left of or above b
+				const bool vertical = end(*a, a->x0, width) == b->x0;
+				const bool horizontal = end(*a, a->y0, height) == b->y0;
+				const unsigned int first = vertical ? std::max(a->y0, b->y0) : std::max(a->x0, b->x0);
+				const unsigned int last = vertical ? std::min(end(*a, a->y0, height), end(*b, b->y0, height)) : std::min(end(*a, a->x0, width), end(*b, b->x0, width));
+				if ((!vertical && !horizontal) || first >= last)
+					continue;
+
+				borders++;
+				if (std::max(a->level, b->level) >= std::min(a->level, b->level) + 2)
+					coarseBorders++;
+				for (unsigned int k = first; k <= last; k++)
+				{
+					const unsigned int x = vertical ? b->x0 : k;
+					const unsigned int y = vertical ? k : b->y0;
+					const float height_a = chunkHeight(*a, x, y, width, height);
+					const float height_b = chunkHeight(*b, x, y, width, height);
+					const float skirt = height_a >= height_b ? a->skirt : b->skirt;
+					if (std::abs(height_a - height_b) > skirt)
+						gaps++;
+				}
+			}
+		}
+		std::cout << step << ": " << selection.size() << " chunks, " << borders << " shared borders, " << coarseBorders << " between levels two or more apart\n";
+		check(borders > 0, step + ": chunks share borders");
+		check(gaps == 0, step + ": skirts close the gaps between neighbours (" + std::to_string(gaps) + " cells open)");
+	}
+
+	void checkLodBorders()
+	{
+		std::cout << "TerrainLod selection and skirts\n";
+		Heightmap hmap = roughTerrain(1024, 768);
+		TerrainLod lod;
+		lod.update(hmap);
+
+		//Low over a corner, so the levels grow quickly with the distance, then high over the center
+		const TerrainLod::Camera cameras[] = { { -500.f, -370.f, 70.f, 1.f, 1080.f }, { 0.f, 0.f, 150.f, 1.f, 1080.f } };
+		std::vector<const TerrainLod::Chunk*> selection;
+		for (int i = 0; i < 2; i++)
+		{
+			lod.select(hmap, cameras[i], 4.f, selection);
+			checkLodSelection("camera " + std::to_string(i), hmap, selection);
+		}
+
+		//A deep pit raises the errors of the chunks around it without making their neighbours stale
+		hmap.beginModification();
+		float* data = hmap.data();
+		for (unsigned int y = 300; y < 340; y++)
+			for (unsigned int x = 600; x < 640; x++)
+				data[x + y * hmap._width] -= 60.f;
+		hmap.markDirty(600, 300, 640, 340);
+		lod.update(hmap);
+		for (int i = 0; i < 2; i++)
+		{
+			lod.select(hmap, cameras[i], 4.f, selection);
+			checkLodSelection("edited, camera " + std::to_string(i), hmap, selection);
+		}
+	}
+}
+
+int main()
+{
+	checkIncrementalMesh();
+	checkLodBorders();
+
+	if (failures > 0)
+	{
+		std::cout << failures << " checks failed\n";
+		return 1;
+	}
+	std::cout << "all checks passed\n";
+	return 0;
+}
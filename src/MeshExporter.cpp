@@ -0,0 +1,422 @@
+#include "MeshExporter.h"
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		//Each chunk of rows is formatted in a buffer of about this size before being written
+		constexpr size_t chunkBytes = 4 << 20;
+		//Longest shortest round trip representation of a float, "-1.17549435e-38"
+		constexpr size_t maxFloatChars = 16;
+
+		struct Vertex
+		{
+			float position[3];
+			float normal[3];
+			float uv[2];
+		};
+
+		Vertex vertexAt(const Heightmap& hmap, unsigned int x, unsigned int y, float heightScale)
+		{
+			const float* data = hmap.data();
+			const unsigned int width = hmap._width;
+			Vertex vertex = { { static_cast<float>(x), static_cast<float>(y), data[x + y * width] * heightScale },
+				{ 0.f, 0.f, 1.f },
+				{ static_cast<float>(x) / width, static_cast<float>(y) / hmap._height } };
+
+			//Forward differences as Heightmap::computeGradient, without allocating the whole gradient
+			if (width > 1 && hmap._height > 1)
+			{
+				const unsigned int xx = std::min(x, width - 2);
+				const unsigned int yy = std::min(y, hmap._height - 2);
+				const float gradient_x = (data[yy * width + xx + 1] - data[yy * width + xx]) * heightScale;
+				const float gradient_y = (data[(yy + 1) * width + x] - data[yy * width + x]) * heightScale;
+				const float norm = std::sqrt(gradient_x * gradient_x + gradient_y * gradient_y + 1.f);
+				vertex.normal[0] = -gradient_x / norm;
+				vertex.normal[1] = -gradient_y / norm;
+				vertex.normal[2] = 1.f / norm;
+			}
+			return vertex;
+		}
+
+		//Two triangles facing +z for the quad whose top left vertex is (x, y)
+		void quadIndices(unsigned int x, unsigned int y, unsigned int width, uint32_t indices[6])
+		{
+			const uint32_t top_left = x + y * width;
+			const uint32_t bottom_left = top_left + width;
+			indices[0] = top_left;
+			indices[1] = top_left + 1;
+			indices[2] = bottom_left;
+			indices[3] = top_left + 1;
+			indices[4] = bottom_left + 1;
+			indices[5] = bottom_left;
+		}
+
+		class File
+		{
+		public:
+			File(const std::string& path) :
+				_path(path),
+				_file(std::fopen(path.c_str(), "wb"))
+			{
+				if (!_file)
+					throw std::runtime_error("could not open " + path);
+			}
+
+			~File()
+			{
+				if (_file)
+					std::fclose(_file);
+			}
+
+			void write(const void* data, size_t size)
+			{
+				if (!tryWrite(data, size))
+					throw std::runtime_error("could not write " + _path);
+			}
+
+			//Does not throw, for the parallel regions
+			bool tryWrite(const void* data, size_t size)
+			{
+				if (size > 0 && std::fwrite(data, 1, size, _file) != size)
+					return false;
+				_written += size;
+				return true;
+			}
+
+			void close()
+			{
+				const int result = std::fclose(_file);
+				_file = nullptr;
+				if (result != 0)
+					throw std::runtime_error("could not write " + _path);
+			}
+
+			size_t written() const { return _written; }
+
+		private:
+			std::string _path;
+			FILE* _file;
+			size_t _written = 0;
+		};
+
+		//Formats rows [0, rows) in parallel chunks with format(buffer, firstRow, lastRow), which returns the end of what it wrote
+		//in a buffer of maxBytesPerRow bytes per row. The chunks are written in order as soon as they and their predecessors are ready
+		template<typename Format>
+		void writeRows(File& file, unsigned int rows, size_t maxBytesPerRow, Format format)
+		{
+			if (rows == 0)
+				return;
+
+			const unsigned int rowsPerChunk = static_cast<unsigned int>(std::clamp<size_t>(chunkBytes / std::max<size_t>(maxBytesPerRow, 1), 1, rows));
+			const int chunks = static_cast<int>((rows + rowsPerChunk - 1) / rowsPerChunk);
+			bool failed = false;
+
+#pragma omp parallel
+			{
+				std::unique_ptr<char[]> buffer(new char[rowsPerChunk * maxBytesPerRow]);
+
+#pragma omp for ordered schedule(static, 1)
+				for (int chunk = 0; chunk < chunks; chunk++)
+				{
+					const unsigned int firstRow = chunk * rowsPerChunk;
+					const unsigned int lastRow = std::min(firstRow + rowsPerChunk, rows);
+					const char* end = format(buffer.get(), firstRow, lastRow);
+
+#pragma omp ordered
+					{
+						if (!failed && !file.tryWrite(buffer.get(), end - buffer.get()))
+							failed = true;
+					}
+				}
+			}
+
+			if (failed)
+				throw std::runtime_error("could not write the mesh");
+		}
+
+		char* appendFloat(char* out, float value)
+		{
+			return std::to_chars(out, out + maxFloatChars, value).ptr;
+		}
+
+		char* appendIndex(char* out, uint32_t index)
+		{
+			return std::to_chars(out, out + 10, index).ptr;
+		}
+
+		size_t exportObj(const Heightmap& hmap, const std::string& path, float heightScale)
+		{
+			File file(path);
+			const std::string header = "o terrain\n\n";
+			file.write(header.data(), header.size());
+			const unsigned int width = hmap._width;
+
+			//All the attributes of a vertex on one line each, then the faces referencing them as v/vt/vn
+			writeRows(file, hmap._height, width * (3 * (maxFloatChars + 1) * 3 + 12), [&](char* out, unsigned int firstRow, unsigned int lastRow)
+				{
+					for (unsigned int y = firstRow; y < lastRow; y++)
+					{
+						for (unsigned int x = 0; x < width; x++)
+						{
+							const Vertex vertex = vertexAt(hmap, x, y, heightScale);
+							out = std::copy_n("v ", 2, out);
+							out = appendFloat(out, vertex.position[0]); *out++ = ' ';
+							out = appendFloat(out, vertex.position[1]); *out++ = ' ';
+							out = appendFloat(out, vertex.position[2]);
+							out = std::copy_n("\nvn ", 4, out);
+							out = appendFloat(out, vertex.normal[0]); *out++ = ' ';
+							out = appendFloat(out, vertex.normal[1]); *out++ = ' ';
+							out = appendFloat(out, vertex.normal[2]);
+							out = std::copy_n("\nvt ", 4, out);
+							out = appendFloat(out, vertex.uv[0]); *out++ = ' ';
+							out = appendFloat(out, vertex.uv[1]); *out++ = '\n';
+						}
+					}
+					return out;
+				});
+
+			if (width > 1 && hmap._height > 1)
+			{
+				writeRows(file, hmap._height - 1, (width - 1) * 2 * (3 + 3 * (3 * 11 + 1)), [&](char* out, unsigned int firstRow, unsigned int lastRow)
+					{
+						uint32_t indices[6];
+						for (unsigned int y = firstRow; y < lastRow; y++)
+						{
+							for (unsigned int x = 0; x < width - 1; x++)
+							{
+								quadIndices(x, y, width, indices);
+								for (unsigned int i = 0; i < 6; i++)
+								{
+									if (i % 3 == 0)
+										*out++ = 'f';
+									*out++ = ' ';
+									//OBJ indices start at 1
+									char* first = out;
+									out = appendIndex(out, indices[i] + 1);
+									const size_t length = out - first;
+									*out++ = '/';
+									out = std::copy_n(first, length, out);
+									*out++ = '/';
+									out = std::copy_n(first, length, out);
+									if (i % 3 == 2)
+										*out++ = '\n';
+								}
+							}
+						}
+						return out;
+					});
+			}
+
+			file.close();
+			return file.written();
+		}
+
+		size_t exportPly(const Heightmap& hmap, const std::string& path, float heightScale)
+		{
+			File file(path);
+			const unsigned int width = hmap._width;
+			const size_t faces = width > 1 && hmap._height > 1 ? 2 * static_cast<size_t>(width - 1) * (hmap._height - 1) : 0;
+			const std::string header = "ply\nformat binary_little_endian 1.0\ncomment ErosionSimulation heightmap\n"
+				"element vertex " + std::to_string(static_cast<size_t>(width) * hmap._height) + "\n"
+				"property float x\nproperty float y\nproperty float z\n"
+				"property float nx\nproperty float ny\nproperty float nz\n"
+				"property float s\nproperty float t\n"
+				"element face " + std::to_string(faces) + "\n"
+				"property list uchar uint vertex_indices\nend_header\n";
+			file.write(header.data(), header.size());
+
+			writeRows(file, hmap._height, width * sizeof(Vertex), [&](char* out, unsigned int firstRow, unsigned int lastRow)
+				{
+					for (unsigned int y = firstRow; y < lastRow; y++)
+					{
+						for (unsigned int x = 0; x < width; x++)
+						{
+							const Vertex vertex = vertexAt(hmap, x, y, heightScale);
+							std::memcpy(out, &vertex, sizeof(vertex));
+							out += sizeof(vertex);
+						}
+					}
+					return out;
+				});
+
+			if (faces > 0)
+			{
+				//Faces are packed: a count byte then 3 indices
+				const size_t faceSize = 1 + 3 * sizeof(uint32_t);
+				writeRows(file, hmap._height - 1, (width - 1) * 2 * faceSize, [&](char* out, unsigned int firstRow, unsigned int lastRow)
+					{
+						uint32_t indices[6];
+						for (unsigned int y = firstRow; y < lastRow; y++)
+						{
+							for (unsigned int x = 0; x < width - 1; x++)
+							{
+								quadIndices(x, y, width, indices);
+								*out++ = 3;
+								std::memcpy(out, indices, 3 * sizeof(uint32_t));
+								out += 3 * sizeof(uint32_t);
+								*out++ = 3;
+								std::memcpy(out, indices + 3, 3 * sizeof(uint32_t));
+								out += 3 * sizeof(uint32_t);
+							}
+						}
+						return out;
+					});
+			}
+
+			file.close();
+			return file.written();
+		}
+
+		//Writes the positions, normals, texture coordinates and indices one after the other, as laid out in the glTF buffer
+		void writeGltfBuffer(File& file, const Heightmap& hmap, float heightScale)
+		{
+			const unsigned int width = hmap._width;
+			for (unsigned int attribute = 0; attribute < 3; attribute++)
+			{
+				const unsigned int components = attribute == 2 ? 2 : 3;
+				writeRows(file, hmap._height, width * components * sizeof(float), [&](char* out, unsigned int firstRow, unsigned int lastRow)
+					{
+						for (unsigned int y = firstRow; y < lastRow; y++)
+						{
+							for (unsigned int x = 0; x < width; x++)
+							{
+								const Vertex vertex = vertexAt(hmap, x, y, heightScale);
+								const float* values = attribute == 0 ? vertex.position : attribute == 1 ? vertex.normal : vertex.uv;
+								std::memcpy(out, values, components * sizeof(float));
+								out += components * sizeof(float);
+							}
+						}
+						return out;
+					});
+			}
+
+			if (width > 1 && hmap._height > 1)
+			{
+				writeRows(file, hmap._height - 1, (width - 1) * 6 * sizeof(uint32_t), [&](char* out, unsigned int firstRow, unsigned int lastRow)
+					{
+						for (unsigned int y = firstRow; y < lastRow; y++)
+						{
+							for (unsigned int x = 0; x < width - 1; x++)
+							{
+								uint32_t indices[6];
+								quadIndices(x, y, width, indices);
+								std::memcpy(out, indices, sizeof(indices));
+								out += sizeof(indices);
+							}
+						}
+						return out;
+					});
+			}
+		}
+
+		size_t exportGltf(const Heightmap& hmap, const std::string& path, float heightScale, bool binary)
+		{
+			const size_t vertices = static_cast<size_t>(hmap._width) * hmap._height;
+			const size_t indices = hmap._width > 1 && hmap._height > 1 ? 6 * static_cast<size_t>(hmap._width - 1) * (hmap._height - 1) : 0;
+			const size_t positionsSize = vertices * 3 * sizeof(float);
+			const size_t uvsSize = vertices * 2 * sizeof(float);
+			const size_t bufferSize = 2 * positionsSize + uvsSize + indices * sizeof(uint32_t);
+
+			const auto [minHeight, maxHeight] = vertices > 0 ? std::minmax_element(hmap.data(), hmap.data() + vertices) : std::make_pair(hmap.data(), hmap.data());
+			const float low = vertices > 0 ? std::min(*minHeight * heightScale, *maxHeight * heightScale) : 0.f;
+			const float high = vertices > 0 ? std::max(*minHeight * heightScale, *maxHeight * heightScale) : 0.f;
+
+			std::string bufferUri;
+			std::string binPath;
+			if (!binary)
+			{
+				binPath = path.substr(0, path.find_last_of('.')) + ".bin";
+				bufferUri = ",\"uri\":\"" + binPath.substr(binPath.find_last_of("/\\") + 1) + "\"";
+			}
+
+			auto number = [](float value) { char text[maxFloatChars]; return std::string(text, std::to_chars(text, text + maxFloatChars, value).ptr); };
+			auto view = [](size_t offset, size_t length, unsigned int target)
+				{
+					return "{\"buffer\":0,\"byteOffset\":" + std::to_string(offset) + ",\"byteLength\":" + std::to_string(length) + ",\"target\":" + std::to_string(target) + "}";
+				};
+			//The map is z up, the node turns it to the y up convention of glTF
+			std::string json = "{\"asset\":{\"version\":\"2.0\",\"generator\":\"ErosionSimulation\"},\"scene\":0,\"scenes\":[{\"nodes\":[0]}],"
+				"\"nodes\":[{\"mesh\":0,\"rotation\":[-0.70710678,0,0,0.70710678]}],"
+				"\"meshes\":[{\"primitives\":[{\"attributes\":{\"POSITION\":0,\"NORMAL\":1,\"TEXCOORD_0\":2}" + std::string(indices > 0 ? ",\"indices\":3" : "") + "}]}],"
+				"\"buffers\":[{\"byteLength\":" + std::to_string(bufferSize) + bufferUri + "}],"
+				"\"bufferViews\":[" + view(0, positionsSize, 34962) + "," + view(positionsSize, positionsSize, 34962) + "," + view(2 * positionsSize, uvsSize, 34962)
+				+ (indices > 0 ? "," + view(2 * positionsSize + uvsSize, indices * sizeof(uint32_t), 34963) : "") + "],"
+				"\"accessors\":[{\"bufferView\":0,\"componentType\":5126,\"count\":" + std::to_string(vertices) + ",\"type\":\"VEC3\","
+				"\"min\":[0,0," + number(low) + "],\"max\":[" + std::to_string(hmap._width > 0 ? hmap._width - 1 : 0) + "," + std::to_string(hmap._height > 0 ? hmap._height - 1 : 0) + "," + number(high) + "]},"
+				"{\"bufferView\":1,\"componentType\":5126,\"count\":" + std::to_string(vertices) + ",\"type\":\"VEC3\"},"
+				"{\"bufferView\":2,\"componentType\":5126,\"count\":" + std::to_string(vertices) + ",\"type\":\"VEC2\"}"
+				+ (indices > 0 ? ",{\"bufferView\":3,\"componentType\":5125,\"count\":" + std::to_string(indices) + ",\"type\":\"SCALAR\"}" : "") + "]}";
+
+			if (!binary)
+			{
+				File file(path);
+				file.write(json.data(), json.size());
+				file.close();
+
+				File bin(binPath);
+				writeGltfBuffer(bin, hmap, heightScale);
+				bin.close();
+				return file.written() + bin.written();
+			}
+
+			//Chunks of a glb are 4 bytes aligned, the json is padded with spaces
+			json.resize((json.size() + 3) / 4 * 4, ' ');
+			//The lengths of a glb are 32 bits, a .gltf with its separate .bin has no such limit
+			if (12 + 8 + json.size() + 8 + bufferSize > UINT32_MAX)
+				throw std::runtime_error("the mesh of " + path + " exceeds the 4 GiB limit of .glb, export to .gltf instead");
+			const uint32_t header[5] = { 0x46546C67, 2, static_cast<uint32_t>(12 + 8 + json.size() + 8 + bufferSize),
+				static_cast<uint32_t>(json.size()), 0x4E4F534A };
+			const uint32_t binHeader[2] = { static_cast<uint32_t>(bufferSize), 0x004E4942 };
+
+			File file(path);
+			file.write(header, sizeof(header));
+			file.write(json.data(), json.size());
+			file.write(binHeader, sizeof(binHeader));
+			writeGltfBuffer(file, hmap, heightScale);
+			file.close();
+			return file.written();
+		}
+	}
+
+	MeshFormat meshFormatFromPath(const std::string& path)
+	{
+		std::string extension = path.substr(path.find_last_of('.') == std::string::npos ? path.size() : path.find_last_of('.'));
+		std::transform(extension.begin(), extension.end(), extension.begin(), [](unsigned char c) { return static_cast<char>(std::tolower(c)); });
+		if (extension == ".obj")
+			return MeshFormat::Obj;
+		if (extension == ".ply")
+			return MeshFormat::Ply;
+		if (extension == ".glb")
+			return MeshFormat::Glb;
+		if (extension == ".gltf")
+			return MeshFormat::Gltf;
+		throw std::runtime_error("unknown mesh format " + extension);
+	}
+
+	size_t exportMesh(const Heightmap& hmap, const std::string& path, MeshFormat format, float heightScale)
+	{
+		switch (format)
+		{
+		case MeshFormat::Obj:
+			return exportObj(hmap, path, heightScale);
+		case MeshFormat::Ply:
+			return exportPly(hmap, path, heightScale);
+		case MeshFormat::Glb:
+			return exportGltf(hmap, path, heightScale, true);
+		case MeshFormat::Gltf:
+			return exportGltf(hmap, path, heightScale, false);
+		}
+		throw std::runtime_error("unknown mesh format");
+	}
+}
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <string>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	enum class MeshFormat
+	{
+		Obj,
+		//Binary little endian PLY
+		Ply,
+		//Binary glTF, json and buffer in one file
+		Glb,
+		//glTF json, with the buffer written next to it with the .bin extension
+		Gltf
+	};
+
+	//Format matching the extension of path, throws std::runtime_error for unknown extensions
+	MeshFormat meshFormatFromPath(const std::string& path);
+
+	//Writes one vertex per cell at (x, y, height * heightScale) with a unit normal and texture coordinates, and two triangles per quad facing +z.
+	//Rows are formatted in parallel chunks, each written with a single fwrite in order. Returns the number of bytes written,
+	//throws std::runtime_error when the file cannot be written
+	size_t exportMesh(const Heightmap& hmap, const std::string& path, MeshFormat format, float heightScale = 1.f);
+}
@@ -0,0 +1,244 @@
+#include "PipeErosion.h"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <omp.h>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		template<typename Pass>
+		void timed(double& seconds, Pass pass)
+		{
+			const auto start = std::chrono::steady_clock::now();
+			pass();
+			seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		}
+	}
+
+	PipeErosion::PipeErosion(const Config& config) :
+		_config(config)
+	{
+	}
+
+	void PipeErosion::reset()
+	{
+		_width = 0;
+		_height = 0;
+		_timings = {};
+	}
+
+	void PipeErosion::resize(unsigned int width, unsigned int height)
+	{
+		if (width == _width && height == _height)
+			return;
+
+		_width = width;
+		_height = height;
+		const size_t cells = static_cast<size_t>(width) * height;
+		for (auto* field : { &_water, &_sediment, &_transportedSediment, &_fluxLeft, &_fluxRight, &_fluxTop, &_fluxBottom, &_velocityX, &_velocityY, &_sinTilt })
+			field->assign(cells, 0.f);
+	}
+
+	void PipeErosion::run(Heightmap& hmap, unsigned int iterations, int threads)
+	{
+		if (hmap._width == 0 || hmap._height == 0)
+			return;
+
+		resize(hmap._width, hmap._height);
+		_threads = threads <= 0 ? omp_get_max_threads() : threads;
+		float* terrain = hmap.data();
+		hmap.beginModification();
+
+		for (unsigned int i = 0; i < iterations; i++)
+		{
+			timed(_timings.rain, [&]() { rainPass(); });
+			timed(_timings.flux, [&]() { fluxPass(terrain); });
+			//The sediment moves with the water of the step, before the depths are updated
+			timed(_timings.transport, [&]() { transportPass(); });
+			timed(_timings.water, [&]() { waterPass(); });
+			timed(_timings.erosion, [&]() { erosionPass(terrain); });
+			timed(_timings.evaporation, [&]() { evaporationPass(); });
+		}
+		hmap.markDirty(0, 0, hmap._width, hmap._height);
+	}
+
+	void PipeErosion::rainPass()
+	{
+		const float rain = _config.timeStep * _config.rainRate;
+		float* water = _water.data();
+		const int cells = static_cast<int>(_water.size());
+#pragma omp parallel for num_threads(_threads)
+		for (int i = 0; i < cells; i++)
+			water[i] += rain;
+	}
+
+	void PipeErosion::fluxPass(const float* terrain)
+	{
+		const int width = static_cast<int>(_width);
+		const int height = static_cast<int>(_height);
+		const float fluxFactor = _config.timeStep * _config.pipeArea * _config.gravity / _config.cellSize;
+		const float cellArea = _config.cellSize * _config.cellSize;
+		const float timeStep = _config.timeStep;
+		const float inverseCellSpan = 0.5f / _config.cellSize;
+		const float minTilt = _config.minTilt;
+
+		const float* water = _water.data();
+		float* fluxLeft = _fluxLeft.data();
+		float* fluxRight = _fluxRight.data();
+		float* fluxTop = _fluxTop.data();
+		float* fluxBottom = _fluxBottom.data();
+		float* sinTilt = _sinTilt.data();
+
+#pragma omp parallel for num_threads(_threads)
+		for (int y = 0; y < height; y++)
+		{
+			const size_t row = static_cast<size_t>(y) * width;
+			const size_t top = y > 0 ? row - width : row;
+			const size_t bottom = y < height - 1 ? row + width : row;
+			for (int x = 0; x < width; x++)
+			{
+				const size_t i = row + x;
+				const int left = x > 0 ? x - 1 : x;
+				const int right = x < width - 1 ? x + 1 : x;
+
+				//The map border is a wall: the flux towards it stays at 0
+				const float surface = terrain[i] + water[i];
+				const float outLeft = x > 0 ? std::max(0.f, fluxLeft[i] + fluxFactor * (surface - terrain[row + left] - water[row + left])) : 0.f;
+				const float outRight = x < width - 1 ? std::max(0.f, fluxRight[i] + fluxFactor * (surface - terrain[row + right] - water[row + right])) : 0.f;
+				const float outTop = y > 0 ? std::max(0.f, fluxTop[i] + fluxFactor * (surface - terrain[top + x] - water[top + x])) : 0.f;
+				const float outBottom = y < height - 1 ? std::max(0.f, fluxBottom[i] + fluxFactor * (surface - terrain[bottom + x] - water[bottom + x])) : 0.f;
+
+				//Never drain more water than the cell holds
+				const float outflow = (outLeft + outRight + outTop + outBottom) * timeStep;
+				const float scale = outflow > water[i] * cellArea ? water[i] * cellArea / outflow : 1.f;
+				fluxLeft[i] = outLeft * scale;
+				fluxRight[i] = outRight * scale;
+				fluxTop[i] = outTop * scale;
+				fluxBottom[i] = outBottom * scale;
+
+				const float slopeX = (terrain[row + right] - terrain[row + left]) * inverseCellSpan;
+				const float slopeY = (terrain[bottom + x] - terrain[top + x]) * inverseCellSpan;
+				const float slope2 = slopeX * slopeX + slopeY * slopeY;
+				sinTilt[i] = std::max(minTilt, std::sqrt(slope2 / (1.f + slope2)));
+			}
+		}
+	}
+
+	void PipeErosion::waterPass()
+	{
+		const int width = static_cast<int>(_width);
+		const int height = static_cast<int>(_height);
+		const float timeStep = _config.timeStep;
+		const float cellSize = _config.cellSize;
+		const float inverseCellArea = 1.f / (cellSize * cellSize);
+
+		float* water = _water.data();
+		const float* fluxLeft = _fluxLeft.data();
+		const float* fluxRight = _fluxRight.data();
+		const float* fluxTop = _fluxTop.data();
+		const float* fluxBottom = _fluxBottom.data();
+		float* velocityX = _velocityX.data();
+		float* velocityY = _velocityY.data();
+
+#pragma omp parallel for num_threads(_threads)
+		for (int y = 0; y < height; y++)
+		{
+			const size_t row = static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; x++)
+			{
+				const size_t i = row + x;
+				const float inLeft = x > 0 ? fluxRight[i - 1] : 0.f;
+				const float inRight = x < width - 1 ? fluxLeft[i + 1] : 0.f;
+				const float inTop = y > 0 ? fluxBottom[i - width] : 0.f;
+				const float inBottom = y < height - 1 ? fluxTop[i + width] : 0.f;
+
+				const float inflow = inLeft + inRight + inTop + inBottom;
+				const float outflow = fluxLeft[i] + fluxRight[i] + fluxTop[i] + fluxBottom[i];
+				const float previous = water[i];
+				const float current = std::max(0.f, previous + timeStep * (inflow - outflow) * inverseCellArea);
+				water[i] = current;
+
+				//Velocity from the mean flux through the cell and the mean water depth during the step
+				const float depth = 0.5f * (previous + current);
+				const float inverseSection = depth > 1e-6f ? 1.f / (cellSize * depth) : 0.f;
+				velocityX[i] = 0.5f * (inLeft - fluxLeft[i] + fluxRight[i] - inRight) * inverseSection;
+				velocityY[i] = 0.5f * (inTop - fluxTop[i] + fluxBottom[i] - inBottom) * inverseSection;
+			}
+		}
+	}
+
+	void PipeErosion::erosionPass(float* terrain)
+	{
+		const float capacityFactor = _config.sedimentCapacity;
+		const float dissolving = _config.dissolving;
+		const float deposition = _config.deposition;
+		const float inverseErosionDepth = 1.f / _config.maxErosionDepth;
+
+		const float* water = _water.data();
+		float* sediment = _sediment.data();
+		const float* velocityX = _velocityX.data();
+		const float* velocityY = _velocityY.data();
+		const float* sinTilt = _sinTilt.data();
+		const int cells = static_cast<int>(_sediment.size());
+
+#pragma omp parallel for num_threads(_threads)
+		for (int i = 0; i < cells; i++)
+		{
+			const float speed = std::sqrt(velocityX[i] * velocityX[i] + velocityY[i] * velocityY[i]);
+			const float capacity = capacityFactor * sinTilt[i] * speed * std::min(1.f, water[i] * inverseErosionDepth);
+			const float difference = capacity - sediment[i];
+			//Dissolves terrain below capacity and deposits above it
+			const float change = difference > 0.f ? dissolving * difference : deposition * difference;
+			terrain[i] -= change;
+			sediment[i] += change;
+		}
+	}
+
+	void PipeErosion::transportPass()
+	{
+		const int width = static_cast<int>(_width);
+		const int height = static_cast<int>(_height);
+		const float timeStep = _config.timeStep;
+		const float inverseCellArea = 1.f / (_config.cellSize * _config.cellSize);
+
+		const float* water = _water.data();
+		const float* sediment = _sediment.data();
+		float* transported = _transportedSediment.data();
+		const float* fluxLeft = _fluxLeft.data();
+		const float* fluxRight = _fluxRight.data();
+		const float* fluxTop = _fluxTop.data();
+		const float* fluxBottom = _fluxBottom.data();
+
+		//Fraction of the sediment of cell i leaving with the flux, at most 1 since the flux pass never drains more water than the cell holds
+		const auto carried = [&](size_t i, float flux) { return water[i] > 0.f ? sediment[i] * std::min(1.f, flux * timeStep * inverseCellArea / water[i]) : 0.f; };
+
+#pragma omp parallel for num_threads(_threads)
+		for (int y = 0; y < height; y++)
+		{
+			const size_t row = static_cast<size_t>(y) * width;
+			for (int x = 0; x < width; x++)
+			{
+				const size_t i = row + x;
+				const float inflow = (x > 0 ? carried(i - 1, fluxRight[i - 1]) : 0.f)
+					+ (x < width - 1 ? carried(i + 1, fluxLeft[i + 1]) : 0.f)
+					+ (y > 0 ? carried(i - width, fluxBottom[i - width]) : 0.f)
+					+ (y < height - 1 ? carried(i + width, fluxTop[i + width]) : 0.f);
+				const float outflow = carried(i, fluxLeft[i] + fluxRight[i] + fluxTop[i] + fluxBottom[i]);
+				transported[i] = sediment[i] - outflow + inflow;
+			}
+		}
+		_sediment.swap(_transportedSediment);
+	}
+
+	void PipeErosion::evaporationPass()
+	{
+		const float remaining = std::max(0.f, 1.f - _config.evaporation * _config.timeStep);
+		float* water = _water.data();
+		const int cells = static_cast<int>(_water.size());
+#pragma omp parallel for num_threads(_threads)
+		for (int i = 0; i < cells; i++)
+			water[i] *= remaining;
+	}
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	//Eulerian hydraulic erosion on the grid (virtual pipes shallow water): water, suspended sediment and the outflow flux towards the
+	//four neighbours are stored per cell and updated by stencil passes. Every pass writes each cell from values of the previous pass only,
+	//so the result does not depend on the number of threads.
+	class PipeErosion
+	{
+	public:
+		struct Config
+		{
+			float timeStep = 0.02f;
+			//Water added to every cell per unit of time
+			float rainRate = 0.012f;
+			float gravity = 9.81f;
+			//Cross section of the virtual pipes and length of a cell
+			float pipeArea = 1.f;
+			float cellSize = 1.f;
+			float sedimentCapacity = 1.f;
+			float dissolving = 0.5f;
+			float deposition = 1.f;
+			float evaporation = 0.015f;
+			//Lower bound of the sine of the slope, so flat water still carries sediment
+			float minTilt = 0.05f;
+			//Water depth from which the capacity is no longer reduced, shallow films would otherwise erode at any speed
+			float maxErosionDepth = 1.f;
+		} _config;
+
+		struct PassTimings
+		{
+			double rain = 0.;
+			double flux = 0.;
+			double transport = 0.;
+			double water = 0.;
+			double erosion = 0.;
+			double evaporation = 0.;
+
+			double total() const { return rain + flux + transport + water + erosion + evaporation; }
+		};
+
+		PipeErosion() = default;
+		PipeErosion(const Config& config);
+
+		//Runs iterations time steps on hmap, water and sediment are kept between calls as long as the map size does not change.
+		//threads <= 0 uses all cores
+		void run(Heightmap& hmap, unsigned int iterations, int threads = 0);
+		//Drops the water and sediment
+		void reset();
+
+		//Seconds spent in each pass since the last reset
+		const PassTimings& timings() const { return _timings; }
+		const std::vector<float>& water() const { return _water; }
+		const std::vector<float>& sediment() const { return _sediment; }
+
+	private:
+		void resize(unsigned int width, unsigned int height);
+
+		void rainPass();
+		//Updates the outflow flux from the height differences and the sine of the local slope used by the erosion pass
+		void fluxPass(const float* terrain);
+		//Moves the sediment along the water flux, conservative upwind finite volumes
+		void transportPass();
+		//Moves the water along the flux and derives the velocity field
+		void waterPass();
+		void erosionPass(float* terrain);
+		void evaporationPass();
+
+		unsigned int _width = 0;
+		unsigned int _height = 0;
+		int _threads = 1;
+
+		std::vector<float> _water;
+		std::vector<float> _sediment;
+		std::vector<float> _transportedSediment;
+		std::vector<float> _fluxLeft;
+		std::vector<float> _fluxRight;
+		std::vector<float> _fluxTop;
+		std::vector<float> _fluxBottom;
+		std::vector<float> _velocityX;
+		std::vector<float> _velocityY;
+		std::vector<float> _sinTilt;
+
+		PassTimings _timings;
+	};
+}
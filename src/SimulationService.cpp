@@ -0,0 +1,253 @@
+#include "SimulationService.h"
+#include <chrono>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		//Chunks of a run are sized to last about this long, so cancellation and publication stay responsive
+		constexpr std::chrono::milliseconds chunkDuration(20);
+		constexpr std::chrono::milliseconds publishInterval(33);
+	}
+
+	SimulationService::SimulationService(unsigned int width, unsigned int height) :
+		_hmap(width, height)
+	{
+		publish();
+		_frames.update();
+		_thread = std::thread(&SimulationService::loop, this);
+	}
+
+	SimulationService::~SimulationService()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_stop = true;
+			_requests.clear();
+		}
+		_cancel = true;
+		_condition.notify_one();
+		_thread.join();
+	}
+
+	void SimulationService::generate(unsigned int width, unsigned int height, float maxValue, const TerrainGenerator::Config& terrain)
+	{
+		Request request;
+		request.type = Request::TYPE::GENERATE;
+		request.width = width;
+		request.height = height;
+		request.maxValue = maxValue;
+		request.terrainConfig = terrain;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_requests.push_back(request);
+		}
+		_condition.notify_one();
+	}
+
+	void SimulationService::run(const ErosionGenerator::Config& config, unsigned int droplets, unsigned int seed, const DropletOptions& options, bool recordTrajectories,
+		const TrajectoryRecorder::Config& trajectories)
+	{
+		Request request;
+		request.type = Request::TYPE::RUN;
+		request.config = config;
+		request.droplets = droplets;
+		request.seed = seed;
+		request.options = options;
+		request.recordTrajectories = recordTrajectories;
+		request.trajectoryConfig = trajectories;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_requests.push_back(request);
+		}
+		_condition.notify_one();
+	}
+
+	void SimulationService::runUntilConverged(const ErosionGenerator::Config& config, const ConvergenceOptions& convergence, unsigned int seed, const DropletOptions& options, bool recordTrajectories,
+		const TrajectoryRecorder::Config& trajectories)
+	{
+		Request request;
+		request.type = Request::TYPE::CONVERGE;
+		request.config = config;
+		request.convergence = convergence;
+		request.seed = seed;
+		request.options = options;
+		request.recordTrajectories = recordTrajectories;
+		request.trajectoryConfig = trajectories;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_requests.push_back(request);
+		}
+		_condition.notify_one();
+	}
+
+	void SimulationService::relax(const ThermalErosion::Config& config, unsigned int iterations, int threads)
+	{
+		Request request;
+		request.type = Request::TYPE::RELAX;
+		request.thermalConfig = config;
+		request.iterations = iterations;
+		request.options.threads = threads;
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_requests.push_back(request);
+		}
+		_condition.notify_one();
+	}
+
+	void SimulationService::cancel()
+	{
+		{
+			std::lock_guard<std::mutex> lock(_mutex);
+			_requests.clear();
+		}
+		_cancel = true;
+	}
+
+	void SimulationService::loop()
+	{
+		while (true)
+		{
+			Request request;
+			{
+				std::unique_lock<std::mutex> lock(_mutex);
+				_condition.wait(lock, [this]() { return _stop || !_requests.empty(); });
+				if (_stop)
+					return;
+
+				request = _requests.front();
+				_requests.pop_front();
+				_cancel = false;
+				_busy = true;
+			}
+
+			execute(request);
+			_busy = false;
+		}
+	}
+
+	void SimulationService::execute(const Request& request)
+	{
+		switch (request.type)
+		{
+		case Request::TYPE::GENERATE:
+			//Unchanged settings are answered by the terrain cache without generating again
+			_generator._terrain._config = request.terrainConfig;
+			_hmap = _generator.generateNoisyTerrain(request.width, request.height, request.maxValue);
+			_trajectories = nullptr;
+			publish();
+			break;
+
+		case Request::TYPE::RUN:
+		{
+			_generator._config = request.config;
+			_dropletsRequested = request.droplets;
+			_dropletsDone = 0;
+
+			auto trajectories = request.recordTrajectories ? std::make_shared<TrajectoryRecorder>(request.trajectoryConfig) : nullptr;
+			DropletOptions options = request.options;
+			options.trajectorySink = trajectories.get();
+
+			//Chunks stay multiples of tiledRoundSize, so the threaded engines give the same map whatever the timings
+			constexpr unsigned int roundSize = ErosionGenerator::tiledRoundSize;
+			unsigned int chunk = roundSize;
+			unsigned int done = 0;
+			auto lastPublish = std::chrono::steady_clock::now();
+			while (done < request.droplets && !_cancel)
+			{
+				const unsigned int count = std::min(chunk, request.droplets - done);
+				const auto start = std::chrono::steady_clock::now();
+				options.firstDroplet = done;
+				_generator.launchDroplets(_hmap, count, request.seed, options);
+				const auto end = std::chrono::steady_clock::now();
+
+				done += count;
+				_dropletsDone = done;
+
+				if (end - start < chunkDuration / 2)
+					chunk *= 2;
+				else if (end - start > chunkDuration * 2 && chunk > roundSize)
+					chunk /= 2;
+
+				//Publishing is O(1), but the next write copies the map once since the frame shares it
+				if (end - lastPublish > publishInterval)
+				{
+					publish();
+					lastPublish = end;
+				}
+			}
+			_trajectories = std::move(trajectories);
+			publish();
+			break;
+		}
+
+		case Request::TYPE::CONVERGE:
+		{
+			_generator._config = request.config;
+			//No known total, the progress is hidden
+			_dropletsRequested = 0;
+			_dropletsDone = 0;
+
+			auto trajectories = request.recordTrajectories ? std::make_shared<TrajectoryRecorder>(request.trajectoryConfig) : nullptr;
+			DropletOptions options = request.options;
+			options.trajectorySink = trajectories.get();
+
+			ConvergenceOptions convergence = request.convergence;
+			auto lastPublish = std::chrono::steady_clock::now();
+			_convergence = std::make_shared<std::vector<ConvergencePoint>>();
+			//A batch is never interrupted, cancel() stops the run at the end of the current one
+			convergence.onBatch = [this, &lastPublish](const ConvergencePoint& point)
+			{
+				_dropletsDone = point.droplets;
+				//Published frames share the curve, so it is copied rather than appended to
+				auto curve = std::make_shared<std::vector<ConvergencePoint>>(*_convergence);
+				curve->push_back(point);
+				_convergence = std::move(curve);
+				const auto now = std::chrono::steady_clock::now();
+				if (now - lastPublish > publishInterval)
+				{
+					publish();
+					lastPublish = now;
+				}
+				return !_cancel;
+			};
+
+			const auto result = _generator.launchDropletsUntilConverged(_hmap, request.seed, convergence, options);
+			_convergence = std::make_shared<std::vector<ConvergencePoint>>(result.curve);
+			_trajectories = std::move(trajectories);
+			publish();
+			break;
+		}
+
+		case Request::TYPE::RELAX:
+		{
+			_thermal._config = request.thermalConfig;
+			//Iterations are run in small groups so cancellation and publication stay responsive
+			constexpr unsigned int iterationsPerChunk = 16;
+			auto lastPublish = std::chrono::steady_clock::now();
+			for (unsigned int done = 0; done < request.iterations && !_cancel; done += iterationsPerChunk)
+			{
+				_thermal.run(_hmap, std::min(iterationsPerChunk, request.iterations - done), request.options.threads);
+				const auto end = std::chrono::steady_clock::now();
+				if (end - lastPublish > publishInterval)
+				{
+					publish();
+					lastPublish = end;
+				}
+			}
+			publish();
+			break;
+		}
+		}
+	}
+
+	void SimulationService::publish()
+	{
+		Frame& frame = _frames.back();
+		frame.hmap = _hmap;
+		frame.trajectories = _trajectories;
+		frame.convergence = _convergence;
+		frame.version = ++_version;
+		_frames.publish();
+	}
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "ErosionGenerator.h"
+#include "ThermalErosion.h"
+#include "TrajectoryRecorder.h"
+#include "TripleBuffer.h"
+
+namespace ErosionSimulation
+{
+	//Runs terrain generation and erosion on its own thread and publishes snapshots of the map through a triple buffer,
+	//so a render loop can read a consistent map every frame without waiting for the simulation.
+	class SimulationService
+	{
+	public:
+		struct Frame
+		{
+			Heightmap hmap;
+			std::shared_ptr<const TrajectoryRecorder> trajectories;
+			//Batches of the last adaptive run, null until one is started
+			std::shared_ptr<const std::vector<ConvergencePoint>> convergence;
+			unsigned long long version = 0;
+		};
+
+		SimulationService(unsigned int width, unsigned int height);
+		~SimulationService();
+
+		SimulationService(const SimulationService&) = delete;
+		SimulationService& operator=(const SimulationService&) = delete;
+
+		//Requests are queued and executed in order by the simulation thread
+		void generate(unsigned int width, unsigned int height, float maxValue, const TerrainGenerator::Config& terrain = {});
+		//The config is copied, the trajectory sink of options is replaced by the service's own recorder when recordTrajectories is set.
+		//The map only depends on the seed, not on the chunks the run is split in to stay responsive
+		void run(const ErosionGenerator::Config& config, unsigned int droplets, unsigned int seed, const DropletOptions& options, bool recordTrajectories,
+			const TrajectoryRecorder::Config& trajectories = {});
+		//Adaptive run, stopping on convergence, its limits or cancel(). The curve is published with the frames as the batches complete
+		void runUntilConverged(const ErosionGenerator::Config& config, const ConvergenceOptions& convergence, unsigned int seed, const DropletOptions& options, bool recordTrajectories,
+			const TrajectoryRecorder::Config& trajectories = {});
+		//Talus relaxation of the map, queued after the previous requests like any run
+		void relax(const ThermalErosion::Config& config, unsigned int iterations, int threads);
+		//Stops the current run after its current chunk and drops the queued requests
+		void cancel();
+
+		//Reader side, must always be called from the same thread. Returns true when a newer frame was published
+		bool updateFrame() { return _frames.update(); }
+		const Frame& frame() const { return _frames.front(); }
+
+		bool busy() const { return _busy.load(std::memory_order_relaxed); }
+		unsigned long long dropletsDone() const { return _dropletsDone.load(std::memory_order_relaxed); }
+		unsigned long long dropletsRequested() const { return _dropletsRequested.load(std::memory_order_relaxed); }
+
+	private:
+		struct Request
+		{
+			enum class TYPE
+			{
+				GENERATE,
+				RUN,
+				CONVERGE,
+				RELAX
+			} type = TYPE::GENERATE;
+
+			unsigned int width = 0;
+			unsigned int height = 0;
+			float maxValue = 0.f;
+			TerrainGenerator::Config terrainConfig;
+
+			ErosionGenerator::Config config;
+			unsigned int droplets = 0;
+			unsigned int seed = 0;
+			DropletOptions options;
+			bool recordTrajectories = false;
+			TrajectoryRecorder::Config trajectoryConfig;
+			ConvergenceOptions convergence;
+
+			ThermalErosion::Config thermalConfig;
+			unsigned int iterations = 0;
+		};
+
+		void loop();
+		void execute(const Request& request);
+		//Trajectories of a run are only published once the run is complete
+		void publish();
+
+		ErosionGenerator _generator;
+		ThermalErosion _thermal;
+		Heightmap _hmap;
+		std::shared_ptr<const TrajectoryRecorder> _trajectories;
+		std::shared_ptr<const std::vector<ConvergencePoint>> _convergence;
+		TripleBuffer<Frame> _frames;
+		unsigned long long _version = 0;
+
+		std::mutex _mutex;
+		std::condition_variable _condition;
+		std::deque<Request> _requests;
+		bool _stop = false;
+
+		std::atomic<bool> _cancel = false;
+		std::atomic<bool> _busy = false;
+		std::atomic<unsigned long long> _dropletsDone = 0;
+		std::atomic<unsigned long long> _dropletsRequested = 0;
+
+		std::thread _thread;
+	};
+}
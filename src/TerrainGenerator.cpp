@@ -0,0 +1,140 @@
+#include "TerrainGenerator.h"
+#include <algorithm>
+#include <limits>
+#include <vector>
+#include <omp.h>
+#include "TiledHeightmap.h"
+
+namespace ErosionSimulation
+{
+	TerrainGenerator::TerrainGenerator(const Config& config) :
+		_config(config)
+	{
+	}
+
+	FastNoise::SmartNode<> TerrainGenerator::graph()
+	{
+		if (_graph && _graphConfig == _config)
+			return _graph;
+
+		FastNoise::SmartNode<> node = FastNoise::New<FastNoise::OpenSimplex2S>();
+		if (_config.octaves > 1)
+		{
+			auto fbm = FastNoise::New<FastNoise::FractalFBm>();
+			fbm->SetSource(node);
+			fbm->SetOctaveCount(_config.octaves);
+			fbm->SetGain(_config.gain);
+			fbm->SetLacunarity(_config.lacunarity);
+			fbm->SetWeightedStrength(_config.weightedStrength);
+			node = fbm;
+		}
+		if (_config.warpAmplitude > 0.f)
+		{
+			auto warp = FastNoise::New<FastNoise::DomainWarpGradient>();
+			warp->SetSource(node);
+			warp->SetWarpAmplitude(_config.warpAmplitude);
+			warp->SetWarpFrequency(_config.warpFrequency);
+			node = warp;
+		}
+
+		_graph = node;
+		_graphConfig = _config;
+		return _graph;
+	}
+
+	Heightmap TerrainGenerator::generate(unsigned int width, unsigned int height, float maxValue, int seed, int threads)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for (auto entry = _cache.begin(); entry != _cache.end(); ++entry)
+		{
+			if (entry->config == _config && entry->width == width && entry->height == height && entry->maxValue == maxValue && entry->seed == seed)
+			{
+				_cache.splice(_cache.begin(), _cache, entry);
+				_cacheHits++;
+				return _cache.front().hmap;
+			}
+		}
+
+		Heightmap hmap(width, height);
+		if (width > 0 && height > 0)
+		{
+			const auto noise = graph();
+			threads = threads <= 0 ? omp_get_max_threads() : threads;
+			float* data = hmap.data();
+
+			//Bands span whole rows, so FastNoise writes them in place
+			const int bands = static_cast<int>((height + bandHeight - 1) / bandHeight);
+			std::vector<FastNoise::OutputMinMax> ranges(bands);
+#pragma omp parallel for schedule(dynamic) num_threads(threads)
+			for (int band = 0; band < bands; band++)
+			{
+				const unsigned int y0 = band * bandHeight;
+				const unsigned int rows = std::min(bandHeight, height - y0);
+				ranges[band] = noise->GenUniformGrid2D(data + static_cast<size_t>(y0) * width, 0, y0, width, rows, _config.frequency, seed);
+			}
+
+			float minValue = std::numeric_limits<float>::max();
+			float maxNoise = std::numeric_limits<float>::lowest();
+			for (const auto& range : ranges)
+			{
+				minValue = std::min(minValue, range.min);
+				maxNoise = std::max(maxNoise, range.max);
+			}
+
+			//Offset and scale fused in a single pass. The scale is the one the erosion defaults are tuned for: maxValue times the noise range
+			const float scale = maxValue * (maxNoise - minValue);
+			hmap = (hmap - minValue) * scale;
+		}
+
+		//The cache shares the buffer, the caller's first write detaches its own copy
+		_cache.push_front({ _config, width, height, maxValue, seed, hmap });
+		if (_cache.size() > cacheSize)
+			_cache.pop_back();
+		return hmap;
+	}
+
+	void TerrainGenerator::generate(TiledHeightmap& tiles, float maxValue, int seed)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		const auto noise = graph();
+		const unsigned int tileSize = tiles.tileSize();
+		//UNorm16 tiles cannot hold the raw noise outside of their range, it is generated again instead of read back
+		const bool regenerate = tiles.format() == HeightFormat::UNorm16;
+		float minValue = std::numeric_limits<float>::max();
+		float maxNoise = std::numeric_limits<float>::lowest();
+		for (unsigned int ty = 0; ty < tiles.tilesY(); ty++)
+		{
+			for (unsigned int tx = 0; tx < tiles.tilesX(); tx++)
+			{
+				Heightmap tile(std::min(tileSize, tiles.width() - tx * tileSize), std::min(tileSize, tiles.height() - ty * tileSize));
+				auto minMax = noise->GenUniformGrid2D(tile.data(), tx * tileSize, ty * tileSize, tile._width, tile._height, _config.frequency, seed);
+				minValue = std::min(minValue, minMax.min);
+				maxNoise = std::max(maxNoise, minMax.max);
+				if (!regenerate)
+					tiles.write(tx * tileSize, ty * tileSize, tile);
+			}
+		}
+
+		//Normalization needs the range of the whole map, hence the second pass
+		const float scale = maxValue * (maxNoise - minValue);
+		for (unsigned int ty = 0; ty < tiles.tilesY(); ty++)
+		{
+			for (unsigned int tx = 0; tx < tiles.tilesX(); tx++)
+			{
+				Heightmap tile(std::min(tileSize, tiles.width() - tx * tileSize), std::min(tileSize, tiles.height() - ty * tileSize));
+				if (regenerate)
+					noise->GenUniformGrid2D(tile.data(), tx * tileSize, ty * tileSize, tile._width, tile._height, _config.frequency, seed);
+				else
+					tiles.read(tx * tileSize, ty * tileSize, tile);
+				tile = (tile - minValue) * scale;
+				tiles.write(tx * tileSize, ty * tileSize, tile);
+			}
+		}
+	}
+
+	void TerrainGenerator::clearCache()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_cache.clear();
+	}
+}
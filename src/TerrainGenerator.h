@@ -0,0 +1,72 @@
+#pragma once
+
+#include <FastNoise/FastNoise.h>
+#include <list>
+#include <mutex>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	class TiledHeightmap;
+
+	//Noise terrain built from a FastNoise node graph: OpenSimplex2S, summed in fBm octaves, optionally domain warped.
+	//Maps are generated in parallel bands of rows written in place, offset to 0 and scaled in a single fused pass,
+	//and the last results are cached so generating again with the same parameters only shares the cached buffer.
+	class TerrainGenerator
+	{
+	public:
+		struct Config
+		{
+			float frequency = 0.003f;
+			//1 is a single OpenSimplex2S octave
+			int octaves = 1;
+			float gain = 0.5f;
+			float lacunarity = 2.f;
+			//Lowers the amplitude of an octave where the previous ones are low, giving smoother valleys
+			float weightedStrength = 0.f;
+			//Warp displacement in noise units, 0 disables the domain warp
+			float warpAmplitude = 0.f;
+			float warpFrequency = 0.5f;
+
+			bool operator==(const Config& other) const = default;
+		} _config;
+
+		TerrainGenerator() = default;
+		TerrainGenerator(const Config& config);
+
+		//Heights start at 0 and are scaled by maxValue times the range of the noise. threads <= 0 uses all cores
+		Heightmap generate(unsigned int width, unsigned int height, float maxValue, int seed = 0, int threads = 0);
+		//Same terrain as the in-memory version, generated and normalized one tile at a time
+		void generate(TiledHeightmap& tiles, float maxValue, int seed = 0);
+
+		void clearCache();
+		//Number of generate calls answered from the cache
+		unsigned long long cacheHits() const { return _cacheHits; }
+
+		//Rows generated by one task
+		static constexpr unsigned int bandHeight = 32;
+		static constexpr size_t cacheSize = 4;
+
+	private:
+		//Returns the graph of the current config, rebuilt only when the config changes. Called with _mutex held
+		FastNoise::SmartNode<> graph();
+
+		struct CacheEntry
+		{
+			Config config;
+			unsigned int width;
+			unsigned int height;
+			float maxValue;
+			int seed;
+			Heightmap hmap;
+		};
+
+		//Held for a whole generation, the band tasks only read the graph
+		std::mutex _mutex;
+		FastNoise::SmartNode<> _graph;
+		Config _graphConfig;
+		//Most recently used first
+		std::list<CacheEntry> _cache;
+		unsigned long long _cacheHits = 0;
+	};
+}
@@ -0,0 +1,316 @@
+#include "TerrainLod.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+
+namespace ErosionSimulation
+{
+	bool TerrainLod::update(const Heightmap& hmap)
+	{
+		const bool rebuild = hmap._width != _width || hmap._height != _height || hmap.generation() < _generation || _levels.empty();
+		if (!rebuild)
+		{
+			const auto regions = hmap.dirtyRegions(_generation);
+			_generation = hmap.generation();
+			if (regions.empty())
+				return false;
+
+			std::vector<std::vector<char>> dirty(_levels.size());
+			for (unsigned int level = 0; level < _levels.size(); level++)
+			{
+				const Level& lod = _levels[level];
+				const int span = static_cast<int>(chunkCells << level);
+				const int stride = 1 << level;
+				dirty[level].assign(lod.chunks.size(), 0);
+				for (const auto& region : regions)
+				{
+					//Normals read one vertex further, so a cell also changes the chunks ending a stride before it
+					const int first_x = std::max(static_cast<int>(region.x0) - stride, 0) / span;
+					const int first_y = std::max(static_cast<int>(region.y0) - stride, 0) / span;
+					const int last_x = std::min(static_cast<int>(region.x1) + stride, static_cast<int>(_width) - 1) / span;
+					const int last_y = std::min(static_cast<int>(region.y1) + stride, static_cast<int>(_height) - 1) / span;
+					for (int cy = first_y; cy <= std::min(last_y, static_cast<int>(lod.chunksY) - 1); cy++)
+						for (int cx = first_x; cx <= std::min(last_x, static_cast<int>(lod.chunksX) - 1); cx++)
+							dirty[level][cx + cy * lod.chunksX] = 1;
+				}
+			}
+
+			//Children first, the errors of the parents include them
+			for (unsigned int level = 0; level < _levels.size(); level++)
+			{
+				Level& lod = _levels[level];
+#pragma omp parallel for schedule(dynamic)
+				for (int index = 0; index < static_cast<int>(lod.chunks.size()); index++)
+				{
+					if (!dirty[level][index])
+						continue;
+					computeError(hmap, level, index % lod.chunksX, index / lod.chunksX);
+					lod.chunks[index].stale = true;
+				}
+			}
+			return false;
+		}
+
+		_width = hmap._width;
+		_height = hmap._height;
+		_generation = hmap.generation();
+		_levels.clear();
+		if (_width < 2 || _height < 2)
+			return true;
+
+		unsigned int id = 0;
+		for (unsigned int level = 0; ; level++)
+		{
+			const unsigned int span = chunkCells << level;
+			Level lod;
+			lod.chunksX = (_width - 1 + span - 1) / span;
+			lod.chunksY = (_height - 1 + span - 1) / span;
+			lod.chunks.resize(static_cast<size_t>(lod.chunksX) * lod.chunksY);
+			for (unsigned int cy = 0; cy < lod.chunksY; cy++)
+			{
+				for (unsigned int cx = 0; cx < lod.chunksX; cx++)
+				{
+					Chunk& chunk = lod.chunks[cx + cy * lod.chunksX];
+					chunk.id = id++;
+					chunk.level = level;
+					chunk.x0 = cx * span;
+					chunk.y0 = cy * span;
+					chunk.stride = 1u << level;
+					chunk.version = 0;
+					chunk.stale = true;
+				}
+			}
+			_levels.push_back(std::move(lod));
+
+			if (_levels.back().chunks.size() == 1)
+				break;
+		}
+
+		for (unsigned int level = 0; level < _levels.size(); level++)
+		{
+			const Level& lod = _levels[level];
+#pragma omp parallel for schedule(dynamic)
+			for (int index = 0; index < static_cast<int>(lod.chunks.size()); index++)
+				computeError(hmap, level, index % lod.chunksX, index / lod.chunksX);
+		}
+		return true;
+	}
+
+	void TerrainLod::computeError(const Heightmap& hmap, unsigned int level, unsigned int cx, unsigned int cy)
+	{
+		Chunk& chunk = _levels[level].chunks[cx + cy * _levels[level].chunksX];
+		const float* data = hmap.data();
+		const unsigned int stride = chunk.stride;
+		const unsigned int x_end = std::min(chunk.x0 + chunkCells * stride, _width - 1);
+		const unsigned int y_end = std::min(chunk.y0 + chunkCells * stride, _height - 1);
+
+		float error = 0.f;
+		float minHeight = std::numeric_limits<float>::max();
+		float maxHeight = std::numeric_limits<float>::lowest();
+		for (unsigned int y = chunk.y0; y <= y_end; y++)
+		{
+			//Vertices of the chunk around the cell, the last ones clamped to the map
+			const unsigned int top = chunk.y0 + (y - chunk.y0) / stride * stride;
+			const unsigned int bottom = std::min(top + stride, _height - 1);
+			const float y_remain = bottom > top ? static_cast<float>(y - top) / (bottom - top) : 0.f;
+			for (unsigned int x = chunk.x0; x <= x_end; x++)
+			{
+				const float value = data[x + y * _width];
+				minHeight = std::min(minHeight, value);
+				maxHeight = std::max(maxHeight, value);
+				if (stride == 1)
+					continue;
+
+				const unsigned int left = chunk.x0 + (x - chunk.x0) / stride * stride;
+				const unsigned int right = std::min(left + stride, _width - 1);
+				const float x_remain = right > left ? static_cast<float>(x - left) / (right - left) : 0.f;
+
+				//Same split as the index buffer: the diagonal goes from the bottom left to the top right vertex
+				const float top_left = data[left + top * _width];
+				const float top_right = data[right + top * _width];
+				const float bottom_left = data[left + bottom * _width];
+				const float bottom_right = data[right + bottom * _width];
+				const float interpolated = x_remain + y_remain <= 1.f ?
+					top_left + x_remain * (top_right - top_left) + y_remain * (bottom_left - top_left) :
+					bottom_right + (1.f - x_remain) * (bottom_left - bottom_right) + (1.f - y_remain) * (top_right - bottom_right);
+				error = std::max(error, std::abs(value - interpolated));
+			}
+		}
+
+		if (level > 0)
+		{
+			const Level& children = _levels[level - 1];
+			for (unsigned int child_y = 2 * cy; child_y < std::min(2 * cy + 2, children.chunksY); child_y++)
+				for (unsigned int child_x = 2 * cx; child_x < std::min(2 * cx + 2, children.chunksX); child_x++)
+					error = std::max(error, children.chunks[child_x + child_y * children.chunksX].error);
+		}
+
+		chunk.error = error;
+		chunk.minHeight = minHeight;
+		chunk.maxHeight = maxHeight;
+	}
+
+	void TerrainLod::buildMesh(const Heightmap& hmap, Chunk& chunk, float skirtDepth) const
+	{
+		const float* data = hmap.data();
+		const unsigned int stride = chunk.stride;
+		chunk.vertices.resize(3 * vertexCount);
+		chunk.normals.resize(3 * vertexCount);
+		chunk.uvs.resize(2 * vertexCount);
+
+		for (unsigned int j = 0; j < chunkVertices; j++)
+		{
+			const unsigned int y = std::min(chunk.y0 + j * stride, _height - 1);
+			const unsigned int up = y >= stride ? y - stride : 0;
+			const unsigned int down = std::min(y + stride, _height - 1);
+			for (unsigned int i = 0; i < chunkVertices; i++)
+			{
+				const unsigned int x = std::min(chunk.x0 + i * stride, _width - 1);
+				const unsigned int left = x >= stride ? x - stride : 0;
+				const unsigned int right = std::min(x + stride, _width - 1);
+
+				const size_t vertex = i + j * chunkVertices;
+				chunk.vertices[3 * vertex] = static_cast<float>(x) - _width / 2;
+				chunk.vertices[3 * vertex + 1] = static_cast<float>(y) - _height / 2;
+				chunk.vertices[3 * vertex + 2] = data[x + y * _width];
+				chunk.uvs[2 * vertex] = static_cast<float>(x) / _width;
+				chunk.uvs[2 * vertex + 1] = static_cast<float>(y) / _height;
+
+				//Central differences over the spacing of the chunk, so coarse levels are shaded by their own slope. Normalized as computeNormals does
+				const float gradient_x = (data[right + y * _width] - data[left + y * _width]) / (right - left);
+				const float gradient_y = (data[x + down * _width] - data[x + up * _width]) / (down - up);
+				const float inverseNorm = 1.f / std::sqrt(gradient_x * gradient_x + gradient_y * gradient_y + 1.f);
+				chunk.normals[3 * vertex] = -gradient_x * inverseNorm;
+				chunk.normals[3 * vertex + 1] = -gradient_y * inverseNorm;
+				chunk.normals[3 * vertex + 2] = inverseNorm;
+			}
+		}
+		buildSkirts(chunk, skirtDepth);
+
+		chunk.stale = false;
+	}
+
+	void TerrainLod::buildSkirts(Chunk& chunk, float skirtDepth) const
+	{
+		//Top, bottom, left and right borders
+		for (unsigned int edge = 0; edge < 4; edge++)
+		{
+			for (unsigned int k = 0; k < chunkVertices; k++)
+			{
+				const unsigned int border = edge == 0 ? k : edge == 1 ? k + chunkCells * chunkVertices : edge == 2 ? k * chunkVertices : chunkCells + k * chunkVertices;
+				const unsigned int skirt = chunkVertices * chunkVertices + edge * chunkVertices + k;
+				for (unsigned int c = 0; c < 3; c++)
+				{
+					chunk.vertices[3 * skirt + c] = chunk.vertices[3 * border + c];
+					chunk.normals[3 * skirt + c] = chunk.normals[3 * border + c];
+				}
+				chunk.uvs[2 * skirt] = chunk.uvs[2 * border];
+				chunk.uvs[2 * skirt + 1] = chunk.uvs[2 * border + 1];
+				chunk.vertices[3 * skirt + 2] -= skirtDepth;
+			}
+		}
+
+		chunk.skirt = skirtDepth;
+		chunk.version++;
+	}
+
+	float TerrainLod::skirtDepth(unsigned int level, unsigned int cx, unsigned int cy) const
+	{
+		//Along a shared border the finer chunk has a vertex wherever the coarser one has, so the gap is at most the error of the coarser one.
+		//Selection does not balance levels, any coarser chunk touching this one can be a neighbour
+		const Chunk& chunk = _levels[level].chunks[cx + cy * _levels[level].chunksX];
+		const unsigned int x0 = chunk.x0 > 0 ? chunk.x0 - 1 : 0;
+		const unsigned int y0 = chunk.y0 > 0 ? chunk.y0 - 1 : 0;
+		const unsigned int x1 = std::min(chunk.x0 + chunkCells * chunk.stride, _width - 1);
+		const unsigned int y1 = std::min(chunk.y0 + chunkCells * chunk.stride, _height - 1);
+
+		float depth = 0.f;
+		for (unsigned int coarser = level; coarser < _levels.size(); coarser++)
+		{
+			const Level& lod = _levels[coarser];
+			const unsigned int span = chunkCells << coarser;
+			for (unsigned int y = y0 / span; y <= std::min(y1 / span, lod.chunksY - 1); y++)
+				for (unsigned int x = x0 / span; x <= std::min(x1 / span, lod.chunksX - 1); x++)
+					depth = std::max(depth, lod.chunks[x + y * lod.chunksX].error);
+		}
+		return depth + 1.f;
+	}
+
+	void TerrainLod::select(const Heightmap& hmap, const Camera& camera, float maxPixelError, std::vector<const Chunk*>& selection)
+	{
+		selection.clear();
+		if (_levels.empty())
+			return;
+
+		const float pixelsPerUnit = camera.viewportHeight / (2.f * std::tan(camera.fovY / 2.f));
+		const unsigned int top = static_cast<unsigned int>(_levels.size()) - 1;
+		selectChunk(hmap, top, 0, 0, camera, pixelsPerUnit, maxPixelError, selection);
+	}
+
+	void TerrainLod::selectChunk(const Heightmap& hmap, unsigned int level, unsigned int cx, unsigned int cy, const Camera& camera, float pixelsPerUnit,
+		float maxPixelError, std::vector<const Chunk*>& selection)
+	{
+		Level& lod = _levels[level];
+		Chunk& chunk = lod.chunks[cx + cy * lod.chunksX];
+
+		//Distance from the camera to the bounding box of the chunk
+		const float min_x = static_cast<float>(chunk.x0) - _width / 2;
+		const float min_y = static_cast<float>(chunk.y0) - _height / 2;
+		const float max_x = static_cast<float>(std::min(chunk.x0 + chunkCells * chunk.stride, _width - 1)) - _width / 2;
+		const float max_y = static_cast<float>(std::min(chunk.y0 + chunkCells * chunk.stride, _height - 1)) - _height / 2;
+		const float dx = std::max({ min_x - camera.x, 0.f, camera.x - max_x });
+		const float dy = std::max({ min_y - camera.y, 0.f, camera.y - max_y });
+		const float dz = std::max({ chunk.minHeight - camera.z, 0.f, camera.z - chunk.maxHeight });
+		const float distance = std::max(std::sqrt(dx * dx + dy * dy + dz * dz), 1e-3f);
+
+		if (level == 0 || chunk.error * pixelsPerUnit / distance <= maxPixelError)
+		{
+			//The errors of the neighbours change without making this chunk stale
+			const float depth = skirtDepth(level, cx, cy);
+			if (chunk.stale)
+				buildMesh(hmap, chunk, depth);
+			else if (chunk.skirt != depth)
+				buildSkirts(chunk, depth);
+			selection.push_back(&chunk);
+			return;
+		}
+
+		const Level& children = _levels[level - 1];
+		for (unsigned int child_y = 2 * cy; child_y < std::min(2 * cy + 2, children.chunksY); child_y++)
+			for (unsigned int child_x = 2 * cx; child_x < std::min(2 * cx + 2, children.chunksX); child_x++)
+				selectChunk(hmap, level - 1, child_x, child_y, camera, pixelsPerUnit, maxPixelError, selection);
+	}
+
+	const std::vector<uint16_t>& TerrainLod::indices()
+	{
+		static const std::vector<uint16_t> indices = []()
+		{
+			std::vector<uint16_t> indices;
+			indices.reserve(6 * chunkCells * chunkCells + 4 * 6 * chunkCells);
+			for (unsigned int y = 0; y < chunkCells; y++)
+			{
+				for (unsigned int x = 0; x < chunkCells; x++)
+				{
+					const uint16_t top_left = static_cast<uint16_t>(x + y * chunkVertices);
+					const uint16_t bottom_left = static_cast<uint16_t>(top_left + chunkVertices);
+					indices.insert(indices.cend(), { top_left, bottom_left, static_cast<uint16_t>(top_left + 1) });
+					indices.insert(indices.cend(), { static_cast<uint16_t>(top_left + 1), bottom_left, static_cast<uint16_t>(bottom_left + 1) });
+				}
+			}
+
+			for (unsigned int edge = 0; edge < 4; edge++)
+			{
+				for (unsigned int k = 0; k < chunkCells; k++)
+				{
+					const unsigned int border = edge == 0 ? k : edge == 1 ? k + chunkCells * chunkVertices : edge == 2 ? k * chunkVertices : chunkCells + k * chunkVertices;
+					const unsigned int next = edge < 2 ? border + 1 : border + chunkVertices;
+					const unsigned int skirt = chunkVertices * chunkVertices + edge * chunkVertices + k;
+					indices.insert(indices.cend(), { static_cast<uint16_t>(border), static_cast<uint16_t>(skirt), static_cast<uint16_t>(next) });
+					indices.insert(indices.cend(), { static_cast<uint16_t>(next), static_cast<uint16_t>(skirt), static_cast<uint16_t>(skirt + 1) });
+				}
+			}
+			return indices;
+		}();
+		return indices;
+	}
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	//Quadtree of fixed size chunks over a heightmap. A chunk of level L samples one cell out of 2^L, so every chunk has the same
+	//chunkVertices x chunkVertices grid and all of them share a single 16 bit index buffer.
+	//Chunks are selected so that their geometric error projected on screen stays under a number of pixels,
+	//and skirts hanging from their borders hide the cracks between neighbours of different levels: the gap along a shared border is at most
+	//the error of the coarser chunk, so the skirts are as deep as the largest error of the chunks of the same or coarser levels touching them.
+	class TerrainLod
+	{
+	public:
+		static constexpr unsigned int chunkCells = 64;
+		static constexpr unsigned int chunkVertices = chunkCells + 1;
+		//Grid vertices, followed by one skirt vertex under each border vertex
+		static constexpr unsigned int vertexCount = chunkVertices * chunkVertices + 4 * chunkVertices;
+
+		struct Camera
+		{
+			//Position in the coordinates of the mesh: map centered on the origin, heights along z
+			float x;
+			float y;
+			float z;
+			//Vertical field of view in radians
+			float fovY;
+			float viewportHeight;
+		};
+
+		struct Chunk
+		{
+			//Unique over the tree, stable until the dimensions change
+			unsigned int id;
+			unsigned int level;
+			//First cell and distance in cells between two vertices
+			unsigned int x0;
+			unsigned int y0;
+			unsigned int stride;
+			//Largest height difference between the triangles of the chunk and the map, never lower than the errors of its children
+			float error;
+			float minHeight;
+			float maxHeight;
+			//Incremented every time the mesh is rebuilt
+			unsigned long long version;
+			//Depth the skirts were built with
+			float skirt;
+			std::vector<float> vertices;
+			//Unit normals and texture coordinates, laid out as TerrainMesh
+			std::vector<float> normals;
+			std::vector<float> uvs;
+			bool stale;
+		};
+
+		//Recomputes the errors of the chunks covering the regions modified since the previous update, or the whole tree
+		//when the dimensions change. Returns true when the tree was rebuilt, invalidating the chunk ids
+		bool update(const Heightmap& hmap);
+		//Fills selection with the chunks to draw, refining while the projected error exceeds maxPixelError, and rebuilds their meshes when stale
+		void select(const Heightmap& hmap, const Camera& camera, float maxPixelError, std::vector<const Chunk*>& selection);
+
+		//Triangles of a chunk, grid then skirts, indexing its vertices, normals and uvs
+		static const std::vector<uint16_t>& indices();
+
+		unsigned int levels() const { return static_cast<unsigned int>(_levels.size()); }
+
+	private:
+		struct Level
+		{
+			unsigned int chunksX;
+			unsigned int chunksY;
+			std::vector<Chunk> chunks;
+		};
+
+		void computeError(const Heightmap& hmap, unsigned int level, unsigned int cx, unsigned int cy);
+		void buildMesh(const Heightmap& hmap, Chunk& chunk, float skirtDepth) const;
+		//Copies the border vertices of the grid skirtDepth below them
+		void buildSkirts(Chunk& chunk, float skirtDepth) const;
+		void selectChunk(const Heightmap& hmap, unsigned int level, unsigned int cx, unsigned int cy, const Camera& camera, float pixelsPerUnit,
+			float maxPixelError, std::vector<const Chunk*>& selection);
+		//Depth of the skirts of a chunk, enough to cover the gap to a selected neighbour of any level
+		float skirtDepth(unsigned int level, unsigned int cx, unsigned int cy) const;
+
+		unsigned int _width = 0;
+		unsigned int _height = 0;
+		unsigned long long _generation = 0;
+		std::vector<Level> _levels;
+	};
+}
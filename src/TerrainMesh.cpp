@@ -0,0 +1,123 @@
+#include "TerrainMesh.h"
+#include <algorithm>
+#include "GradientField.h"
+
+namespace ErosionSimulation
+{
+	bool TerrainMesh::update(const Heightmap& hmap)
+	{
+		_dirtyRanges.clear();
+		_topologyChanged = false;
+
+		//A map older than the mesh cannot be a later state of the same terrain
+		if (hmap._width != _width || hmap._height != _height || hmap.generation() < _generation || _vertices.empty())
+		{
+			rebuild(hmap);
+			_generation = hmap.generation();
+			_topologyChanged = true;
+			return true;
+		}
+
+		const auto regions = hmap.dirtyRegions(_generation);
+		_generation = hmap.generation();
+		if (regions.empty())
+			return false;
+
+		for (const auto& region : regions)
+		{
+			//The normals of the surrounding vertices read the cells of the region
+			const DirtyRect rect = { region.x0 > 0 ? region.x0 - 1 : 0, region.y0 > 0 ? region.y0 - 1 : 0,
+				std::min(region.x1 + 1, _width), std::min(region.y1 + 1, _height) };
+			updateRect(hmap, rect);
+
+			const size_t vertexSize = 3 * sizeof(float);
+			if (rect.x0 == 0 && rect.x1 == _width)
+			{
+				_dirtyRanges.push_back({ static_cast<size_t>(rect.y0) * _width * vertexSize, static_cast<size_t>(rect.y1 - rect.y0) * _width * vertexSize });
+				continue;
+			}
+			for (unsigned int y = rect.y0; y < rect.y1; y++)
+				_dirtyRanges.push_back({ (static_cast<size_t>(y) * _width + rect.x0) * vertexSize, static_cast<size_t>(rect.x1 - rect.x0) * vertexSize });
+		}
+		mergeRanges();
+		return true;
+	}
+
+	void TerrainMesh::rebuild(const Heightmap& hmap)
+	{
+		_width = hmap._width;
+		_height = hmap._height;
+		const size_t count = static_cast<size_t>(_width) * _height;
+		_vertices.assign(3 * count, 0.f);
+		_normals.assign(3 * count, 0.f);
+		_uvs.assign(2 * count, 0.f);
+		_indices.clear();
+		if (count == 0)
+			return;
+
+		//the vertex x and y never change afterwards
+#pragma omp parallel for
+		for (int y = 0; y < static_cast<int>(_height); y++)
+		{
+			for (unsigned int x = 0; x < _width; x++)
+			{
+				const size_t index = x + static_cast<size_t>(y) * _width;
+				_vertices[3 * index] = static_cast<float>(x) - _width / 2;
+				_vertices[3 * index + 1] = static_cast<float>(y) - _height / 2;
+				_uvs[2 * index] = static_cast<float>(x) / _width;
+				_uvs[2 * index + 1] = static_cast<float>(y) / _height;
+			}
+		}
+		updateRect(hmap, { 0, 0, _width, _height });
+
+		if (_width < 2 || _height < 2)
+			return;
+
+		_indices.reserve(6 * static_cast<size_t>(_width - 1) * (_height - 1));
+		for (unsigned int y = 0; y < _height - 1; y++)
+		{
+			for (unsigned int x = 0; x < _width - 1; x++)
+			{
+				_indices.insert(_indices.cend(), { x + y * _width, x + (y + 1) * _width, x + 1 + y * _width });
+				_indices.insert(_indices.cend(), { x + 1 + y * _width , x + (y + 1) * _width,  x + 1 + (y + 1) * _width });
+			}
+		}
+	}
+
+	void TerrainMesh::updateRect(const Heightmap& hmap, const DirtyRect& rect)
+	{
+		const float* data = hmap.data();
+		const unsigned int width = _width;
+
+#pragma omp parallel for
+		for (int y = static_cast<int>(rect.y0); y < static_cast<int>(rect.y1); y++)
+		{
+			for (unsigned int x = rect.x0; x < rect.x1; x++)
+			{
+				const size_t index = x + static_cast<size_t>(y) * width;
+				_vertices[3 * index + 2] = data[index];
+			}
+		}
+		computeNormals(hmap, GradientKernel::CentralDifference, rect, _normals);
+	}
+
+	void TerrainMesh::mergeRanges()
+	{
+		if (_dirtyRanges.empty())
+			return;
+
+		std::sort(_dirtyRanges.begin(), _dirtyRanges.end(), [](const ByteRange& a, const ByteRange& b) { return a.offset < b.offset; });
+
+		size_t merged = 0;
+		for (size_t i = 1; i < _dirtyRanges.size(); i++)
+		{
+			ByteRange& last = _dirtyRanges[merged];
+			const ByteRange& range = _dirtyRanges[i];
+			if (range.offset <= last.offset + last.size)
+				last.size = std::max(last.offset + last.size, range.offset + range.size) - last.offset;
+			else
+				_dirtyRanges[++merged] = range;
+		}
+		_dirtyRanges.resize(merged + 1);
+	}
+}
@@ -0,0 +1,53 @@
+#pragma once
+
+#include <vector>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	//CPU copy of the render buffers of a heightmap, one vertex per cell.
+	//update() only recomputes the vertices and normals of the blocks the map reports dirty since the previous update,
+	//and lists the bytes that changed so the GPU buffers can be patched instead of uploaded again.
+	class TerrainMesh
+	{
+	public:
+		struct ByteRange
+		{
+			size_t offset;
+			size_t size;
+		};
+
+		//Returns false when nothing changed since the previous update
+		bool update(const Heightmap& hmap);
+
+		//True when the last update rebuilt everything (first update, new dimensions or unrelated map): all buffers must be uploaded
+		bool topologyChanged() const { return _topologyChanged; }
+		//Ranges of the vertex and normal buffers changed by the last update, sorted and disjoint. Both buffers hold 3 floats per vertex so they share the ranges
+		const std::vector<ByteRange>& dirtyRanges() const { return _dirtyRanges; }
+
+		const std::vector<float>& vertices() const { return _vertices; }
+		const std::vector<float>& normals() const { return _normals; }
+		const std::vector<float>& uvs() const { return _uvs; }
+		const std::vector<unsigned int>& indices() const { return _indices; }
+
+		unsigned int width() const { return _width; }
+		unsigned int height() const { return _height; }
+
+	private:
+		void rebuild(const Heightmap& hmap);
+		//Recomputes the heights and normals of the half-open rectangle of vertices
+		void updateRect(const Heightmap& hmap, const DirtyRect& rect);
+		void mergeRanges();
+
+		unsigned int _width = 0;
+		unsigned int _height = 0;
+		unsigned long long _generation = 0;
+		bool _topologyChanged = false;
+
+		std::vector<float> _vertices;
+		std::vector<float> _normals;
+		std::vector<float> _uvs;
+		std::vector<unsigned int> _indices;
+		std::vector<ByteRange> _dirtyRanges;
+	};
+}
@@ -0,0 +1,130 @@
+#include "ThermalErosion.h"
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <omp.h>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		constexpr int neighbourCount = 8;
+		constexpr int neighbourX[neighbourCount] = { -1, 0, 1, -1, 1, -1, 0, 1 };
+		constexpr int neighbourY[neighbourCount] = { -1, -1, -1, 0, 0, 1, 1, 1 };
+
+		//Rows above, at and below y, clamped to the map, so only the first and last columns need clamping
+		void neighbourRows(const float* data, int y, int width, int height, const float* rows[3])
+		{
+			rows[0] = data + static_cast<size_t>(std::max(y - 1, 0)) * width;
+			rows[1] = data + static_cast<size_t>(y) * width;
+			rows[2] = data + static_cast<size_t>(std::min(y + 1, height - 1)) * width;
+		}
+
+		//Share of its steepest excess that cell x gives away, left and right are its neighbouring columns, clamped on the borders
+		inline float excessRatio(const float* const rows[3], int left, int x, int right, const float talus[neighbourCount], float rate)
+		{
+			const int columns[3] = { left, x, right };
+			const float h = rows[1][x];
+			float totalExcess = 0.f;
+			float maxDifference = 0.f;
+			for (int n = 0; n < neighbourCount; n++)
+			{
+				const float difference = h - rows[neighbourY[n] + 1][columns[neighbourX[n] + 1]] - talus[n];
+				//(d + |d|) / 2 is exactly max(0, d), without the branch GCC threads with the max below
+				totalExcess += (difference + std::abs(difference)) * 0.5f;
+				maxDifference = std::max(maxDifference, difference);
+			}
+			//Half the steepest excess at most, so the cell never ends below the neighbours it feeds. maxDifference starts at 0, so it is the
+			//steepest excess and is 0 when totalExcess is: dividing by at least the smallest float keeps the loop free of branches
+			return 0.5f * rate * maxDifference / std::max(totalExcess, std::numeric_limits<float>::min());
+		}
+
+		//Height of cell x once the transfers with its neighbours are applied
+		inline float transfer(const float* const rows[3], const float* const ratios[3], int left, int x, int right, const float talus[neighbourCount])
+		{
+			const int columns[3] = { left, x, right };
+			const float h = rows[1][x];
+			const float cellRatio = ratios[1][x];
+			float change = 0.f;
+			for (int n = 0; n < neighbourCount; n++)
+			{
+				const int row = neighbourY[n] + 1;
+				const int column = columns[neighbourX[n] + 1];
+				const float difference = h - rows[row][column];
+				//Same excess as computed by the sender, so what leaves a cell is exactly what its neighbours receive
+				change -= cellRatio * std::max(0.f, difference - talus[n]);
+				change += ratios[row][column] * std::max(0.f, -difference - talus[n]);
+			}
+			return h + change;
+		}
+	}
+
+	ThermalErosion::ThermalErosion(const Config& config) :
+		_config(config)
+	{
+	}
+
+	void ThermalErosion::run(Heightmap& hmap, unsigned int iterations, int threads)
+	{
+		if (iterations == 0 || hmap._width == 0 || hmap._height == 0)
+			return;
+
+		const int width = static_cast<int>(hmap._width);
+		const int height = static_cast<int>(hmap._height);
+		const size_t cells = static_cast<size_t>(width) * height;
+		threads = threads <= 0 ? omp_get_max_threads() : threads;
+		_transferRatio.resize(cells);
+		_buffer.resize(cells);
+
+		//Diagonal neighbours are sqrt(2) cells away and tolerate a larger difference
+		float talus[neighbourCount];
+		for (int n = 0; n < neighbourCount; n++)
+			talus[n] = _config.talusSlope * std::sqrt(static_cast<float>(neighbourX[n] * neighbourX[n] + neighbourY[n] * neighbourY[n]));
+		const float rate = std::clamp(_config.rate, 0.f, 1.f);
+
+		hmap.beginModification();
+		float* source = hmap.data();
+		float* destination = _buffer.data();
+		float* ratio = _transferRatio.data();
+
+		for (unsigned int iteration = 0; iteration < iterations; iteration++)
+		{
+			//Neighbours outside the map are clamped to the cell itself, which never has any excess over itself
+#pragma omp parallel for num_threads(threads)
+			for (int y = 0; y < height; y++)
+			{
+				const float* rows[3];
+				neighbourRows(source, y, width, height, rows);
+				float* ratioRow = ratio + static_cast<size_t>(y) * width;
+				ratioRow[0] = excessRatio(rows, 0, 0, std::min(1, width - 1), talus, rate);
+#pragma omp simd
+				for (int x = 1; x < width - 1; x++)
+					ratioRow[x] = excessRatio(rows, x - 1, x, x + 1, talus, rate);
+				if (width > 1)
+					ratioRow[width - 1] = excessRatio(rows, width - 2, width - 1, width - 1, talus, rate);
+			}
+
+#pragma omp parallel for num_threads(threads)
+			for (int y = 0; y < height; y++)
+			{
+				const float* rows[3];
+				const float* ratios[3];
+				neighbourRows(source, y, width, height, rows);
+				neighbourRows(ratio, y, width, height, ratios);
+				float* destinationRow = destination + static_cast<size_t>(y) * width;
+				destinationRow[0] = transfer(rows, ratios, 0, 0, std::min(1, width - 1), talus);
+#pragma omp simd
+				for (int x = 1; x < width - 1; x++)
+					destinationRow[x] = transfer(rows, ratios, x - 1, x, x + 1, talus);
+				if (width > 1)
+					destinationRow[width - 1] = transfer(rows, ratios, width - 2, width - 1, width - 1, talus);
+			}
+			std::swap(source, destination);
+		}
+
+		//An odd number of iterations leaves the result in the scratch buffer
+		if (source != hmap._data)
+			std::copy(source, source + cells, hmap._data);
+		hmap.markDirty(0, 0, width, height);
+	}
+}
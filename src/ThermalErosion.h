@@ -0,0 +1,33 @@
+#pragma once
+
+#include <vector>
+#include "Heightmap.h"
+
+namespace ErosionSimulation
+{
+	//Talus relaxation: material slides from every cell to those of its 8 neighbours lower by more than the talus slope allows.
+	//Each iteration first computes how much material leaves every cell, then gathers the transfers into a second buffer,
+	//so the result does not depend on the number of threads and no material is lost.
+	class ThermalErosion
+	{
+	public:
+		struct Config
+		{
+			//Height difference per cell of distance above which material slides, the tangent of the talus angle
+			float talusSlope = 1.2f;
+			//Fraction of the excess of the steepest neighbour moved per iteration, at most 1
+			float rate = 0.5f;
+		} _config;
+
+		ThermalErosion() = default;
+		ThermalErosion(const Config& config);
+
+		//threads <= 0 uses all cores
+		void run(Heightmap& hmap, unsigned int iterations, int threads = 0);
+
+	private:
+		//Share of its excess over each neighbour that leaves every cell
+		std::vector<float> _transferRatio;
+		std::vector<float> _buffer;
+	};
+}
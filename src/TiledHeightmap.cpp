@@ -0,0 +1,196 @@
+#include "TiledHeightmap.h"
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <stdexcept>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		struct TilesHeader
+		{
+			char magic[8];
+			uint32_t version;
+			uint32_t width;
+			uint32_t height;
+			uint32_t tileSize;
+			//Since version 2, version 1 tiles are float32
+			uint32_t format;
+			float rangeMin;
+			float rangeMax;
+		};
+
+		constexpr char tilesMagic[8] = { 'E', 'R', 'O', 'S', 'T', 'I', 'L', 'E' };
+		constexpr uint32_t tilesVersion = 2;
+		constexpr size_t tilesHeaderV1Size = offsetof(TilesHeader, format);
+
+		const char* tileExtension(HeightFormat format)
+		{
+			return format == HeightFormat::Float32 ? ".f32" : format == HeightFormat::Float16 ? ".f16" : ".u16";
+		}
+
+		std::string headerPath(const std::string& directory)
+		{
+			return (std::filesystem::path(directory) / "tiles.meta").string();
+		}
+	}
+
+	TiledHeightmap::TiledHeightmap(const std::string& directory, unsigned int width, unsigned int height, unsigned int tileSize, unsigned int maxResidentTiles,
+		HeightFormat format, const HeightRange& range) :
+		_directory(directory),
+		_width(width),
+		_height(height),
+		_tileSize(tileSize),
+		_maxResidentTiles(std::max(maxResidentTiles, 1U)),
+		_format(format),
+		_range(range)
+	{
+	}
+
+	std::unique_ptr<TiledHeightmap> TiledHeightmap::create(const std::string& directory, unsigned int width, unsigned int height, unsigned int tileSize, unsigned int maxResidentTiles,
+		HeightFormat format, const HeightRange& range)
+	{
+		if (tileSize == 0)
+			throw std::runtime_error("the tile size must be positive");
+		std::filesystem::create_directories(directory);
+
+		const TilesHeader header = { { tilesMagic[0], tilesMagic[1], tilesMagic[2], tilesMagic[3], tilesMagic[4], tilesMagic[5], tilesMagic[6], tilesMagic[7] },
+			tilesVersion, width, height, tileSize, static_cast<uint32_t>(format), range.min, range.max };
+		FILE* file = std::fopen(headerPath(directory).c_str(), "wb");
+		if (!file)
+			throw std::runtime_error("could not create " + headerPath(directory));
+		const bool written = std::fwrite(&header, sizeof(header), 1, file) == 1;
+		if (std::fclose(file) != 0 || !written)
+			throw std::runtime_error("could not write " + headerPath(directory));
+
+		std::unique_ptr<TiledHeightmap> tiles(new TiledHeightmap(directory, width, height, tileSize, maxResidentTiles, format, range));
+		//Tiles of a previous map are dropped, they are created sparse on first access and read as zeros
+		for (unsigned int ty = 0; ty < tiles->tilesY(); ty++)
+			for (unsigned int tx = 0; tx < tiles->tilesX(); tx++)
+				std::filesystem::remove(tiles->tilePath(tx, ty));
+		return tiles;
+	}
+
+	std::unique_ptr<TiledHeightmap> TiledHeightmap::open(const std::string& directory, unsigned int maxResidentTiles)
+	{
+		TilesHeader header;
+		FILE* file = std::fopen(headerPath(directory).c_str(), "rb");
+		if (!file)
+			throw std::runtime_error(directory + " does not hold a tiled heightmap");
+		bool read = std::fread(&header, tilesHeaderV1Size, 1, file) == 1;
+		if (read && header.version == 1)
+		{
+			header.format = static_cast<uint32_t>(HeightFormat::Float32);
+			header.rangeMin = 0.f;
+			header.rangeMax = 1.f;
+		}
+		else if (read)
+			read = std::fread(reinterpret_cast<char*>(&header) + tilesHeaderV1Size, sizeof(header) - tilesHeaderV1Size, 1, file) == 1;
+		std::fclose(file);
+		if (!read || std::memcmp(header.magic, tilesMagic, sizeof(tilesMagic)) != 0 || header.version < 1 || header.version > tilesVersion || header.tileSize == 0
+			|| header.format > static_cast<uint32_t>(HeightFormat::UNorm16))
+			throw std::runtime_error(headerPath(directory) + " is not a tiled heightmap header");
+
+		return std::unique_ptr<TiledHeightmap>(new TiledHeightmap(directory, header.width, header.height, header.tileSize, maxResidentTiles,
+			static_cast<HeightFormat>(header.format), { header.rangeMin, header.rangeMax }));
+	}
+
+	std::string TiledHeightmap::tilePath(unsigned int tx, unsigned int ty) const
+	{
+		return (std::filesystem::path(_directory) / ("tile_" + std::to_string(tx) + "_" + std::to_string(ty) + tileExtension(_format))).string();
+	}
+
+	char* TiledHeightmap::acquire(unsigned int tx, unsigned int ty)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		const unsigned int key = tx + ty * tilesX();
+		auto found = _tiles.find(key);
+		if (found == _tiles.end())
+		{
+			//Edge tiles keep the full size, so every tile has the same layout
+			Tile tile;
+			tile.file = std::make_unique<MappedFile>(tilePath(tx, ty), MappedFile::Mode::ReadWrite, static_cast<size_t>(_tileSize) * _tileSize * heightFormatSize(_format));
+			_lru.push_front(key);
+			tile.lru = _lru.begin();
+			found = _tiles.emplace(key, std::move(tile)).first;
+			_faults++;
+
+			//Unmapping flushes the pages of the evicted tiles back to their files
+			auto candidate = _lru.end();
+			while (_tiles.size() > _maxResidentTiles && candidate != _lru.begin())
+			{
+				--candidate;
+				const auto evicted = _tiles.find(*candidate);
+				if (evicted->second.pins > 0)
+					continue;
+				candidate = _lru.erase(candidate);
+				_tiles.erase(evicted);
+			}
+		}
+		else
+			_lru.splice(_lru.begin(), _lru, found->second.lru);
+
+		found->second.pins++;
+		return reinterpret_cast<char*>(found->second.file->data());
+	}
+
+	void TiledHeightmap::release(unsigned int tx, unsigned int ty)
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_tiles[tx + ty * tilesX()].pins--;
+	}
+
+	size_t TiledHeightmap::residentTiles() const
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		return _tiles.size();
+	}
+
+	void TiledHeightmap::copy(unsigned int x0, unsigned int y0, unsigned int width, unsigned int height, float* data, bool toTiles)
+	{
+		if (x0 + width > _width || y0 + height > _height)
+			throw std::runtime_error("region out of the tiled heightmap");
+		if (width == 0 || height == 0)
+			return;
+
+		for (unsigned int ty = y0 / _tileSize; ty <= (y0 + height - 1) / _tileSize; ty++)
+		{
+			for (unsigned int tx = x0 / _tileSize; tx <= (x0 + width - 1) / _tileSize; tx++)
+			{
+				const unsigned int first_x = std::max(x0, tx * _tileSize);
+				const unsigned int last_x = std::min(x0 + width, (tx + 1) * _tileSize);
+				const unsigned int first_y = std::max(y0, ty * _tileSize);
+				const unsigned int last_y = std::min(y0 + height, (ty + 1) * _tileSize);
+
+				char* tile = acquire(tx, ty);
+				const size_t heightSize = heightFormatSize(_format);
+				for (unsigned int y = first_y; y < last_y; y++)
+				{
+					char* tileRow = tile + (static_cast<size_t>(y - ty * _tileSize) * _tileSize + (first_x - tx * _tileSize)) * heightSize;
+					float* regionRow = data + static_cast<size_t>(y - y0) * width + (first_x - x0);
+					if (toTiles)
+						encodeHeights(_format, regionRow, tileRow, last_x - first_x, _range);
+					else
+						decodeHeights(_format, tileRow, regionRow, last_x - first_x, _range);
+				}
+				release(tx, ty);
+			}
+		}
+	}
+
+	void TiledHeightmap::read(unsigned int x0, unsigned int y0, Heightmap& hmap)
+	{
+		copy(x0, y0, hmap._width, hmap._height, hmap.data(), false);
+		hmap.beginModification();
+		hmap.markDirty(0, 0, hmap._width, hmap._height);
+	}
+
+	void TiledHeightmap::write(unsigned int x0, unsigned int y0, const Heightmap& hmap)
+	{
+		copy(x0, y0, hmap._width, hmap._height, const_cast<float*>(hmap.data()), true);
+	}
+}
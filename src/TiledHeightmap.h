@@ -0,0 +1,76 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "Heightmap.h"
+#include "HeightStorage.h"
+#include "MappedFile.h"
+
+namespace ErosionSimulation
+{
+	//Heightmap stored on disk as one file per square tile, only the most recently used tiles stay mapped in memory.
+	//Regions are copied in and out of regular Heightmaps; the tiles they cross are faulted in on demand.
+	//Concurrent reads and writes are safe as long as they touch different tiles.
+	class TiledHeightmap
+	{
+	public:
+		//Creates the tiles in directory, created if needed, all heights at 0 (at range.min for UNorm16).
+		//Regions are converted from and to the format of the tiles as they are copied, so 16 bit tiles halve the disk and page cache traffic
+		static std::unique_ptr<TiledHeightmap> create(const std::string& directory, unsigned int width, unsigned int height,
+			unsigned int tileSize = 1024, unsigned int maxResidentTiles = 64, HeightFormat format = HeightFormat::Float32, const HeightRange& range = { 0.f, 1.f });
+		//Opens tiles made by create. Throws std::runtime_error when the directory does not hold a tiled map
+		static std::unique_ptr<TiledHeightmap> open(const std::string& directory, unsigned int maxResidentTiles = 64);
+
+		unsigned int width() const { return _width; }
+		unsigned int height() const { return _height; }
+		unsigned int tileSize() const { return _tileSize; }
+		unsigned int tilesX() const { return (_width + _tileSize - 1) / _tileSize; }
+		unsigned int tilesY() const { return (_height + _tileSize - 1) / _tileSize; }
+		HeightFormat format() const { return _format; }
+		const HeightRange& range() const { return _range; }
+
+		//Copies the region of hmap dimensions starting at (x0, y0) into hmap
+		void read(unsigned int x0, unsigned int y0, Heightmap& hmap);
+		//Copies hmap into the region starting at (x0, y0)
+		void write(unsigned int x0, unsigned int y0, const Heightmap& hmap);
+
+		//Number of tiles mapped from disk so far and currently mapped
+		unsigned long long faults() const { return _faults; }
+		size_t residentTiles() const;
+
+	private:
+		TiledHeightmap(const std::string& directory, unsigned int width, unsigned int height, unsigned int tileSize, unsigned int maxResidentTiles,
+			HeightFormat format, const HeightRange& range);
+
+		//Maps the tile if needed and keeps it resident until release
+		char* acquire(unsigned int tx, unsigned int ty);
+		void release(unsigned int tx, unsigned int ty);
+		//Copies between the tiles and a buffer of the region, toTiles selects the direction
+		void copy(unsigned int x0, unsigned int y0, unsigned int width, unsigned int height, float* data, bool toTiles);
+		std::string tilePath(unsigned int tx, unsigned int ty) const;
+
+		struct Tile
+		{
+			std::unique_ptr<MappedFile> file;
+			unsigned int pins = 0;
+			std::list<unsigned int>::iterator lru;
+		};
+
+		std::string _directory;
+		unsigned int _width;
+		unsigned int _height;
+		unsigned int _tileSize;
+		unsigned int _maxResidentTiles;
+		HeightFormat _format;
+		HeightRange _range;
+
+		mutable std::mutex _mutex;
+		std::unordered_map<unsigned int, Tile> _tiles;
+		//Most recently used first
+		std::list<unsigned int> _lru;
+		unsigned long long _faults = 0;
+	};
+}
@@ -0,0 +1,156 @@
+#include "TrajectoryRecorder.h"
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+
+namespace ErosionSimulation
+{
+	TrajectoryRecorder::PointIterator& TrajectoryRecorder::PointIterator::operator++()
+	{
+		if (--_remaining > 0)
+		{
+			int16_t delta[2];
+			std::memcpy(delta, _deltas, deltaSize);
+			_deltas += deltaSize;
+			_point.x += delta[0] * _quantum;
+			_point.y += delta[1] * _quantum;
+		}
+		return *this;
+	}
+
+	TrajectoryRecorder::Trajectory::Trajectory(const std::byte* record, float quantum) :
+		_deltas(record + sizeof(Header)),
+		_quantum(quantum)
+	{
+		Header header;
+		std::memcpy(&header, record, sizeof(Header));
+		_first = { header.x, header.y };
+		_count = header.count;
+	}
+
+	void TrajectoryRecorder::Trajectory::decode(std::vector<point2f>& points) const
+	{
+		points.reserve(_count);
+		points.assign(begin(), end());
+	}
+
+	TrajectoryRecorder::Iterator& TrajectoryRecorder::Iterator::operator++()
+	{
+		_offset += _recorder->recordSizeAt(_offset);
+		if (_recorder->_wrapped && _offset == _recorder->_wrapEnd)
+			_offset = 0;
+		_remaining--;
+		return *this;
+	}
+
+	TrajectoryRecorder::TrajectoryRecorder(const Config& config) :
+		_config(config)
+	{
+	}
+
+	void TrajectoryRecorder::record(const point2f* points, unsigned int count)
+	{
+		const unsigned long long droplet = _droplets.fetch_add(1, std::memory_order_relaxed);
+		if (count == 0 || droplet % std::max(_config.dropletStride, 1u) != 0)
+			return;
+
+		const unsigned int stride = std::max(_config.stepStride, 1u);
+		const unsigned int kept = (count - 1) / stride + 1 + ((count - 1) % stride != 0 ? 1 : 0);
+		const size_t size = recordSize(kept);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (size > _config.budgetBytes)
+		{
+			_evicted++;
+			return;
+		}
+
+		const size_t offset = allocate(size);
+		std::byte* out = _arena.data() + offset;
+		const Header header = { kept, points[0].x, points[0].y };
+		std::memcpy(out, &header, sizeof(Header));
+		out += sizeof(Header);
+
+		//Deltas are taken from the decoded point, a delta clamped to the int16 range is caught up by the next ones
+		const float inverseQuantum = 1.f / _config.quantum;
+		point2f decoded = points[0];
+		for (unsigned int k = 1; k < kept; k++)
+		{
+			const point2f& point = points[std::min(k * stride, count - 1)];
+			int16_t delta[2];
+			delta[0] = static_cast<int16_t>(std::clamp(std::lround((point.x - decoded.x) * inverseQuantum), -32767L, 32767L));
+			delta[1] = static_cast<int16_t>(std::clamp(std::lround((point.y - decoded.y) * inverseQuantum), -32767L, 32767L));
+			decoded.x += delta[0] * _config.quantum;
+			decoded.y += delta[1] * _config.quantum;
+			std::memcpy(out, delta, deltaSize);
+			out += deltaSize;
+		}
+
+		_count++;
+		_bytes += size;
+	}
+
+	void TrajectoryRecorder::clear()
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_tail = _head = _wrapEnd = 0;
+		_wrapped = false;
+		_count = 0;
+		_bytes = 0;
+		_evicted = 0;
+		_droplets = 0;
+	}
+
+	size_t TrajectoryRecorder::recordSizeAt(size_t offset) const
+	{
+		uint32_t count;
+		std::memcpy(&count, _arena.data() + offset, sizeof(count));
+		return recordSize(count);
+	}
+
+	size_t TrajectoryRecorder::allocate(size_t size)
+	{
+		while (true)
+		{
+			if (!_wrapped)
+			{
+				//The arena grows up to the budget before the ring starts overwriting
+				if (_head + size > _arena.size() && _arena.size() < _config.budgetBytes)
+					_arena.resize(std::min(_config.budgetBytes, std::max(2 * _arena.size(), _head + size)));
+				if (_head + size <= _arena.size())
+					break;
+
+				_wrapEnd = _head;
+				_head = 0;
+				_wrapped = true;
+			}
+			if (_wrapped && _head + size <= _tail)
+				break;
+			evictOldest();
+		}
+
+		const size_t offset = _head;
+		_head += size;
+		return offset;
+	}
+
+	void TrajectoryRecorder::evictOldest()
+	{
+		const size_t size = recordSizeAt(_tail);
+		_tail += size;
+		_bytes -= size;
+		_count--;
+		_evicted++;
+		if (_count == 0)
+		{
+			//Both ends restart from the beginning of the arena
+			_tail = _head = _wrapEnd = 0;
+			_wrapped = false;
+		}
+		else if (_wrapped && _tail == _wrapEnd)
+		{
+			_tail = 0;
+			_wrapped = false;
+		}
+	}
+}
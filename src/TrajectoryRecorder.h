@@ -0,0 +1,151 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <iterator>
+#include <mutex>
+#include <vector>
+#include "ErosionGenerator.h"
+
+namespace ErosionSimulation
+{
+	//Trajectory sink with a fixed memory budget: the sampled trajectories are encoded one after the other in a single arena used as a ring buffer,
+	//so once the budget is reached each new trajectory evicts the oldest ones. A trajectory is stored as its first point followed by
+	//int16 deltas in multiples of Config::quantum, each relative to the decoded previous point so the rounding errors do not add up.
+	class TrajectoryRecorder : public TrajectorySink
+	{
+	public:
+		struct Config
+		{
+			size_t budgetBytes = 64 << 20;
+			//Records one droplet out of dropletStride
+			unsigned int dropletStride = 1;
+			//Keeps one point out of stepStride, plus the last one
+			unsigned int stepStride = 1;
+			//Resolution of the deltas in cells, a single delta spans at most 32767 * quantum
+			float quantum = 1.f / 128.f;
+		};
+
+		//Decodes the points of a trajectory on the fly
+		class PointIterator
+		{
+		public:
+			using iterator_category = std::input_iterator_tag;
+			using value_type = point2f;
+			using difference_type = std::ptrdiff_t;
+			using pointer = const point2f*;
+			using reference = const point2f&;
+
+			PointIterator() = default;
+			PointIterator(const std::byte* deltas, point2f point, unsigned int remaining, float quantum) :
+				_deltas(deltas), _point(point), _remaining(remaining), _quantum(quantum) {}
+
+			const point2f& operator*() const { return _point; }
+			const point2f* operator->() const { return &_point; }
+			PointIterator& operator++();
+			PointIterator operator++(int) { PointIterator previous = *this; ++*this; return previous; }
+			bool operator==(const PointIterator& other) const { return _remaining == other._remaining; }
+
+		private:
+			const std::byte* _deltas = nullptr;
+			point2f _point = {};
+			unsigned int _remaining = 0;
+			float _quantum = 0.f;
+		};
+
+		class Trajectory
+		{
+		public:
+			Trajectory(const std::byte* record, float quantum);
+
+			unsigned int size() const { return _count; }
+			PointIterator begin() const { return { _deltas, _first, _count, _quantum }; }
+			PointIterator end() const { return {}; }
+			//Replaces the content of points, whose capacity can be reused from one trajectory to the next
+			void decode(std::vector<point2f>& points) const;
+
+		private:
+			const std::byte* _deltas;
+			point2f _first;
+			unsigned int _count;
+			float _quantum;
+		};
+
+		//Oldest trajectory first
+		class Iterator
+		{
+		public:
+			using iterator_category = std::forward_iterator_tag;
+			using value_type = Trajectory;
+			using difference_type = std::ptrdiff_t;
+			using pointer = void;
+			using reference = Trajectory;
+
+			Iterator() = default;
+			Iterator(const TrajectoryRecorder* recorder, size_t offset, size_t remaining) : _recorder(recorder), _offset(offset), _remaining(remaining) {}
+
+			Trajectory operator*() const { return { _recorder->_arena.data() + _offset, _recorder->_config.quantum }; }
+			Iterator& operator++();
+			Iterator operator++(int) { Iterator previous = *this; ++*this; return previous; }
+			bool operator==(const Iterator& other) const { return _remaining == other._remaining; }
+
+		private:
+			const TrajectoryRecorder* _recorder = nullptr;
+			size_t _offset = 0;
+			size_t _remaining = 0;
+		};
+
+		TrajectoryRecorder() = default;
+		TrajectoryRecorder(const Config& config);
+
+		//Called concurrently by the droplet engines
+		void record(const point2f* points, unsigned int count) override;
+
+		//Reading must not overlap with recording
+		Iterator begin() const { return { this, _tail, _count }; }
+		Iterator end() const { return {}; }
+		size_t size() const { return _count; }
+		bool empty() const { return _count == 0; }
+
+		//Droplets received, including those skipped by the sampling
+		unsigned long long droplets() const { return _droplets.load(std::memory_order_relaxed); }
+		//Sampled trajectories overwritten by newer ones or larger than the budget
+		unsigned long long evicted() const { return _evicted; }
+		//Bytes of the arena holding trajectories
+		size_t bytes() const { return _bytes; }
+
+		const Config& config() const { return _config; }
+		void clear();
+
+	private:
+		struct Header
+		{
+			uint32_t count;
+			float x;
+			float y;
+		};
+		static constexpr size_t deltaSize = 2 * sizeof(int16_t);
+
+		static size_t recordSize(unsigned int count) { return sizeof(Header) + (count > 0 ? count - 1 : 0) * deltaSize; }
+		size_t recordSizeAt(size_t offset) const;
+		//Offset of a free span of size bytes, evicting the oldest records as needed
+		size_t allocate(size_t size);
+		void evictOldest();
+
+		const Config _config;
+		std::vector<std::byte> _arena;
+
+		std::mutex _mutex;
+		std::atomic<unsigned long long> _droplets = 0;
+
+		//Records lie in [_tail, _head), or in [_tail, _wrapEnd) then [0, _head) once the ring has wrapped
+		size_t _tail = 0;
+		size_t _head = 0;
+		size_t _wrapEnd = 0;
+		bool _wrapped = false;
+		size_t _count = 0;
+		size_t _bytes = 0;
+		unsigned long long _evicted = 0;
+	};
+}
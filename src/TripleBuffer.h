@@ -0,0 +1,39 @@
+#pragma once
+
+#include <atomic>
+
+namespace ErosionSimulation
+{
+	//Lock-free single producer / single consumer triple buffer: the writer fills back() and publishes it,
+	//the reader always sees the latest complete value in front() and neither side ever waits for the other.
+	template<typename T>
+	class TripleBuffer
+	{
+	public:
+		//Writer side
+		T& back() { return _slots[_back]; }
+		void publish()
+		{
+			_back = _middle.exchange(static_cast<unsigned char>(_back | freshBit), std::memory_order_acq_rel) & indexMask;
+		}
+
+		//Reader side, returns true when a newer value was published since the last call
+		bool update()
+		{
+			if (!(_middle.load(std::memory_order_relaxed) & freshBit))
+				return false;
+			_front = _middle.exchange(_front, std::memory_order_acq_rel) & indexMask;
+			return true;
+		}
+		const T& front() const { return _slots[_front]; }
+
+	private:
+		static constexpr unsigned char freshBit = 4;
+		static constexpr unsigned char indexMask = 3;
+
+		T _slots[3];
+		unsigned char _back = 0;
+		std::atomic<unsigned char> _middle{ 1 };
+		unsigned char _front = 2;
+	};
+}
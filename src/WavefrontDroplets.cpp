@@ -0,0 +1,275 @@
+#include "WavefrontDroplets.h"
+#include "HeightSampler.h"
+#include "CounterRng.h"
+#include <algorithm>
+#include <cmath>
+
+#if defined(_MSC_VER) && defined(EROSION_WAVEFRONT_AVX2)
+#include <intrin.h>
+#include <immintrin.h>
+#endif
+
+namespace ErosionSimulation
+{
+	void advanceLanesScalar(WavefrontLanes& lanes, const WavefrontParams& params)
+	{
+		for (int l = 0; l < wavefrontLanes; l++)
+		{
+			if (!lanes.active[l])
+				continue;
+
+			const float x = lanes.x[l];
+			const float y = lanes.y[l];
+			const HeightSample local = sampleHeightGradient(params.data, params.width, params.height, { x, y });
+
+			//Random directions are only drawn on flat ground, as runDroplet does, so a droplet advances its xorshift state the same way in every engine
+			const float grad_norm = std::sqrt(local.gradient_x * local.gradient_x + local.gradient_y * local.gradient_y);
+			float new_dir_x, new_dir_y;
+			if (grad_norm == 0.f)
+			{
+				new_dir_x = randomDirection(lanes.rng[l]);
+				new_dir_y = randomDirection(lanes.rng[l]);
+			}
+			else
+			{
+				new_dir_x = -local.gradient_x / grad_norm;
+				new_dir_y = -local.gradient_y / grad_norm;
+			}
+
+			float dir_x = params.inertia * lanes.dir_x[l] + (1 - params.inertia) * new_dir_x;
+			float dir_y = params.inertia * lanes.dir_y[l] + (1 - params.inertia) * new_dir_y;
+			const float dir_norm = std::sqrt(dir_x * dir_x + dir_y * dir_y);
+			if (dir_norm == 0.f)
+			{
+				lanes.next_x[l] = x;
+				lanes.next_y[l] = y;
+				lanes.active[l] = 0;
+				continue;
+			}
+			dir_x /= dir_norm;
+			dir_y /= dir_norm;
+			lanes.dir_x[l] = dir_x;
+			lanes.dir_y[l] = dir_y;
+
+			const float next_x = x + dir_x;
+			const float next_y = y + dir_y;
+			lanes.next_x[l] = next_x;
+			lanes.next_y[l] = next_y;
+			if (!(next_x >= 0 && next_x < params.width && next_y >= 0 && next_y < params.height))
+			{
+				lanes.active[l] = 0;
+				continue;
+			}
+
+			const float next_height = sampleHeightGradient(params.data, params.width, params.height, { next_x, next_y }).height;
+			const float hdiff = next_height - local.height;
+			lanes.hdiff[l] = hdiff;
+			lanes.capacity[l] = std::max(-hdiff, params.minSlope) * lanes.speed[l] * lanes.volume[l] * params.capacityFactor;
+		}
+	}
+
+	void finishLanesScalar(WavefrontLanes& lanes, const WavefrontParams& params)
+	{
+		for (int l = 0; l < wavefrontLanes; l++)
+		{
+			if (!lanes.active[l])
+				continue;
+
+			const float speed = lanes.speed[l];
+			lanes.speed[l] = std::sqrt(std::max(0.f, speed * speed - lanes.hdiff[l] * params.gravity));
+			lanes.volume[l] *= params.evaporation;
+			lanes.x[l] = lanes.next_x[l];
+			lanes.y[l] = lanes.next_y[l];
+			lanes.steps[l]++;
+			if (lanes.volume[l] < 1e-3f || lanes.steps[l] >= params.maxDropletSteps)
+				lanes.active[l] = 0;
+		}
+	}
+
+	WavefrontSimulator::WavefrontSimulator(const ErosionGenerator::Config& config, const ErosionBrush& brush, bool useAvx2) :
+		_config(config),
+		_brush(brush),
+		_useAvx2(useAvx2 && avx2Supported())
+	{
+	}
+
+	bool WavefrontSimulator::avx2Supported()
+	{
+#if defined(EROSION_WAVEFRONT_AVX2) && defined(_MSC_VER)
+		int info[4];
+		__cpuid(info, 0);
+		if (info[0] < 7)
+			return false;
+		__cpuid(info, 1);
+		const bool osxsave = (info[2] & (1 << 27)) != 0;
+		if (!osxsave || (_xgetbv(0) & 0x6) != 0x6)
+			return false;
+		__cpuidex(info, 7, 0);
+		return (info[1] & (1 << 5)) != 0;
+#elif defined(EROSION_WAVEFRONT_AVX2)
+		return __builtin_cpu_supports("avx2");
+#else
+		return false;
+#endif
+	}
+
+	void WavefrontSimulator::run(Heightmap& hmap, const point2f* starts, const uint32_t* directionStates, unsigned int count,
+		point2f* trajectories, TrajectorySink* sink, FlowMap* flow, DropletStats& stats) const
+	{
+		const size_t trajectoryCapacity = static_cast<size_t>(std::max(_config.maxDropletSteps, 0)) + 1;
+
+		auto advanceLanes = advanceLanesScalar;
+		auto finishLanes = finishLanesScalar;
+#ifdef EROSION_WAVEFRONT_AVX2
+		//The AVX2 gathers read the 2x2 cell unguarded, maps narrower than 2 cells go through the bounds-checked scalar sampler
+		if (_useAvx2 && hmap._width >= 2 && hmap._height >= 2)
+		{
+			advanceLanes = advanceLanesAvx2;
+			finishLanes = finishLanesAvx2;
+		}
+#endif
+
+		const WavefrontParams params = { hmap._data, static_cast<int>(hmap._width), static_cast<int>(hmap._height),
+			_config.inertia, _config.minSlope, _config.capacityFactor, _config.gravity, _config.evaporation, _config.maxDropletSteps };
+
+		WavefrontLanes lanes{};
+		unsigned int trajectoryLength[wavefrontLanes]{};
+		bool running[wavefrontLanes]{};
+		//Lanes still active when entering finishLanes, only tracked for the instrumentation
+		bool stepping[wavefrontLanes]{};
+		unsigned int next = 0;
+
+		while (true)
+		{
+			//Refill the terminated lanes with new droplets
+			bool anyActive = false;
+			for (int l = 0; l < wavefrontLanes; l++)
+			{
+				while (!lanes.active[l] && next < count)
+				{
+					const point2f start = starts[next];
+					const uint32_t directionState = directionStates[next++];
+					stats.droplets++;
+					if (sink)
+					{
+						trajectories[l * trajectoryCapacity] = start;
+						trajectoryLength[l] = 1;
+					}
+					if (_config.maxDropletSteps <= 0)
+					{
+						stats.counters.terminate(Termination::MaxSteps, 0);
+						if (sink)
+							sink->record(trajectories + l * trajectoryCapacity, 1);
+						continue;
+					}
+
+					lanes.x[l] = start.x;
+					lanes.y[l] = start.y;
+					lanes.dir_x[l] = 0.f;
+					lanes.dir_y[l] = 0.f;
+					lanes.speed[l] = 0.f;
+					lanes.volume[l] = 1.f;
+					lanes.sediment[l] = 0.f;
+					lanes.steps[l] = 0;
+					lanes.rng[l] = directionState;
+					lanes.active[l] = -1;
+				}
+				running[l] = lanes.active[l] != 0;
+				anyActive |= running[l];
+			}
+			if (!anyActive)
+				break;
+
+			advanceLanes(lanes, params);
+
+			//Scattered writes, lane by lane
+			for (int l = 0; l < wavefrontLanes; l++)
+			{
+				if (!lanes.active[l])
+				{
+					if constexpr (instrumentationEnabled)
+					{
+						//Stopped by the advance kernel, a zero direction leaves next inside the map (or NaN)
+						const float next_x = lanes.next_x[l];
+						const float next_y = lanes.next_y[l];
+						if (running[l])
+							stats.counters.terminate(next_x < 0 || next_x >= params.width || next_y < 0 || next_y >= params.height ?
+								Termination::OutOfBounds : Termination::Flat, lanes.steps[l]);
+					}
+					continue;
+				}
+
+				const point2f currentPoint = { lanes.x[l], lanes.y[l] };
+				if (sink)
+					trajectories[l * trajectoryCapacity + trajectoryLength[l]++] = { lanes.next_x[l], lanes.next_y[l] };
+				stats.steps++;
+				if (flow)
+					flow->add(currentPoint, lanes.sediment[l], lanes.volume[l]);
+
+				const float hdiff = lanes.hdiff[l];
+				const float capacity = lanes.capacity[l];
+				float& sediments = lanes.sediment[l];
+				if (hdiff < 0)
+				{
+					if (capacity > sediments)
+					{
+						const auto erosionFactor = std::min((capacity - sediments) * _config.erosionFactor, -hdiff);
+						const auto eroded = _brush.apply(hmap, currentPoint, erosionFactor);
+						sediments += eroded;
+						stats.eroded += eroded;
+						stats.counters.erosion();
+					}
+					else
+					{
+						const auto sedimentsToDeposit = _config.depositFactor * (sediments - capacity);
+						const auto deposited = deposit(hmap, currentPoint, sedimentsToDeposit, -hdiff);
+						sediments -= deposited;
+						stats.deposited += deposited;
+						stats.counters.deposit(sedimentsToDeposit, deposited);
+					}
+				}
+				else if (hdiff == 0.f)
+				{
+					lanes.active[l] = 0;
+					stats.counters.terminate(Termination::Flat, lanes.steps[l] + 1);
+				}
+				else
+				{
+					const auto sedimentsToDeposit = sediments;
+					const auto deposited = deposit(hmap, currentPoint, sedimentsToDeposit, hdiff);
+					sediments -= deposited;
+					stats.deposited += deposited;
+					stats.counters.deposit(sedimentsToDeposit, deposited);
+					if (sediments == 0.f || deposited < 1e-5)
+					{
+						lanes.active[l] = 0;
+						stats.counters.terminate(Termination::Stalled, lanes.steps[l] + 1);
+					}
+				}
+			}
+
+			if constexpr (instrumentationEnabled)
+			{
+				for (int l = 0; l < wavefrontLanes; l++)
+					stepping[l] = lanes.active[l] != 0;
+			}
+
+			finishLanes(lanes, params);
+
+			if constexpr (instrumentationEnabled)
+			{
+				for (int l = 0; l < wavefrontLanes; l++)
+				{
+					if (stepping[l] && !lanes.active[l])
+						stats.counters.terminate(lanes.volume[l] < 1e-3f ? Termination::Evaporated : Termination::MaxSteps, lanes.steps[l]);
+				}
+			}
+
+			for (int l = 0; l < wavefrontLanes; l++)
+			{
+				if (running[l] && !lanes.active[l] && sink)
+					sink->record(trajectories + l * trajectoryCapacity, trajectoryLength[l]);
+			}
+		}
+	}
+}
@@ -0,0 +1,77 @@
+#pragma once
+
+#include <cstdint>
+#include "ErosionGenerator.h"
+
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#define EROSION_WAVEFRONT_AVX2
+#endif
+
+namespace ErosionSimulation
+{
+	constexpr int wavefrontLanes = 8;
+
+	//Structure of arrays state of the droplets advanced in lockstep, active lanes are all ones and terminated lanes zero
+	struct alignas(32) WavefrontLanes
+	{
+		float x[wavefrontLanes];
+		float y[wavefrontLanes];
+		float dir_x[wavefrontLanes];
+		float dir_y[wavefrontLanes];
+		float speed[wavefrontLanes];
+		float volume[wavefrontLanes];
+		float sediment[wavefrontLanes];
+
+		float next_x[wavefrontLanes];
+		float next_y[wavefrontLanes];
+		float hdiff[wavefrontLanes];
+		float capacity[wavefrontLanes];
+
+		uint32_t rng[wavefrontLanes];
+		int32_t steps[wavefrontLanes];
+		int32_t active[wavefrontLanes];
+	};
+
+	struct WavefrontParams
+	{
+		const float* data;
+		int width;
+		int height;
+		float inertia;
+		float minSlope;
+		float capacityFactor;
+		float gravity;
+		float evaporation;
+		int maxDropletSteps;
+	};
+
+	//Samples the current cell, moves the active lanes one step downhill and computes the height difference and capacity,
+	//lanes leaving the map or without direction are terminated
+	void advanceLanesScalar(WavefrontLanes& lanes, const WavefrontParams& params);
+	//Updates speed, volume and position of the lanes still active after erosion, terminating evaporated or exhausted ones
+	void finishLanesScalar(WavefrontLanes& lanes, const WavefrontParams& params);
+#ifdef EROSION_WAVEFRONT_AVX2
+	void advanceLanesAvx2(WavefrontLanes& lanes, const WavefrontParams& params);
+	void finishLanesAvx2(WavefrontLanes& lanes, const WavefrontParams& params);
+#endif
+
+	//Simulates droplets wavefrontLanes at a time: the sampling and the droplet physics run on all lanes at once,
+	//only the scattered erosion and deposition is applied lane by lane.
+	class WavefrontSimulator
+	{
+	public:
+		WavefrontSimulator(const ErosionGenerator::Config& config, const ErosionBrush& brush, bool useAvx2);
+
+		static bool avx2Supported();
+
+		//Runs count droplets from their spawn points and direction states, lanes being refilled in order.
+		//trajectories must hold wavefrontLanes * (maxDropletSteps + 1) points when sink is set. flow, when set, is sized as hmap
+		void run(Heightmap& hmap, const point2f* starts, const uint32_t* directionStates, unsigned int count,
+			point2f* trajectories, TrajectorySink* sink, FlowMap* flow, DropletStats& stats) const;
+
+	private:
+		const ErosionGenerator::Config& _config;
+		const ErosionBrush& _brush;
+		bool _useAvx2;
+	};
+}
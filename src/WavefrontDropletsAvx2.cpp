@@ -0,0 +1,133 @@
+//Compiled with AVX2 enabled, only called when WavefrontSimulator::avx2Supported() and the map is at least 2x2
+#include "WavefrontDroplets.h"
+
+#ifdef EROSION_WAVEFRONT_AVX2
+#include <immintrin.h>
+
+namespace ErosionSimulation
+{
+	namespace
+	{
+		//Bilinear height of the 2x2 cells under (x, y), gathered only for the lanes of mask
+		__m256 sampleAvx2(const WavefrontParams& params, __m256 x, __m256 y, __m256 mask, __m256* gradient_x, __m256* gradient_y)
+		{
+			//Clamped on the integer index as sampleHeightGradient does, a float epsilon is lost on maps wider than 2048 cells
+			const __m256 one = _mm256_set1_ps(1.f);
+			const __m256i x_left = _mm256_min_epi32(_mm256_cvttps_epi32(x), _mm256_set1_epi32(params.width - 2));
+			const __m256i y_top = _mm256_min_epi32(_mm256_cvttps_epi32(y), _mm256_set1_epi32(params.height - 2));
+			const __m256 x_remain = _mm256_min_ps(_mm256_sub_ps(x, _mm256_cvtepi32_ps(x_left)), one);
+			const __m256 y_remain = _mm256_min_ps(_mm256_sub_ps(y, _mm256_cvtepi32_ps(y_top)), one);
+
+			const __m256i index = _mm256_add_epi32(_mm256_mullo_epi32(y_top, _mm256_set1_epi32(params.width)), x_left);
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 top_left = _mm256_mask_i32gather_ps(zero, params.data, index, mask, 4);
+			const __m256 top_right = _mm256_mask_i32gather_ps(zero, params.data + 1, index, mask, 4);
+			const __m256 bottom_left = _mm256_mask_i32gather_ps(zero, params.data + params.width, index, mask, 4);
+			const __m256 bottom_right = _mm256_mask_i32gather_ps(zero, params.data + params.width + 1, index, mask, 4);
+
+			const __m256 x_keep = _mm256_sub_ps(one, x_remain);
+			const __m256 y_keep = _mm256_sub_ps(one, y_remain);
+
+			if (gradient_x)
+			{
+				*gradient_x = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(top_right, top_left), y_keep), _mm256_mul_ps(_mm256_sub_ps(bottom_right, bottom_left), y_remain));
+				*gradient_y = _mm256_add_ps(_mm256_mul_ps(_mm256_sub_ps(bottom_left, top_left), x_keep), _mm256_mul_ps(_mm256_sub_ps(bottom_right, top_right), x_remain));
+			}
+
+			const __m256 top = _mm256_add_ps(_mm256_mul_ps(top_left, x_keep), _mm256_mul_ps(top_right, x_remain));
+			const __m256 bottom = _mm256_add_ps(_mm256_mul_ps(bottom_left, x_keep), _mm256_mul_ps(bottom_right, x_remain));
+			return _mm256_add_ps(_mm256_mul_ps(top, y_keep), _mm256_mul_ps(bottom, y_remain));
+		}
+
+		__m256 randomDirectionAvx2(__m256i& state)
+		{
+			state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 13));
+			state = _mm256_xor_si256(state, _mm256_srli_epi32(state, 17));
+			state = _mm256_xor_si256(state, _mm256_slli_epi32(state, 5));
+			const __m256 unit = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_srli_epi32(state, 8)), _mm256_set1_ps(1.f / 8388608.f));
+			return _mm256_sub_ps(unit, _mm256_set1_ps(1.f));
+		}
+	}
+
+	void advanceLanesAvx2(WavefrontLanes& lanes, const WavefrontParams& params)
+	{
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.f);
+		__m256 active = _mm256_castsi256_ps(_mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.active)));
+
+		const __m256 x = _mm256_load_ps(lanes.x);
+		const __m256 y = _mm256_load_ps(lanes.y);
+		__m256 gradient_x, gradient_y;
+		const __m256 local_height = sampleAvx2(params, x, y, active, &gradient_x, &gradient_y);
+
+		//Downhill direction, or a random one on flat ground. Operations are those of advanceLanesScalar in the same order, divisions included,
+		//so both kernels round identically and the map does not depend on the CPU
+		const __m256 sign = _mm256_set1_ps(-0.f);
+		const __m256 grad_norm = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(gradient_x, gradient_x), _mm256_mul_ps(gradient_y, gradient_y)));
+		const __m256 flat = _mm256_cmp_ps(grad_norm, zero, _CMP_EQ_OQ);
+
+		//Every lane draws, only the active flat ones keep their advanced state, as if they alone had drawn
+		const __m256i rng = _mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.rng));
+		__m256i drawn = rng;
+		const __m256 random_x = randomDirectionAvx2(drawn);
+		const __m256 random_y = randomDirectionAvx2(drawn);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes.rng), _mm256_blendv_epi8(rng, drawn, _mm256_castps_si256(_mm256_and_ps(flat, active))));
+		const __m256 grad_divisor = _mm256_blendv_ps(grad_norm, one, flat);
+		const __m256 new_dir_x = _mm256_blendv_ps(_mm256_div_ps(_mm256_xor_ps(gradient_x, sign), grad_divisor), random_x, flat);
+		const __m256 new_dir_y = _mm256_blendv_ps(_mm256_div_ps(_mm256_xor_ps(gradient_y, sign), grad_divisor), random_y, flat);
+
+		const __m256 inertia = _mm256_set1_ps(params.inertia);
+		const __m256 steering = _mm256_set1_ps(1 - params.inertia);
+		__m256 dir_x = _mm256_add_ps(_mm256_mul_ps(inertia, _mm256_load_ps(lanes.dir_x)), _mm256_mul_ps(steering, new_dir_x));
+		__m256 dir_y = _mm256_add_ps(_mm256_mul_ps(inertia, _mm256_load_ps(lanes.dir_y)), _mm256_mul_ps(steering, new_dir_y));
+		const __m256 dir_norm = _mm256_sqrt_ps(_mm256_add_ps(_mm256_mul_ps(dir_x, dir_x), _mm256_mul_ps(dir_y, dir_y)));
+		const __m256 stopped = _mm256_cmp_ps(dir_norm, zero, _CMP_EQ_OQ);
+		const __m256 dir_divisor = _mm256_blendv_ps(dir_norm, one, stopped);
+		dir_x = _mm256_div_ps(dir_x, dir_divisor);
+		dir_y = _mm256_div_ps(dir_y, dir_divisor);
+
+		const __m256 next_x = _mm256_add_ps(x, dir_x);
+		const __m256 next_y = _mm256_add_ps(y, dir_y);
+		const __m256 inside = _mm256_and_ps(
+			_mm256_and_ps(_mm256_cmp_ps(next_x, zero, _CMP_GE_OQ), _mm256_cmp_ps(next_x, _mm256_set1_ps(static_cast<float>(params.width)), _CMP_LT_OQ)),
+			_mm256_and_ps(_mm256_cmp_ps(next_y, zero, _CMP_GE_OQ), _mm256_cmp_ps(next_y, _mm256_set1_ps(static_cast<float>(params.height)), _CMP_LT_OQ)));
+		active = _mm256_andnot_ps(stopped, _mm256_and_ps(active, inside));
+
+		const __m256 next_height = sampleAvx2(params, next_x, next_y, active, nullptr, nullptr);
+		const __m256 hdiff = _mm256_sub_ps(next_height, local_height);
+		//max_ps(b, a) picks a on ties like std::max(a, b)
+		const __m256 slope = _mm256_max_ps(_mm256_set1_ps(params.minSlope), _mm256_xor_ps(hdiff, sign));
+		const __m256 capacity = _mm256_mul_ps(_mm256_mul_ps(_mm256_mul_ps(slope, _mm256_load_ps(lanes.speed)), _mm256_load_ps(lanes.volume)), _mm256_set1_ps(params.capacityFactor));
+
+		_mm256_store_ps(lanes.dir_x, dir_x);
+		_mm256_store_ps(lanes.dir_y, dir_y);
+		_mm256_store_ps(lanes.next_x, next_x);
+		_mm256_store_ps(lanes.next_y, next_y);
+		_mm256_store_ps(lanes.hdiff, hdiff);
+		_mm256_store_ps(lanes.capacity, capacity);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes.active), _mm256_castps_si256(active));
+	}
+
+	void finishLanesAvx2(WavefrontLanes& lanes, const WavefrontParams& params)
+	{
+		const __m256 active = _mm256_castsi256_ps(_mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.active)));
+
+		const __m256 speed = _mm256_load_ps(lanes.speed);
+		const __m256 kinetic = _mm256_sub_ps(_mm256_mul_ps(speed, speed), _mm256_mul_ps(_mm256_load_ps(lanes.hdiff), _mm256_set1_ps(params.gravity)));
+		const __m256 new_speed = _mm256_sqrt_ps(_mm256_max_ps(kinetic, _mm256_setzero_ps()));
+		const __m256 volume = _mm256_mul_ps(_mm256_load_ps(lanes.volume), _mm256_set1_ps(params.evaporation));
+
+		//active lanes are all ones, subtracting them counts a step
+		const __m256i steps = _mm256_sub_epi32(_mm256_load_si256(reinterpret_cast<const __m256i*>(lanes.steps)), _mm256_castps_si256(active));
+		const __m256 evaporated = _mm256_cmp_ps(volume, _mm256_set1_ps(1e-3f), _CMP_LT_OQ);
+		const __m256 exhausted = _mm256_castsi256_ps(_mm256_cmpgt_epi32(steps, _mm256_set1_epi32(params.maxDropletSteps - 1)));
+
+		_mm256_store_ps(lanes.speed, _mm256_blendv_ps(speed, new_speed, active));
+		_mm256_store_ps(lanes.volume, _mm256_blendv_ps(_mm256_load_ps(lanes.volume), volume, active));
+		_mm256_store_ps(lanes.x, _mm256_blendv_ps(_mm256_load_ps(lanes.x), _mm256_load_ps(lanes.next_x), active));
+		_mm256_store_ps(lanes.y, _mm256_blendv_ps(_mm256_load_ps(lanes.y), _mm256_load_ps(lanes.next_y), active));
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes.steps), steps);
+		_mm256_store_si256(reinterpret_cast<__m256i*>(lanes.active), _mm256_castps_si256(_mm256_andnot_ps(_mm256_or_ps(evaporated, exhausted), active)));
+	}
+}
+#endif